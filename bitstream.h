@@ -1,20 +1,105 @@
 #ifndef _BITSTREAM_H_
 #define _BITSTREAM_H_
 
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * bitpos is the position of the reader and may be set directly, the cache
+ * holds the 64 bits from byte cache_pos / 8 on and is refilled whenever a
+ * read leaves [cache_pos, cache_end). A zero initialized cache is empty.
+ * Bytes after length read as zero.
+ */
 typedef struct
 {
 	const uint8_t *data;
 	unsigned int length;
 	unsigned int bitpos;
+	uint64_t cache;
+	unsigned int cache_pos;
+	unsigned int cache_end;
 } bitstream;
 
-uint32_t show_bits(bitstream *bs, int n);
-uint32_t get_bits(bitstream *bs, int n);
-int bytealign(bitstream *bs);
-int  bytealigned(bitstream *bs, int nbit);
-void flush_bits(bitstream *bs, int nbit);
+static inline void bitstream_fill(bitstream *bs)
+{
+	unsigned int byte = bs->bitpos / 8;
+
+	if (byte + 8 <= bs->length)
+	{
+		uint64_t w;
+		memcpy(&w, bs->data + byte, 8);
+		bs->cache = __builtin_bswap64(w);
+	}
+	else
+	{
+		unsigned int i;
+		bs->cache = 0;
+		for (i = 0; i < 8 && byte + i < bs->length; i++)
+			bs->cache |= (uint64_t)bs->data[byte + i] << (56 - 8 * i);
+	}
+
+	bs->cache_pos = byte * 8;
+	bs->cache_end = byte * 8 + 64;
+}
+
+// n <= 32, the double shift keeps n == 0 defined
+static inline uint32_t bitstream_peek(bitstream *bs, unsigned int bitpos, int n)
+{
+	if (bitpos < bs->cache_pos || bitpos + n > bs->cache_end)
+	{
+		unsigned int save = bs->bitpos;
+		bs->bitpos = bitpos;
+		bitstream_fill(bs);
+		bs->bitpos = save;
+	}
+
+	return (bs->cache << (bitpos - bs->cache_pos)) >> 1 >> (63 - n);
+}
+
+static inline uint32_t show_bits(bitstream *bs, int n)
+{
+	return bitstream_peek(bs, bs->bitpos, n);
+}
+
+static inline uint32_t show_bits_aligned(bitstream *bs, int n, int aligned)
+{
+	return bitstream_peek(bs, aligned ? (bs->bitpos + 7) & ~7 : bs->bitpos, n);
+}
+
+static inline uint32_t get_bits(bitstream *bs, int n)
+{
+	uint32_t bits = bitstream_peek(bs, bs->bitpos, n);
+	bs->bitpos += n;
+	return bits;
+}
+
+static inline void flush_bits(bitstream *bs, int nbit)
+{
+	bs->bitpos += nbit;
+}
+
+static inline int bytealign(bitstream *bs)
+{
+	bs->bitpos = (bs->bitpos + 7) & ~7;
+	if (bs->bitpos > bs->length * 8)
+	{
+		bs->bitpos = bs->length * 8;
+		return 1;
+	}
+	return 0;
+}
+
+static inline int bytealigned(bitstream *bs, int nbit)
+{
+	return ((bs->bitpos + nbit) & 7) == 0;
+}
+
+static inline int bits_left(bitstream *bs)
+{
+	return bs->bitpos / 8 < bs->length;
+}
+
 int nextbits_bytealigned(bitstream *bs, int nbit);
-int bits_left(bitstream *bs);
 int decode012(bitstream *bs);
 
 #endif
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Runs random show/get/skip/seek/align sequences on the cached reader of
+ * bitstream.h and on the byte loop reader it replaced, then times both
+ * on a VLC like sequence of reads.
+ *
+ * The old reader read whatever followed length, the new one reads zeros,
+ * so the reference gets a zero padded copy of the data and the new reader
+ * a copy padded with 0xff. The old show_bits_aligned() took the bits per
+ * byte from bs->bitpos instead of its own position and returned wrong bits
+ * for unaligned reads that cross a byte, the reference for show_bits is a
+ * get_bits on a copy, the old one is only counted.
+ *
+ *   bitstream_fuzz [operations]
+ *
+ * Exits with 1 on the first mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bitstream.h"
+
+#define MAX_LENGTH 256
+#define PADDING 16
+#define BENCH_LENGTH (1024 * 1024)
+
+typedef struct
+{
+	const uint8_t *data;
+	unsigned int length;
+	unsigned int bitpos;
+} ref_bitstream;
+
+// the reader before the cache, as it was in mpeg4.c
+
+static uint32_t ref_show_bits_aligned(ref_bitstream *bs, int n, int aligned)
+{
+    uint32_t bits = 0;
+    int remaining_bits = n;
+    int bitpos;
+
+    if(aligned)
+        bitpos = (bs->bitpos+7) & ~7;
+    else
+        bitpos = bs->bitpos;
+
+    while (remaining_bits > 0)
+    {
+        int bits_in_current_byte = 8 - (bs->bitpos & 7);
+
+        int trash_bits = 0;
+        if (remaining_bits < bits_in_current_byte)
+                trash_bits = bits_in_current_byte - remaining_bits;
+
+        int useful_bits = bits_in_current_byte - trash_bits;
+
+        bits = (bits << useful_bits) | (bs->data[bitpos / 8] >> trash_bits);
+
+        remaining_bits -= useful_bits;
+        bitpos += useful_bits;
+    }
+
+    return bits & ((1 << n) - 1);
+}
+
+static uint32_t ref_get_bits(ref_bitstream *bs, int n)
+{
+    uint32_t bits = 0;
+    int remaining_bits = n;
+
+    while (remaining_bits > 0)
+    {
+            int bits_in_current_byte = 8 - (bs->bitpos & 7);
+
+            int trash_bits = 0;
+            if (remaining_bits < bits_in_current_byte)
+                    trash_bits = bits_in_current_byte - remaining_bits;
+
+            int useful_bits = bits_in_current_byte - trash_bits;
+
+            bits = (bits << useful_bits) | (bs->data[bs->bitpos / 8] >> trash_bits);
+
+            remaining_bits -= useful_bits;
+            bs->bitpos += useful_bits;
+    }
+
+    return bits & ((1 << n) - 1);
+}
+
+static int ref_bytealign(ref_bitstream *bs)
+{
+    bs->bitpos = ((bs->bitpos+7) >> 3) << 3;
+    if(bs->bitpos > bs->length * 8)
+    {
+        bs->bitpos = bs->length * 8;
+        return 1;
+    }
+    return 0;
+}
+
+// the old mask is undefined for 32 bits, read those in two halves
+static uint32_t ref_read(ref_bitstream *bs, int n)
+{
+	if (n == 32)
+	{
+		uint32_t high = ref_get_bits(bs, 16);
+		return high << 16 | ref_get_bits(bs, 16);
+	}
+
+	return n ? ref_get_bits(bs, n) : 0;
+}
+
+static uint32_t ref_show(ref_bitstream *bs, int n, int aligned)
+{
+	ref_bitstream copy = *bs;
+	if (aligned)
+		copy.bitpos = (copy.bitpos + 7) & ~7;
+	return ref_read(&copy, n);
+}
+
+static uint64_t now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static int fail(const char *op, unsigned long i, unsigned int bitpos, int n, uint32_t got, uint32_t expected)
+{
+	fprintf(stderr, "operation %lu: %s(%d) at bit %u returned 0x%08x instead of 0x%08x\n",
+	        i, op, n, bitpos, got, expected);
+	return 0;
+}
+
+static int fuzz(unsigned long operations)
+{
+	static uint8_t data[MAX_LENGTH + PADDING], ref_data[MAX_LENGTH + PADDING];
+	unsigned long i, old_show = 0, old_show_wrong = 0;
+	bitstream bs, saved;
+	ref_bitstream ref, ref_saved;
+
+	memset(&bs, 0, sizeof(bs));
+	memset(&ref, 0, sizeof(ref));
+
+	for (i = 0; i < operations; i++)
+	{
+		// a new buffer every now and then
+		if (i % 1000 == 0)
+		{
+			unsigned int j, length = 1 + rand() % MAX_LENGTH;
+			for (j = 0; j < length; j++)
+				data[j] = ref_data[j] = rand();
+			memset(data + length, 0xff, PADDING);
+			memset(ref_data + length, 0x00, PADDING);
+
+			memset(&bs, 0, sizeof(bs));
+			bs.data = data;
+			bs.length = length;
+			ref.data = ref_data;
+			ref.length = length;
+			ref.bitpos = 0;
+			saved = bs;
+			ref_saved = ref;
+		}
+
+		// stay where the zero padded reference can follow
+		if (bs.bitpos > bs.length * 8 + 8)
+			bs.bitpos = ref.bitpos = rand() % (bs.length * 8 + 1);
+
+		int n = rand() % 33;
+		uint32_t got, expected;
+		unsigned int bitpos = bs.bitpos;
+
+		switch (rand() % 8)
+		{
+		case 0:
+		case 1:
+			got = get_bits(&bs, n);
+			expected = ref_read(&ref, n);
+			if (got != expected)
+				return fail("get_bits", i, bitpos, n, got, expected);
+			break;
+
+		case 2:
+			got = show_bits(&bs, n);
+			expected = ref_show(&ref, n, 0);
+			if (got != expected)
+				return fail("show_bits", i, bitpos, n, got, expected);
+			if (n > 0 && n < 32)
+			{
+				old_show++;
+				old_show_wrong += ref_show_bits_aligned(&ref, n, 0) != expected;
+			}
+			break;
+
+		case 3:
+			got = show_bits_aligned(&bs, n, 1);
+			expected = ref_show(&ref, n, 1);
+			if (got != expected)
+				return fail("show_bits_aligned", i, bitpos, n, got, expected);
+			break;
+
+		case 4:
+			flush_bits(&bs, n);
+			ref.bitpos += n;
+			break;
+
+		case 5:
+			got = bytealign(&bs);
+			expected = ref_bytealign(&ref);
+			if (got != expected || bs.bitpos != ref.bitpos)
+				return fail("bytealign", i, bitpos, 0, bs.bitpos, ref.bitpos);
+			break;
+
+		case 6:
+			// callers seek by assigning bitpos
+			bs.bitpos = ref.bitpos = rand() % (bs.length * 8 + 1);
+			break;
+
+		case 7:
+			// and save and restore the whole struct
+			if (rand() & 1)
+			{
+				saved = bs;
+				ref_saved = ref;
+			}
+			else
+			{
+				bs = saved;
+				ref = ref_saved;
+			}
+			break;
+		}
+
+		if (bs.bitpos != ref.bitpos)
+			return fail("bitpos", i, bitpos, n, bs.bitpos, ref.bitpos);
+	}
+
+	printf("%lu operations match, the old show_bits was wrong in %lu of %lu reads\n",
+	       operations, old_show_wrong, old_show);
+	return 1;
+}
+
+// mostly short reads with a show before each, like the VLC decoders
+static void bench(void)
+{
+	static const int pattern[16] = { 1, 9, 3, 6, 1, 2, 12, 4, 1, 5, 7, 2, 16, 3, 1, 8 };
+	uint8_t *data = malloc(BENCH_LENGTH + PADDING);
+	unsigned int i, reads = 0;
+	uint32_t sum_new = 0, sum_ref = 0;
+	uint64_t t_new, t_ref;
+
+	if (!data)
+		return;
+
+	for (i = 0; i < BENCH_LENGTH + PADDING; i++)
+		data[i] = rand();
+
+	bitstream bs = { .data = data, .length = BENCH_LENGTH };
+	t_new = now();
+	for (i = 0; bs.bitpos < (BENCH_LENGTH - 8) * 8; i++)
+	{
+		int n = pattern[i % 16];
+		sum_new += show_bits(&bs, 16);
+		sum_new += get_bits(&bs, n);
+	}
+	t_new = now() - t_new;
+	reads = i;
+
+	ref_bitstream ref = { .data = data, .length = BENCH_LENGTH };
+	t_ref = now();
+	for (i = 0; ref.bitpos < (BENCH_LENGTH - 8) * 8; i++)
+	{
+		int n = pattern[i % 16];
+		sum_ref += ref_show(&ref, 16, 0);
+		sum_ref += ref_get_bits(&ref, n);
+	}
+	t_ref = now() - t_ref;
+
+	printf("%u show+get pairs: old %.2f ns, new %.2f ns, %.2fx%s\n", reads,
+	       (double)t_ref / reads, (double)t_new / reads, (double)t_ref / t_new,
+	       sum_new != sum_ref ? " (results differ!)" : "");
+	free(data);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long operations = argc > 1 ? strtoul(argv[1], NULL, 0) : 4000000;
+
+	srand(1);
+	if (!fuzz(operations))
+		return 1;
+
+	bench();
+	return 0;
+}
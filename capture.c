@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vdpau_private.h"
+#include "capture.h"
+#include "trace.h"
+
+/*
+ * API capture, enabled with VDPAU_CAPTURE=<file>.
+ *
+ * vdp_get_proc_address() hands out the wrappers below instead of the
+ * real entry points, every call is timed and appended to the capture
+ * file. vdpau_replay drives the library from such a file.
+ *
+ * With tracing enabled the same wrappers emit a trace event per call.
+ */
+
+static struct
+{
+	FILE *file;
+	uint64_t start;
+	pthread_mutex_t lock;
+} capture = { .file = NULL, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void capture_close(void)
+{
+	pthread_mutex_lock(&capture.lock);
+	if (capture.file)
+		fclose(capture.file);
+	capture.file = NULL;
+	pthread_mutex_unlock(&capture.lock);
+}
+
+int capture_open(const char *filename)
+{
+	capture_header_t header = { .magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION };
+	static int registered;
+
+	pthread_mutex_lock(&capture.lock);
+	if (capture.file)
+		goto out;
+
+	capture.file = fopen(filename, "wb");
+	if (!capture.file)
+	{
+		printf("vdpau capture: can not open %s\n", filename);
+		goto out;
+	}
+
+	fwrite(&header, sizeof(header), 1, capture.file);
+	capture.start = get_time();
+
+	// players rarely destroy the device before exit
+	if (!registered)
+		atexit(capture_close);
+	registered = 1;
+
+out:
+	pthread_mutex_unlock(&capture.lock);
+	return capture.file != NULL;
+}
+
+int capture_enabled(void)
+{
+	return capture.file != NULL;
+}
+
+// the record has to be written in one go, calls can come from several threads
+static void capture_begin(VdpFuncId func_id, uint64_t start, VdpStatus status, VdpHandle handle, uint32_t size)
+{
+	capture_record_t rec;
+	uint64_t now = get_time();
+
+	rec.func_id = func_id;
+	rec.size = size;
+	rec.time = start - capture.start;
+	rec.duration = now - start;
+	rec.status = status;
+	rec.handle = handle;
+
+	pthread_mutex_lock(&capture.lock);
+	if (capture.file)
+		fwrite(&rec, sizeof(rec), 1, capture.file);
+}
+
+static void capture_data(const void *data, uint32_t size)
+{
+	if (capture.file && size)
+		fwrite(data, size, 1, capture.file);
+}
+
+static void capture_end(void)
+{
+	pthread_mutex_unlock(&capture.lock);
+}
+
+static void capture_call(VdpFuncId func_id, uint64_t start, VdpStatus status, VdpHandle handle, const void *data, uint32_t size)
+{
+	if (!capture.file)
+		return;
+
+	capture_begin(func_id, start, status, handle, size);
+	capture_data(data, size);
+	capture_end();
+}
+
+/*
+ * Entry points recorded with their timing only.
+ */
+#define CAPTURE_TIMED(id, fn, params, args) \
+static VdpStatus capture_##fn params \
+{ \
+	uint64_t start = get_time(); \
+	VdpStatus ret = vdp_##fn args; \
+	TRACE_END(start, #fn); \
+	capture_call(id, start, ret, VDP_INVALID_HANDLE, NULL, 0); \
+	return ret; \
+}
+
+CAPTURE_TIMED(VDP_FUNC_ID_GET_API_VERSION, get_api_version,
+	(uint32_t *api_version), (api_version))
+CAPTURE_TIMED(VDP_FUNC_ID_GET_INFORMATION_STRING, get_information_string,
+	(char const **information_string), (information_string))
+CAPTURE_TIMED(VDP_FUNC_ID_GENERATE_CSC_MATRIX, generate_csc_matrix,
+	(VdpProcamp *procamp, VdpColorStandard standard, VdpCSCMatrix *csc_matrix),
+	(procamp, standard, csc_matrix))
+CAPTURE_TIMED(VDP_FUNC_ID_PREEMPTION_CALLBACK_REGISTER, preemption_callback_register,
+	(VdpDevice device, VdpPreemptionCallback callback, void *context),
+	(device, callback, context))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_SURFACE_QUERY_CAPABILITIES, video_surface_query_capabilities,
+	(VdpDevice device, VdpChromaType surface_chroma_type, VdpBool *is_supported, uint32_t *max_width, uint32_t *max_height),
+	(device, surface_chroma_type, is_supported, max_width, max_height))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_SURFACE_QUERY_GET_PUT_BITS_Y_CB_CR_CAPABILITIES, video_surface_query_get_put_bits_y_cb_cr_capabilities,
+	(VdpDevice device, VdpChromaType surface_chroma_type, VdpYCbCrFormat bits_ycbcr_format, VdpBool *is_supported),
+	(device, surface_chroma_type, bits_ycbcr_format, is_supported))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_SURFACE_GET_PARAMETERS, video_surface_get_parameters,
+	(VdpVideoSurface surface, VdpChromaType *chroma_type, uint32_t *width, uint32_t *height),
+	(surface, chroma_type, width, height))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_QUERY_CAPABILITIES, output_surface_query_capabilities,
+	(VdpDevice device, VdpRGBAFormat surface_rgba_format, VdpBool *is_supported, uint32_t *max_width, uint32_t *max_height),
+	(device, surface_rgba_format, is_supported, max_width, max_height))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_QUERY_GET_PUT_BITS_NATIVE_CAPABILITIES, output_surface_query_get_put_bits_native_capabilities,
+	(VdpDevice device, VdpRGBAFormat surface_rgba_format, VdpBool *is_supported),
+	(device, surface_rgba_format, is_supported))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_QUERY_PUT_BITS_INDEXED_CAPABILITIES, output_surface_query_put_bits_indexed_capabilities,
+	(VdpDevice device, VdpRGBAFormat surface_rgba_format, VdpIndexedFormat bits_indexed_format, VdpColorTableFormat color_table_format, VdpBool *is_supported),
+	(device, surface_rgba_format, bits_indexed_format, color_table_format, is_supported))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_QUERY_PUT_BITS_Y_CB_CR_CAPABILITIES, output_surface_query_put_bits_y_cb_cr_capabilities,
+	(VdpDevice device, VdpRGBAFormat surface_rgba_format, VdpYCbCrFormat bits_ycbcr_format, VdpBool *is_supported),
+	(device, surface_rgba_format, bits_ycbcr_format, is_supported))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_CREATE, output_surface_create,
+	(VdpDevice device, VdpRGBAFormat rgba_format, uint32_t width, uint32_t height, VdpOutputSurface *surface),
+	(device, rgba_format, width, height, surface))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_DESTROY, output_surface_destroy,
+	(VdpOutputSurface surface), (surface))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_GET_PARAMETERS, output_surface_get_parameters,
+	(VdpOutputSurface surface, VdpRGBAFormat *rgba_format, uint32_t *width, uint32_t *height),
+	(surface, rgba_format, width, height))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_GET_BITS_NATIVE, output_surface_get_bits_native,
+	(VdpOutputSurface surface, VdpRect const *source_rect, void *const *destination_data, uint32_t const *destination_pitches),
+	(surface, source_rect, destination_data, destination_pitches))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_PUT_BITS_NATIVE, output_surface_put_bits_native,
+	(VdpOutputSurface surface, void const *const *source_data, uint32_t const *source_pitches, VdpRect const *destination_rect),
+	(surface, source_data, source_pitches, destination_rect))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_PUT_BITS_INDEXED, output_surface_put_bits_indexed,
+	(VdpOutputSurface surface, VdpIndexedFormat source_indexed_format, void const *const *source_data, uint32_t const *source_pitch, VdpRect const *destination_rect, VdpColorTableFormat color_table_format, void const *color_table),
+	(surface, source_indexed_format, source_data, source_pitch, destination_rect, color_table_format, color_table))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_PUT_BITS_Y_CB_CR, output_surface_put_bits_y_cb_cr,
+	(VdpOutputSurface surface, VdpYCbCrFormat source_ycbcr_format, void const *const *source_data, uint32_t const *source_pitches, VdpRect const *destination_rect, VdpCSCMatrix const *csc_matrix),
+	(surface, source_ycbcr_format, source_data, source_pitches, destination_rect, csc_matrix))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_RENDER_OUTPUT_SURFACE, output_surface_render_output_surface,
+	(VdpOutputSurface destination_surface, VdpRect const *destination_rect, VdpOutputSurface source_surface, VdpRect const *source_rect, VdpColor const *colors, VdpOutputSurfaceRenderBlendState const *blend_state, uint32_t flags),
+	(destination_surface, destination_rect, source_surface, source_rect, colors, blend_state, flags))
+CAPTURE_TIMED(VDP_FUNC_ID_OUTPUT_SURFACE_RENDER_BITMAP_SURFACE, output_surface_render_bitmap_surface,
+	(VdpOutputSurface destination_surface, VdpRect const *destination_rect, VdpBitmapSurface source_surface, VdpRect const *source_rect, VdpColor const *colors, VdpOutputSurfaceRenderBlendState const *blend_state, uint32_t flags),
+	(destination_surface, destination_rect, source_surface, source_rect, colors, blend_state, flags))
+CAPTURE_TIMED(VDP_FUNC_ID_BITMAP_SURFACE_QUERY_CAPABILITIES, bitmap_surface_query_capabilities,
+	(VdpDevice device, VdpRGBAFormat surface_rgba_format, VdpBool *is_supported, uint32_t *max_width, uint32_t *max_height),
+	(device, surface_rgba_format, is_supported, max_width, max_height))
+CAPTURE_TIMED(VDP_FUNC_ID_BITMAP_SURFACE_CREATE, bitmap_surface_create,
+	(VdpDevice device, VdpRGBAFormat rgba_format, uint32_t width, uint32_t height, VdpBool frequently_accessed, VdpBitmapSurface *surface),
+	(device, rgba_format, width, height, frequently_accessed, surface))
+CAPTURE_TIMED(VDP_FUNC_ID_BITMAP_SURFACE_DESTROY, bitmap_surface_destroy,
+	(VdpBitmapSurface surface), (surface))
+CAPTURE_TIMED(VDP_FUNC_ID_BITMAP_SURFACE_GET_PARAMETERS, bitmap_surface_get_parameters,
+	(VdpBitmapSurface surface, VdpRGBAFormat *rgba_format, uint32_t *width, uint32_t *height, VdpBool *frequently_accessed),
+	(surface, rgba_format, width, height, frequently_accessed))
+CAPTURE_TIMED(VDP_FUNC_ID_BITMAP_SURFACE_PUT_BITS_NATIVE, bitmap_surface_put_bits_native,
+	(VdpBitmapSurface surface, void const *const *source_data, uint32_t const *source_pitches, VdpRect const *destination_rect),
+	(surface, source_data, source_pitches, destination_rect))
+CAPTURE_TIMED(VDP_FUNC_ID_DECODER_QUERY_CAPABILITIES, decoder_query_capabilities,
+	(VdpDevice device, VdpDecoderProfile profile, VdpBool *is_supported, uint32_t *max_level, uint32_t *max_macroblocks, uint32_t *max_width, uint32_t *max_height),
+	(device, profile, is_supported, max_level, max_macroblocks, max_width, max_height))
+CAPTURE_TIMED(VDP_FUNC_ID_DECODER_GET_PARAMETERS, decoder_get_parameters,
+	(VdpDecoder decoder, VdpDecoderProfile *profile, uint32_t *width, uint32_t *height),
+	(decoder, profile, width, height))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_QUERY_FEATURE_SUPPORT, video_mixer_query_feature_support,
+	(VdpDevice device, VdpVideoMixerFeature feature, VdpBool *is_supported),
+	(device, feature, is_supported))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_QUERY_PARAMETER_SUPPORT, video_mixer_query_parameter_support,
+	(VdpDevice device, VdpVideoMixerParameter parameter, VdpBool *is_supported),
+	(device, parameter, is_supported))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_QUERY_ATTRIBUTE_SUPPORT, video_mixer_query_attribute_support,
+	(VdpDevice device, VdpVideoMixerAttribute attribute, VdpBool *is_supported),
+	(device, attribute, is_supported))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_QUERY_PARAMETER_VALUE_RANGE, video_mixer_query_parameter_value_range,
+	(VdpDevice device, VdpVideoMixerParameter parameter, void *min_value, void *max_value),
+	(device, parameter, min_value, max_value))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_QUERY_ATTRIBUTE_VALUE_RANGE, video_mixer_query_attribute_value_range,
+	(VdpDevice device, VdpVideoMixerAttribute attribute, void *min_value, void *max_value),
+	(device, attribute, min_value, max_value))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_CREATE, video_mixer_create,
+	(VdpDevice device, uint32_t feature_count, VdpVideoMixerFeature const *features, uint32_t parameter_count, VdpVideoMixerParameter const *parameters, void const *const *parameter_values, VdpVideoMixer *mixer),
+	(device, feature_count, features, parameter_count, parameters, parameter_values, mixer))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_SET_FEATURE_ENABLES, video_mixer_set_feature_enables,
+	(VdpVideoMixer mixer, uint32_t feature_count, VdpVideoMixerFeature const *features, VdpBool const *feature_enables),
+	(mixer, feature_count, features, feature_enables))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_SET_ATTRIBUTE_VALUES, video_mixer_set_attribute_values,
+	(VdpVideoMixer mixer, uint32_t attribute_count, VdpVideoMixerAttribute const *attributes, void const *const *attribute_values),
+	(mixer, attribute_count, attributes, attribute_values))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_GET_FEATURE_SUPPORT, video_mixer_get_feature_support,
+	(VdpVideoMixer mixer, uint32_t feature_count, VdpVideoMixerFeature const *features, VdpBool *feature_supports),
+	(mixer, feature_count, features, feature_supports))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_GET_FEATURE_ENABLES, video_mixer_get_feature_enables,
+	(VdpVideoMixer mixer, uint32_t feature_count, VdpVideoMixerFeature const *features, VdpBool *feature_enables),
+	(mixer, feature_count, features, feature_enables))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_GET_PARAMETER_VALUES, video_mixer_get_parameter_values,
+	(VdpVideoMixer mixer, uint32_t parameter_count, VdpVideoMixerParameter const *parameters, void *const *parameter_values),
+	(mixer, parameter_count, parameters, parameter_values))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_GET_ATTRIBUTE_VALUES, video_mixer_get_attribute_values,
+	(VdpVideoMixer mixer, uint32_t attribute_count, VdpVideoMixerAttribute const *attributes, void *const *attribute_values),
+	(mixer, attribute_count, attributes, attribute_values))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_DESTROY, video_mixer_destroy,
+	(VdpVideoMixer mixer), (mixer))
+CAPTURE_TIMED(VDP_FUNC_ID_VIDEO_MIXER_RENDER, video_mixer_render,
+	(VdpVideoMixer mixer, VdpOutputSurface background_surface, VdpRect const *background_source_rect, VdpVideoMixerPictureStructure current_picture_structure, uint32_t video_surface_past_count, VdpVideoSurface const *video_surface_past, VdpVideoSurface video_surface_current, uint32_t video_surface_future_count, VdpVideoSurface const *video_surface_future, VdpRect const *video_source_rect, VdpOutputSurface destination_surface, VdpRect const *destination_rect, VdpRect const *destination_video_rect, uint32_t layer_count, VdpLayer const *layers),
+	(mixer, background_surface, background_source_rect, current_picture_structure, video_surface_past_count, video_surface_past, video_surface_current, video_surface_future_count, video_surface_future, video_source_rect, destination_surface, destination_rect, destination_video_rect, layer_count, layers))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_TARGET_CREATE_X11, presentation_queue_target_create_x11,
+	(VdpDevice device, Drawable drawable, VdpPresentationQueueTarget *target),
+	(device, drawable, target))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_TARGET_DESTROY, presentation_queue_target_destroy,
+	(VdpPresentationQueueTarget presentation_queue_target), (presentation_queue_target))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_CREATE, presentation_queue_create,
+	(VdpDevice device, VdpPresentationQueueTarget presentation_queue_target, VdpPresentationQueue *presentation_queue),
+	(device, presentation_queue_target, presentation_queue))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_DESTROY, presentation_queue_destroy,
+	(VdpPresentationQueue presentation_queue), (presentation_queue))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_SET_BACKGROUND_COLOR, presentation_queue_set_background_color,
+	(VdpPresentationQueue presentation_queue, VdpColor *const background_color),
+	(presentation_queue, background_color))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_GET_BACKGROUND_COLOR, presentation_queue_get_background_color,
+	(VdpPresentationQueue presentation_queue, VdpColor *const background_color),
+	(presentation_queue, background_color))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_GET_TIME, presentation_queue_get_time,
+	(VdpPresentationQueue presentation_queue, VdpTime *current_time),
+	(presentation_queue, current_time))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_DISPLAY, presentation_queue_display,
+	(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, uint32_t clip_width, uint32_t clip_height, VdpTime earliest_presentation_time),
+	(presentation_queue, surface, clip_width, clip_height, earliest_presentation_time))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_BLOCK_UNTIL_SURFACE_IDLE, presentation_queue_block_until_surface_idle,
+	(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, VdpTime *first_presentation_time),
+	(presentation_queue, surface, first_presentation_time))
+CAPTURE_TIMED(VDP_FUNC_ID_PRESENTATION_QUEUE_QUERY_SURFACE_STATUS, presentation_queue_query_surface_status,
+	(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, VdpPresentationQueueStatus *status, VdpTime *first_presentation_time),
+	(presentation_queue, surface, status, first_presentation_time))
+
+/*
+ * Entry points replayed by vdpau_replay, see capture.h for the payloads.
+ */
+static VdpStatus capture_device_destroy(VdpDevice device)
+{
+	uint64_t start = get_time();
+	VdpStatus status = vdp_device_destroy(device);
+	TRACE_END(start, "device_destroy");
+	capture_call(VDP_FUNC_ID_DEVICE_DESTROY, start, status, VDP_INVALID_HANDLE, NULL, 0);
+
+	capture_close();
+	return status;
+}
+
+static VdpStatus capture_video_surface_create(VdpDevice device, VdpChromaType chroma_type, uint32_t width, uint32_t height, VdpVideoSurface *surface)
+{
+	capture_surface_create_t args = { .chroma_type = chroma_type, .width = width, .height = height };
+	uint64_t start = get_time();
+	VdpStatus status = vdp_video_surface_create(device, chroma_type, width, height, surface);
+	TRACE_END(start, "video_surface_create");
+
+	capture_call(VDP_FUNC_ID_VIDEO_SURFACE_CREATE, start, status, surface ? *surface : VDP_INVALID_HANDLE, &args, sizeof(args));
+	return status;
+}
+
+static VdpStatus capture_video_surface_destroy(VdpVideoSurface surface)
+{
+	uint32_t args = surface;
+	uint64_t start = get_time();
+	VdpStatus status = vdp_video_surface_destroy(surface);
+	TRACE_END(start, "video_surface_destroy");
+
+	capture_call(VDP_FUNC_ID_VIDEO_SURFACE_DESTROY, start, status, VDP_INVALID_HANDLE, &args, sizeof(args));
+	return status;
+}
+
+static void capture_surface_bits(capture_surface_bits_t *args, VdpVideoSurface surface, VdpYCbCrFormat format, uint32_t const *pitches)
+{
+	int i, planes = (format == VDP_YCBCR_FORMAT_YV12) ? 3 : (format == VDP_YCBCR_FORMAT_NV12) ? 2 : 1;
+
+	memset(args, 0, sizeof(*args));
+	args->surface = surface;
+	args->format = format;
+	for (i = 0; i < planes && pitches; i++)
+		args->pitches[i] = pitches[i];
+}
+
+static VdpStatus capture_video_surface_get_bits_y_cb_cr(VdpVideoSurface surface, VdpYCbCrFormat destination_ycbcr_format, void *const *destination_data, uint32_t const *destination_pitches)
+{
+	capture_surface_bits_t args;
+	uint64_t start = get_time();
+	VdpStatus status = vdp_video_surface_get_bits_y_cb_cr(surface, destination_ycbcr_format, destination_data, destination_pitches);
+	TRACE_END(start, "video_surface_get_bits_y_cb_cr");
+
+	capture_surface_bits(&args, surface, destination_ycbcr_format, destination_pitches);
+	capture_call(VDP_FUNC_ID_VIDEO_SURFACE_GET_BITS_Y_CB_CR, start, status, VDP_INVALID_HANDLE, &args, sizeof(args));
+	return status;
+}
+
+static VdpStatus capture_video_surface_put_bits_y_cb_cr(VdpVideoSurface surface, VdpYCbCrFormat source_ycbcr_format, void const *const *source_data, uint32_t const *source_pitches)
+{
+	capture_surface_bits_t args;
+	uint64_t start = get_time();
+	VdpStatus status = vdp_video_surface_put_bits_y_cb_cr(surface, source_ycbcr_format, source_data, source_pitches);
+	TRACE_END(start, "video_surface_put_bits_y_cb_cr");
+
+	capture_surface_bits(&args, surface, source_ycbcr_format, source_pitches);
+	capture_call(VDP_FUNC_ID_VIDEO_SURFACE_PUT_BITS_Y_CB_CR, start, status, VDP_INVALID_HANDLE, &args, sizeof(args));
+	return status;
+}
+
+static VdpStatus capture_decoder_create(VdpDevice device, VdpDecoderProfile profile, uint32_t width, uint32_t height, uint32_t max_references, VdpDecoder *decoder)
+{
+	capture_decoder_create_t args = { .profile = profile, .width = width, .height = height, .max_references = max_references };
+	uint64_t start = get_time();
+	VdpStatus status = vdp_decoder_create(device, profile, width, height, max_references, decoder);
+	TRACE_END(start, "decoder_create");
+
+	capture_call(VDP_FUNC_ID_DECODER_CREATE, start, status, decoder ? *decoder : VDP_INVALID_HANDLE, &args, sizeof(args));
+	return status;
+}
+
+static VdpStatus capture_decoder_destroy(VdpDecoder decoder)
+{
+	uint32_t args = decoder;
+	uint64_t start = get_time();
+	VdpStatus status = vdp_decoder_destroy(decoder);
+	TRACE_END(start, "decoder_destroy");
+
+	capture_call(VDP_FUNC_ID_DECODER_DESTROY, start, status, VDP_INVALID_HANDLE, &args, sizeof(args));
+	return status;
+}
+
+static VdpStatus capture_decoder_set_video_control_data(VdpDecoder decoder, VdpDecoderControlDataId id, VdpDecoderControlData *data)
+{
+	capture_control_data_t args;
+	uint64_t start = get_time();
+	VdpStatus status = vdp_decoder_set_video_control_data(decoder, id, data);
+	TRACE_END(start, "decoder_set_video_control_data");
+
+	memset(&args, 0, sizeof(args));
+	args.decoder = decoder;
+	args.id = id;
+	if (data)
+		args.data = *data;
+
+	capture_call(VDP_FUNC_ID_DECODER_SET_VIDEO_CONTROL_DATA, start, status, VDP_INVALID_HANDLE, &args, sizeof(args));
+	return status;
+}
+
+static void capture_render(VdpFuncId func_id, uint64_t start, VdpStatus status, VdpDecoder decoder, VdpVideoSurface target,
+                           VdpPictureInfo const *picture_info, uint32_t bitstream_buffer_count,
+                           VdpBitstreamBuffer const *bitstream_buffers, uint32_t bitstream_pos)
+{
+	capture_render_t args;
+	uint32_t i, size;
+
+	if (!capture.file)
+		return;
+
+	decoder_ctx_t *dec = handle_get(decoder);
+	if (!dec || !picture_info)
+	{
+		if (dec)
+			handle_release(decoder);
+		capture_call(func_id, start, status, VDP_INVALID_HANDLE, NULL, 0);
+		return;
+	}
+
+	args.decoder = decoder;
+	args.target = target;
+	args.info_size = capture_picture_info_size(dec->profile);
+	args.buffer_count = bitstream_buffer_count;
+	args.bitstream_pos = bitstream_pos;
+	handle_release(decoder);
+
+	size = sizeof(args) + args.info_size;
+	for (i = 0; i < bitstream_buffer_count; i++)
+		size += sizeof(uint32_t) + bitstream_buffers[i].bitstream_bytes;
+
+	capture_begin(func_id, start, status, VDP_INVALID_HANDLE, size);
+	capture_data(&args, sizeof(args));
+	capture_data(picture_info, args.info_size);
+	for (i = 0; i < bitstream_buffer_count; i++)
+	{
+		capture_data(&bitstream_buffers[i].bitstream_bytes, sizeof(uint32_t));
+		capture_data(bitstream_buffers[i].bitstream, bitstream_buffers[i].bitstream_bytes);
+	}
+	capture_end();
+}
+
+static VdpStatus capture_decoder_render(VdpDecoder decoder, VdpVideoSurface target, VdpPictureInfo const *picture_info, uint32_t bitstream_buffer_count, VdpBitstreamBuffer const *bitstream_buffers)
+{
+	uint64_t start = get_time();
+	VdpStatus status = vdp_decoder_render(decoder, target, picture_info, bitstream_buffer_count, bitstream_buffers);
+	TRACE_END(start, "decoder_render");
+
+	capture_render(VDP_FUNC_ID_DECODER_RENDER, start, status, decoder, target, picture_info,
+	               bitstream_buffer_count, bitstream_buffers, 0);
+	return status;
+}
+
+static VdpStatus capture_decoder_render_stream(VdpDecoder decoder, VdpVideoSurface target, VdpPictureInfo const *picture_info, uint32_t bitstream_buffer_count, VdpBitstreamBuffer const *bitstream_buffers, uint32_t *bitpos_out)
+{
+	uint64_t start = get_time();
+	VdpStatus status = vdp_decoder_render_stream(decoder, target, picture_info, bitstream_buffer_count, bitstream_buffers, bitpos_out);
+	TRACE_END(start, "decoder_render_stream");
+
+	capture_render(VDP_FUNC_ID_DECODER_RENDERSTREAM, start, status, decoder, target, picture_info,
+	               bitstream_buffer_count, bitstream_buffers, bitpos_out ? *bitpos_out : 0);
+	return status;
+}
+
+static void *const capture_functions[] =
+{
+	[VDP_FUNC_ID_GET_API_VERSION]                                       = &capture_get_api_version,
+	[VDP_FUNC_ID_GET_INFORMATION_STRING]                                = &capture_get_information_string,
+	[VDP_FUNC_ID_DEVICE_DESTROY]                                        = &capture_device_destroy,
+	[VDP_FUNC_ID_GENERATE_CSC_MATRIX]                                   = &capture_generate_csc_matrix,
+	[VDP_FUNC_ID_VIDEO_SURFACE_QUERY_CAPABILITIES]                      = &capture_video_surface_query_capabilities,
+	[VDP_FUNC_ID_VIDEO_SURFACE_QUERY_GET_PUT_BITS_Y_CB_CR_CAPABILITIES] = &capture_video_surface_query_get_put_bits_y_cb_cr_capabilities,
+	[VDP_FUNC_ID_VIDEO_SURFACE_CREATE]                                  = &capture_video_surface_create,
+	[VDP_FUNC_ID_VIDEO_SURFACE_DESTROY]                                 = &capture_video_surface_destroy,
+	[VDP_FUNC_ID_VIDEO_SURFACE_GET_PARAMETERS]                          = &capture_video_surface_get_parameters,
+	[VDP_FUNC_ID_VIDEO_SURFACE_GET_BITS_Y_CB_CR]                        = &capture_video_surface_get_bits_y_cb_cr,
+	[VDP_FUNC_ID_VIDEO_SURFACE_PUT_BITS_Y_CB_CR]                        = &capture_video_surface_put_bits_y_cb_cr,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_QUERY_CAPABILITIES]                     = &capture_output_surface_query_capabilities,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_QUERY_GET_PUT_BITS_NATIVE_CAPABILITIES] = &capture_output_surface_query_get_put_bits_native_capabilities,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_QUERY_PUT_BITS_INDEXED_CAPABILITIES]    = &capture_output_surface_query_put_bits_indexed_capabilities,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_QUERY_PUT_BITS_Y_CB_CR_CAPABILITIES]    = &capture_output_surface_query_put_bits_y_cb_cr_capabilities,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_CREATE]                                 = &capture_output_surface_create,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_DESTROY]                                = &capture_output_surface_destroy,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_GET_PARAMETERS]                         = &capture_output_surface_get_parameters,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_GET_BITS_NATIVE]                        = &capture_output_surface_get_bits_native,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_PUT_BITS_NATIVE]                        = &capture_output_surface_put_bits_native,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_PUT_BITS_INDEXED]                       = &capture_output_surface_put_bits_indexed,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_PUT_BITS_Y_CB_CR]                       = &capture_output_surface_put_bits_y_cb_cr,
+	[VDP_FUNC_ID_BITMAP_SURFACE_QUERY_CAPABILITIES]                     = &capture_bitmap_surface_query_capabilities,
+	[VDP_FUNC_ID_BITMAP_SURFACE_CREATE]                                 = &capture_bitmap_surface_create,
+	[VDP_FUNC_ID_BITMAP_SURFACE_DESTROY]                                = &capture_bitmap_surface_destroy,
+	[VDP_FUNC_ID_BITMAP_SURFACE_GET_PARAMETERS]                         = &capture_bitmap_surface_get_parameters,
+	[VDP_FUNC_ID_BITMAP_SURFACE_PUT_BITS_NATIVE]                        = &capture_bitmap_surface_put_bits_native,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_RENDER_OUTPUT_SURFACE]                  = &capture_output_surface_render_output_surface,
+	[VDP_FUNC_ID_OUTPUT_SURFACE_RENDER_BITMAP_SURFACE]                  = &capture_output_surface_render_bitmap_surface,
+	[VDP_FUNC_ID_DECODER_QUERY_CAPABILITIES]                            = &capture_decoder_query_capabilities,
+	[VDP_FUNC_ID_DECODER_CREATE]                                        = &capture_decoder_create,
+	[VDP_FUNC_ID_DECODER_DESTROY]                                       = &capture_decoder_destroy,
+	[VDP_FUNC_ID_DECODER_GET_PARAMETERS]                                = &capture_decoder_get_parameters,
+	[VDP_FUNC_ID_DECODER_RENDER]                                        = &capture_decoder_render,
+	[VDP_FUNC_ID_VIDEO_MIXER_QUERY_FEATURE_SUPPORT]                     = &capture_video_mixer_query_feature_support,
+	[VDP_FUNC_ID_VIDEO_MIXER_QUERY_PARAMETER_SUPPORT]                   = &capture_video_mixer_query_parameter_support,
+	[VDP_FUNC_ID_VIDEO_MIXER_QUERY_ATTRIBUTE_SUPPORT]                   = &capture_video_mixer_query_attribute_support,
+	[VDP_FUNC_ID_VIDEO_MIXER_QUERY_PARAMETER_VALUE_RANGE]               = &capture_video_mixer_query_parameter_value_range,
+	[VDP_FUNC_ID_VIDEO_MIXER_QUERY_ATTRIBUTE_VALUE_RANGE]               = &capture_video_mixer_query_attribute_value_range,
+	[VDP_FUNC_ID_VIDEO_MIXER_CREATE]                                    = &capture_video_mixer_create,
+	[VDP_FUNC_ID_VIDEO_MIXER_SET_FEATURE_ENABLES]                       = &capture_video_mixer_set_feature_enables,
+	[VDP_FUNC_ID_VIDEO_MIXER_SET_ATTRIBUTE_VALUES]                      = &capture_video_mixer_set_attribute_values,
+	[VDP_FUNC_ID_VIDEO_MIXER_GET_FEATURE_SUPPORT]                       = &capture_video_mixer_get_feature_support,
+	[VDP_FUNC_ID_VIDEO_MIXER_GET_FEATURE_ENABLES]                       = &capture_video_mixer_get_feature_enables,
+	[VDP_FUNC_ID_VIDEO_MIXER_GET_PARAMETER_VALUES]                      = &capture_video_mixer_get_parameter_values,
+	[VDP_FUNC_ID_VIDEO_MIXER_GET_ATTRIBUTE_VALUES]                      = &capture_video_mixer_get_attribute_values,
+	[VDP_FUNC_ID_VIDEO_MIXER_DESTROY]                                   = &capture_video_mixer_destroy,
+	[VDP_FUNC_ID_VIDEO_MIXER_RENDER]                                    = &capture_video_mixer_render,
+	[VDP_FUNC_ID_PRESENTATION_QUEUE_TARGET_DESTROY]                     = &capture_presentation_queue_target_destroy,
+	[VDP_FUNC_ID_PRESENTATION_QUEUE_CREATE]                             = &capture_presentation_queue_create,
+	[VDP_FUNC_ID_PRESENTATION_QUEUE_DESTROY]                            = &capture_presentation_queue_destroy,
+	[VDP_FUNC_ID_PRESENTATION_QUEUE_SET_BACKGROUND_COLOR]               = &capture_presentation_queue_set_background_color,
+	[VDP_FUNC_ID_PRESENTATION_QUEUE_GET_BACKGROUND_COLOR]               = &capture_presentation_queue_get_background_color,
+	[VDP_FUNC_ID_PRESENTATION_QUEUE_GET_TIME]                           = &capture_presentation_queue_get_time,
+	[VDP_FUNC_ID_PRESENTATION_QUEUE_DISPLAY]                            = &capture_presentation_queue_display,
+	[VDP_FUNC_ID_PRESENTATION_QUEUE_BLOCK_UNTIL_SURFACE_IDLE]           = &capture_presentation_queue_block_until_surface_idle,
+	[VDP_FUNC_ID_PRESENTATION_QUEUE_QUERY_SURFACE_STATUS]               = &capture_presentation_queue_query_surface_status,
+	[VDP_FUNC_ID_PREEMPTION_CALLBACK_REGISTER]                          = &capture_preemption_callback_register,
+	[VDP_FUNC_ID_DECODER_SET_VIDEO_CONTROL_DATA]                        = &capture_decoder_set_video_control_data,
+	[VDP_FUNC_ID_DECODER_RENDERSTREAM]                                  = &capture_decoder_render_stream
+};
+
+void *capture_wrap(VdpFuncId function_id, void *function)
+{
+	if (function_id < ARRAY_SIZE(capture_functions) && capture_functions[function_id])
+		return capture_functions[function_id];
+	else if (function_id == VDP_FUNC_ID_PRESENTATION_QUEUE_TARGET_CREATE_X11)
+		return &capture_presentation_queue_target_create_x11;
+
+	// get_error_string and get_proc_address itself are passed through
+	return function;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <vdpau/vdpau.h>
+
+/*
+ * Capture file layout, native byte order:
+ *
+ *   capture_header_t
+ *   { capture_record_t, payload[record.size] } ...
+ *
+ * Calls that can be replayed without a display carry a payload, all
+ * other entry points are recorded with their timing only.
+ *
+ *   VIDEO_SURFACE_CREATE     capture_surface_create_t
+ *   VIDEO_SURFACE_DESTROY    uint32_t surface
+ *   VIDEO_SURFACE_GET_BITS   capture_surface_bits_t
+ *   VIDEO_SURFACE_PUT_BITS   capture_surface_bits_t, the planes are not stored
+ *   DECODER_CREATE           capture_decoder_create_t
+ *   DECODER_DESTROY          uint32_t decoder
+ *   DECODER_RENDER(STREAM)   capture_render_t, picture info,
+ *                            { uint32_t bytes, bitstream[bytes] } * buffer_count
+ *   DECODER_SET_VIDEO_...    capture_control_data_t
+ */
+
+#define CAPTURE_MAGIC 0x43504456
+#define CAPTURE_VERSION 1
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+} capture_header_t;
+
+typedef struct
+{
+	uint32_t func_id;
+	uint32_t size;
+	uint64_t time;		// ns since capture start
+	uint64_t duration;	// ns spent in the call
+	int32_t status;
+	uint32_t handle;	// object created by the call
+} capture_record_t;
+
+typedef struct
+{
+	uint32_t chroma_type;
+	uint32_t width;
+	uint32_t height;
+} capture_surface_create_t;
+
+typedef struct
+{
+	uint32_t surface;
+	uint32_t format;
+	uint32_t pitches[3];
+} capture_surface_bits_t;
+
+typedef struct
+{
+	uint32_t profile;
+	uint32_t width;
+	uint32_t height;
+	uint32_t max_references;
+} capture_decoder_create_t;
+
+typedef struct
+{
+	uint32_t decoder;
+	uint32_t target;
+	uint32_t info_size;
+	uint32_t buffer_count;
+	uint32_t bitstream_pos;
+} capture_render_t;
+
+typedef struct
+{
+	uint32_t decoder;
+	uint32_t id;
+	VdpDecoderControlData data;
+} capture_control_data_t;
+
+static inline uint32_t capture_picture_info_size(VdpDecoderProfile profile)
+{
+	switch (profile)
+	{
+	case VDP_DECODER_PROFILE_MPEG1:
+	case VDP_DECODER_PROFILE_MPEG2_SIMPLE:
+	case VDP_DECODER_PROFILE_MPEG2_MAIN:
+		return sizeof(VdpPictureInfoMPEG1Or2);
+	case VDP_DECODER_PROFILE_H264_BASELINE:
+	case VDP_DECODER_PROFILE_H264_MAIN:
+	case VDP_DECODER_PROFILE_H264_HIGH:
+		return sizeof(VdpPictureInfoH264);
+	default:
+		// MPEG4 part 2 and all DivX profiles
+		return sizeof(VdpPictureInfoMPEG4Part2);
+	}
+}
+
+int capture_open(const char *filename);
+int capture_enabled(void);
+void *capture_wrap(VdpFuncId function_id, void *function);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "counters.h"
+
+// counters are always updated, without the page they go here
+static vdpau_counters_t local_counters;
+static char shm_name[32];
+
+vdpau_counters_t *counters = &local_counters;
+
+void counters_init(void)
+{
+	vdpau_counters_t *page;
+	int fd;
+
+	char *env_vdpau_counters = getenv("VDPAU_COUNTERS");
+	if (!env_vdpau_counters || strncmp(env_vdpau_counters, "1", 1) != 0 || counters != &local_counters)
+		return;
+
+	snprintf(shm_name, sizeof(shm_name), COUNTERS_NAME, getpid());
+	fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		printf("could not create counters page %s\n", shm_name);
+		return;
+	}
+
+	if (ftruncate(fd, sizeof(vdpau_counters_t)) == -1)
+		goto err;
+
+	page = mmap(NULL, sizeof(vdpau_counters_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED)
+		goto err;
+
+	close(fd);
+
+	// carry over what was counted before the page existed
+	memcpy(page, &local_counters, sizeof(*page));
+	page->pid = getpid();
+	page->size = sizeof(vdpau_counters_t);
+	page->version = COUNTERS_VERSION;
+	__atomic_store_n(&page->magic, COUNTERS_MAGIC, __ATOMIC_RELEASE);
+
+	counters = page;
+	return;
+
+err:
+	close(fd);
+	shm_unlink(shm_name);
+}
+
+void counters_close(void)
+{
+	vdpau_counters_t *page = counters;
+
+	if (page == &local_counters)
+		return;
+
+	memcpy(&local_counters, page, sizeof(local_counters));
+	counters = &local_counters;
+
+	munmap(page, sizeof(vdpau_counters_t));
+	shm_unlink(shm_name);
+}
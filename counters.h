@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __COUNTERS_H__
+#define __COUNTERS_H__
+
+#include <stdint.h>
+
+/*
+ * Counters page, published as /dev/shm/vdpau_sunxi.<pid> when
+ * VDPAU_COUNTERS=1 is set. The layout is fixed, new fields are only
+ * appended and bump COUNTERS_VERSION. All fields are updated with
+ * relaxed atomics, readers see each value torn-free but not a
+ * consistent snapshot of the whole page.
+ */
+
+#define COUNTERS_MAGIC		0x43444456
+#define COUNTERS_VERSION	2
+#define COUNTERS_NAME		"/vdpau_sunxi.%d"
+
+enum counter_codec
+{
+	COUNTER_CODEC_MPEG12,
+	COUNTER_CODEC_H264,
+	COUNTER_CODEC_MPEG4,
+	COUNTER_CODEC_MSMPEG4,
+	COUNTER_CODEC_COUNT
+};
+
+#define COUNTER_HANDLE_TYPES 16
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	uint32_t size;
+
+	uint64_t frames_decoded[COUNTER_CODEC_COUNT];
+	uint64_t bitstream_bytes;
+	uint64_t h264_slices;
+	uint64_t h264_slices_max;	// most slices in one frame
+	uint64_t h264_errors;		// slices with CEDARV_H264_ERROR non-zero or the STATUS error flag
+	uint64_t mpeg_errors;		// CEDARV_MPEG_ERROR non-zero
+
+	uint64_t ve_busy_ns;		// from cedarv_get until the job is completed
+	uint64_t ve_wait_timeouts;
+
+	uint64_t mem_bytes;		// CMA/UMP memory currently allocated
+	uint64_t mem_allocs;
+
+	int64_t live_handles[COUNTER_HANDLE_TYPES];	// by enum HandleType
+
+	uint64_t display_calls;
+	uint64_t display_late;		// shown after earliest_presentation_time
+
+	uint64_t shadow_hits;		// VE register and table writes skipped
+	uint64_t shadow_misses;
+} vdpau_counters_t;
+
+extern vdpau_counters_t *counters;
+
+void counters_init(void);
+void counters_close(void);
+
+#define COUNTER_ADD(field, val)	__atomic_fetch_add(&counters->field, (val), __ATOMIC_RELAXED)
+#define COUNTER_SUB(field, val)	__atomic_fetch_sub(&counters->field, (val), __ATOMIC_RELAXED)
+#define COUNTER_INC(field)	COUNTER_ADD(field, 1)
+#define COUNTER_DEC(field)	COUNTER_SUB(field, 1)
+#define COUNTER_MAX(field, val)	counter_max(&counters->field, (val))
+
+static inline void counter_max(uint64_t *counter, uint64_t val)
+{
+	uint64_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	while (val > old && !__atomic_compare_exchange_n(counter, &old, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+#endif
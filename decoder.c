@@ -17,11 +17,43 @@
  *
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "vdpau_private.h"
 #include "ve.h"
+#include "counters.h"
 #include <stdio.h>
 
+/*
+ * Initial VBV size, a guess for the largest access unit of the stream.
+ * It is grown on demand if a unit does not fit.
+ */
+static unsigned int vbv_initial_size(VdpDecoderProfile profile, uint32_t width, uint32_t height)
+{
+    unsigned int size = width * height;
+
+    switch (profile)
+    {
+    case VDP_DECODER_PROFILE_H264_BASELINE:
+    case VDP_DECODER_PROFILE_H264_MAIN:
+        size = size * 3 / 4;
+        break;
+    case VDP_DECODER_PROFILE_H264_HIGH:
+        // high profile intra frames can get close to the raw size
+        break;
+    default:
+        size = size / 2;
+        break;
+    }
+
+    if (size < VBV_MIN_SIZE)
+        size = VBV_MIN_SIZE;
+    if (size > VBV_MAX_SIZE)
+        size = VBV_MAX_SIZE;
+
+    return (size + 0xffff) & ~0xffff;
+}
+
 VdpStatus vdp_decoder_create(VdpDevice device, VdpDecoderProfile profile, uint32_t width, uint32_t height, uint32_t max_references, VdpDecoder *decoder)
 {
     device_ctx_t *dev = handle_get(device);
@@ -43,10 +75,16 @@ VdpStatus vdp_decoder_create(VdpDevice device, VdpDecoderProfile profile, uint32
     dec->width = width;
     dec->height = height;
 
-    dec->data = cedarv_malloc(VBV_SIZE);
+    dec->data_size = vbv_initial_size(profile, width, height);
+    dec->data = cedarv_malloc(dec->data_size);
     if (! cedarv_isValid(dec->data))
         goto err_data;
+    dec->host_data = malloc(dec->data_size);
+    if (!dec->host_data)
+        goto err_host_data;
+    VDPAU_DBG("vdpau decoder=%d vbv size %u", *decoder, dec->data_size);
     dec->data_pos = 0;
+    dec->data_offset = 0;
 
     VdpStatus ret;
     switch (profile)
@@ -54,12 +92,14 @@ VdpStatus vdp_decoder_create(VdpDevice device, VdpDecoderProfile profile, uint32
     case VDP_DECODER_PROFILE_MPEG1:
     case VDP_DECODER_PROFILE_MPEG2_SIMPLE:
     case VDP_DECODER_PROFILE_MPEG2_MAIN:
+        dec->codec = COUNTER_CODEC_MPEG12;
         ret = new_decoder_mpeg12(dec);
         break;
 
     case VDP_DECODER_PROFILE_H264_BASELINE:
     case VDP_DECODER_PROFILE_H264_MAIN:
     case VDP_DECODER_PROFILE_H264_HIGH:
+        dec->codec = COUNTER_CODEC_H264;
         ret = new_decoder_h264(dec);
         break;
 
@@ -73,12 +113,14 @@ VdpStatus vdp_decoder_create(VdpDevice device, VdpDecoderProfile profile, uint32
     case VDP_DECODER_PROFILE_DIVX5_MOBILE:
     case VDP_DECODER_PROFILE_DIVX5_HOME_THEATER:
     case VDP_DECODER_PROFILE_DIVX5_HD_1080P:
+        dec->codec = COUNTER_CODEC_MPEG4;
         ret = new_decoder_mpeg4(dec);
         break;
     case VDP_DECODER_PROFILE_DIVX3_HD_1080P:
     case VDP_DECODER_PROFILE_DIVX3_QMOBILE:
     case VDP_DECODER_PROFILE_DIVX3_MOBILE:
     case VDP_DECODER_PROFILE_DIVX3_HOME_THEATER:
+        dec->codec = COUNTER_CODEC_MSMPEG4;
         ret = new_decoder_msmpeg4(dec);
         break;
     default:
@@ -96,6 +138,8 @@ err_handle:
     if (dec->private_free)
         dec->private_free(dec);
 err_decoder:
+    free(dec->host_data);
+err_host_data:
     cedarv_free(dec->data);
 err_data:
     handle_destroy(*decoder);
@@ -111,10 +155,13 @@ VdpStatus vdp_decoder_destroy(VdpDecoder decoder)
     if (!dec)
         return VDP_STATUS_INVALID_HANDLE;
 
+    cedarv_sync(dec->fence);
+
     if (dec->private_free)
         dec->private_free(dec);
 
     cedarv_free(dec->data);
+    free(dec->host_data);
 
     handle_release(decoder);
     handle_destroy(decoder);
@@ -142,6 +189,98 @@ VdpStatus vdp_decoder_get_parameters(VdpDecoder decoder, VdpDecoderProfile *prof
     return VDP_STATUS_OK;
 }
 
+/*
+ * The VBV is used as a ring, each access unit is written behind the previous
+ * one so it can be uploaded while the VE still decodes the last one. Units
+ * are kept contiguous so the CPU side parsers never have to wrap, the
+ * codecs get absolute offsets starting at data_offset and ending at len.
+ */
+static void vbv_wait_busy(decoder_ctx_t *dec, unsigned int start, unsigned int end)
+{
+    if (start < dec->busy_end && dec->busy_start < end)
+    {
+        cedarv_sync(dec->fence);
+        dec->busy_start = dec->busy_end = 0;
+    }
+}
+
+/*
+ * Replace the VBV by one that holds at least needed bytes, doubling the size
+ * at most up to VBV_MAX_SIZE. Leftover data is moved to the new buffer.
+ */
+static int vbv_grow(decoder_ctx_t *dec, unsigned int needed, unsigned int keep_len)
+{
+    unsigned int size = dec->data_size;
+
+    if (needed > VBV_MAX_SIZE)
+        return 0;
+
+    while (size < needed)
+        size *= 2;
+    if (size > VBV_MAX_SIZE)
+        size = VBV_MAX_SIZE;
+
+    CEDARV_MEMORY data = cedarv_malloc(size);
+    if (! cedarv_isValid(data))
+        return 0;
+
+    uint8_t *host_data = malloc(size);
+    if (!host_data)
+    {
+        cedarv_free(data);
+        return 0;
+    }
+
+    cedarv_sync(dec->fence);
+    dec->busy_start = dec->busy_end = 0;
+
+    if (keep_len)
+    {
+        cedarv_memcpy(data, 0, dec->host_data + dec->data_offset, keep_len);
+        memcpy(host_data, dec->host_data + dec->data_offset, keep_len);
+    }
+
+    cedarv_free(dec->data);
+    free(dec->host_data);
+    dec->data = data;
+    dec->host_data = host_data;
+    dec->data_size = size;
+    dec->data_offset = 0;
+    dec->data_pos = keep_len;
+
+    VDPAU_DBG("vbv grown to %u bytes", size);
+    return 1;
+}
+
+static int vbv_reserve(decoder_ctx_t *dec, unsigned int size, int keep)
+{
+    unsigned int keep_len = keep ? dec->data_pos - dec->data_offset : 0;
+
+    if (keep_len + size > dec->data_size && !vbv_grow(dec, keep_len + size, keep_len))
+        return 0;
+
+    unsigned int start = keep ? dec->data_offset : dec->data_pos;
+
+    if (start + keep_len + size > dec->data_size)
+    {
+        // wrap around, leftover data moves to the start of the ring
+        vbv_wait_busy(dec, 0, keep_len + size);
+        if (keep_len)
+        {
+            uint8_t *data = cedarv_getPointer(dec->data);
+            memmove(data, data + start, keep_len);
+            memmove(dec->host_data, dec->host_data + start, keep_len);
+        }
+        start = 0;
+    }
+    else
+        vbv_wait_busy(dec, start + keep_len, start + keep_len + size);
+
+    dec->data_offset = start;
+    dec->data_pos = start + keep_len;
+    return 1;
+}
+
 VdpStatus vdp_decoder_render(VdpDecoder decoder, VdpVideoSurface target, VdpPictureInfo const *picture_info, uint32_t bitstream_buffer_count, VdpBitstreamBuffer const *bitstream_buffers)
 {
     VdpStatus status = VDP_STATUS_INVALID_HANDLE;
@@ -157,23 +296,138 @@ VdpStatus vdp_decoder_render(VdpDecoder decoder, VdpVideoSurface target, VdpPict
     }
 
     vid->source_format = INTERNAL_YCBCR_FORMAT;
-    unsigned int i, pos = 0;
+    unsigned int i, pos, size = 0, zeros = 0;
+
+    for (i = 0; i < bitstream_buffer_count; i++)
+        size += bitstream_buffers[i].bitstream_bytes;
+
+    // the codec may have left the tail of the last bitstream in front of the new one
+    int keep = dec->data_keep;
+    dec->data_keep = 0;
+
+    // only waits if the previous picture is still read from this part of the ring
+    if (!vbv_reserve(dec, size, keep))
+    {
+        VDPAU_DBG("bitstream of %u bytes does not fit into the VBV", size);
+        handle_release(target);
+        handle_release(decoder);
+        return VDP_STATUS_RESOURCES;
+    }
 
+    pos = dec->data_pos;
+    dec->startcode_count = 0;
+    dec->startcodes_valid = 1;
+    if (keep)
+        decoder_scan_startcodes(dec, dec->data_offset, dec->host_data + dec->data_offset, pos - dec->data_offset, &zeros);
     for (i = 0; i < bitstream_buffer_count; i++)
     {
-        cedarv_memcpy(dec->data, pos, bitstream_buffers[i].bitstream, bitstream_buffers[i].bitstream_bytes);
+        decoder_upload_and_scan(dec, pos, bitstream_buffers[i].bitstream, bitstream_buffers[i].bitstream_bytes, &zeros);
         pos += bitstream_buffers[i].bitstream_bytes;
     }
+    dec->data_pos = pos;
     //memory is mapped unchached, therefore no flush necessary. hopefully ;)
     cedarv_flush_cache(dec->data, pos);
 
+    dec->target = target;
     status = dec->decode(dec, picture_info, pos, vid);
+    if (status == VDP_STATUS_OK)
+        COUNTER_INC(frames_decoded[dec->codec]);
+    COUNTER_ADD(bitstream_bytes, size);
 
     handle_release(target);
     handle_release(decoder);
     return status;
 }
 
+void decoder_submit(decoder_ctx_t *decoder, video_surface_ctx_t *output, cedarv_done_fn done, void *arg)
+{
+    uint32_t fence = cedarv_submit(done, arg);
+
+    decoder->fence = fence;
+    output->fence = fence;
+    decoder->busy_start = decoder->data_offset;
+    decoder->busy_end = decoder->data_pos;
+
+    if (!decoder->device->async_decode)
+        cedarv_sync(fence);
+}
+
+/*
+ * Scratch buffers of the VE are only used while a decoder holds the engine,
+ * and the next cedarv_get() completes the previous job, so all decoders of
+ * a device share them. Leases must only be taken between cedarv_get() and
+ * decoder_submit()/cedarv_put(). New buffers are zeroed.
+ */
+int decoder_scratch_lease(decoder_ctx_t *decoder, int size, CEDARV_MEMORY *mem)
+{
+    scratch_buffer_t *scratch = decoder->device->scratch;
+    scratch_buffer_t *best = NULL, *spare = NULL;
+    int i;
+
+    for (i = 0; i < MAX_SCRATCH_BUFFERS; i++)
+    {
+        if (scratch[i].in_use)
+            continue;
+
+        if (scratch[i].size >= size)
+        {
+            if (!best || scratch[i].size < best->size)
+                best = &scratch[i];
+        }
+        else if (!spare || scratch[i].size < spare->size)
+            spare = &scratch[i];
+    }
+
+    if (!best)
+    {
+        // replace the smallest free buffer which is too small
+        if (!spare)
+            return 0;
+
+        CEDARV_MEMORY new_mem = cedarv_malloc(size);
+        if (! cedarv_isValid(new_mem))
+            return 0;
+
+        if (spare->size)
+            cedarv_free(spare->mem);
+
+        cedarv_memset(new_mem, 0, size);
+        cedarv_flush_cache(new_mem, size);
+        spare->mem = new_mem;
+        spare->size = size;
+        best = spare;
+    }
+
+    best->in_use = 1;
+    *mem = best->mem;
+    return 1;
+}
+
+void decoder_scratch_return(decoder_ctx_t *decoder, CEDARV_MEMORY mem)
+{
+    scratch_buffer_t *scratch = decoder->device->scratch;
+    int i;
+
+    for (i = 0; i < MAX_SCRATCH_BUFFERS; i++)
+        if (scratch[i].in_use && cedarv_virt2phys(scratch[i].mem) == cedarv_virt2phys(mem))
+        {
+            scratch[i].in_use = 0;
+            return;
+        }
+}
+
+void decoder_scratch_free(device_ctx_t *dev)
+{
+    int i;
+
+    for (i = 0; i < MAX_SCRATCH_BUFFERS; i++)
+        if (dev->scratch[i].size)
+        {
+            cedarv_free(dev->scratch[i].mem);
+            dev->scratch[i].size = 0;
+        }
+}
+
 VdpStatus vdp_decoder_query_capabilities(VdpDevice device, VdpDecoderProfile profile, VdpBool *is_supported, uint32_t *max_level, uint32_t *max_macroblocks, uint32_t *max_width, uint32_t *max_height)
 {
     if (!is_supported || !max_level || !max_macroblocks || !max_width || !max_height)
@@ -242,30 +496,53 @@ VdpStatus vdp_decoder_render_stream(VdpDecoder decoder, VdpVideoSurface target,
 		return VDP_STATUS_INVALID_HANDLE;
 
 	vid->source_format = INTERNAL_YCBCR_FORMAT;
-	unsigned int i, pos = dec->data_pos;
+	unsigned int i, pos, size = 0;
 
+	for (i = 0; i < bitstream_buffer_count; i++)
+		size += bitstream_buffers[i].bitstream_bytes;
+
+	// partially consumed data stays in the ring in front of the new data
+	if (!vbv_reserve(dec, size, 1))
+	{
+		handle_release(target);
+		handle_release(decoder);
+		return VDP_STATUS_RESOURCES;
+	}
+
+	// leftover data is not indexed, let the codec scan the buffer
+	dec->startcodes_valid = 0;
+
+	pos = dec->data_pos;
 	for (i = 0; i < bitstream_buffer_count; i++)
 	{
 		cedarv_memcpy(dec->data, pos, bitstream_buffers[i].bitstream, bitstream_buffers[i].bitstream_bytes);
+		memcpy(dec->host_data + pos, bitstream_buffers[i].bitstream, bitstream_buffers[i].bitstream_bytes);
 		pos += bitstream_buffers[i].bitstream_bytes;
 	}
+	dec->data_pos = pos;
 	//memory is mapped unchached, therefore no flush necessary. hopefully ;)
 	cedarv_flush_cache(dec->data, pos);
 
 	int error = dec->decode_stream(dec, picture_info, pos, vid, bitstream_pos_returned);
+	if (error == VDP_STATUS_OK)
+		COUNTER_INC(frames_decoded[dec->codec]);
+	COUNTER_ADD(bitstream_bytes, size);
 	if(error)
 	{
-		dec->data_pos = (*bitstream_pos_returned + 7) >> 3;
-		if(dec->data_pos > pos)
-		{
-			dec->data_pos = pos;
-		}
-		//memmove(dec->data, (char*)dec->data + dec->data_pos, pos - dec->data_pos);
+		// bitstream_pos_returned is the absolute bit position in the ring
+		unsigned int consumed = (*bitstream_pos_returned + 7) >> 3;
+		if (consumed > pos)
+			consumed = pos;
+		if (consumed > dec->data_offset)
+			dec->data_offset = consumed;
 	}
 	else
 	{
-		dec->data_pos = 0;
+		dec->data_offset = pos;
 	}
+
+	handle_release(target);
+	handle_release(decoder);
 	return error;
 }
 #endif
@@ -19,6 +19,8 @@
 
 #include "vdpau_private.h"
 #include "ve.h"
+#include "capture.h"
+#include "trace.h"
 #include <vdpau/vdpau_x11.h>
 #include <string.h>
 #include <sys/types.h>
@@ -37,7 +39,7 @@ VdpStatus vdp_imp_device_create_x11(Display *display, int screen, VdpDevice *dev
 	if (!dev)
 		return VDP_STATUS_RESOURCES;
 
-	//dev->display = XOpenDisplay(XDisplayString(display));
+	dev->display = display;	// the player's connection, only its name is used
 	dev->screen = screen;
         dev->fb_id = 0;
 
@@ -58,6 +60,25 @@ VdpStatus vdp_imp_device_create_x11(Display *display, int screen, VdpDevice *dev
 			VDPAU_DBG("Failed to open /dev/g2d! OSD disabled.");
 	}
 
+	char *env_vdpau_async = getenv("VDPAU_ASYNC_DECODE");
+	if (env_vdpau_async && strncmp(env_vdpau_async, "1", 1) == 0)
+		dev->async_decode = 1;
+
+	pthread_mutex_init(&dev->surface_pool_lock, NULL);
+	dev->surface_pool_max = SURFACE_POOL_MAX_SIZE;
+	char *env_vdpau_pool = getenv("VDPAU_SURFACE_POOL_MB");
+	if (env_vdpau_pool)
+		dev->surface_pool_max = (size_t)atoi(env_vdpau_pool) * 1024 * 1024;
+
+	dev->detile_threads = 1;
+	char *env_vdpau_detile = getenv("VDPAU_DETILE_THREADS");
+	if (env_vdpau_detile && atoi(env_vdpau_detile) > 0)
+		dev->detile_threads = atoi(env_vdpau_detile);
+
+	char *env_vdpau_capture = getenv("VDPAU_CAPTURE");
+	if (env_vdpau_capture && *env_vdpau_capture)
+		capture_open(env_vdpau_capture);
+
 	*get_proc_address = &vdp_get_proc_address;
         
 	return VDP_STATUS_OK;
@@ -69,6 +90,11 @@ VdpStatus vdp_device_destroy(VdpDevice device)
 	if (!dev)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	// an async job may still write the scratch and pool buffers
+	cedarv_sync_all();
+	decoder_scratch_free(dev);
+	surface_pool_free(dev);
+	pthread_mutex_destroy(&dev->surface_pool_lock);
 	cedarv_close();
 	//XCloseDisplay(dev->display);
 
@@ -189,6 +215,10 @@ VdpStatus vdp_get_proc_address(VdpDevice device_handle, VdpFuncId function_id, v
         else
            status = VDP_STATUS_INVALID_FUNC_ID;
 
+	// the capture wrappers also emit the entry point trace events
+	if (status == VDP_STATUS_OK && (capture_enabled() || TRACE_ENABLED()))
+		*function_pointer = capture_wrap(function_id, *function_pointer);
+
         handle_release(device_handle);
 	return status;
 }
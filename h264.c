@@ -17,86 +17,33 @@
  *
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "vdpau_private.h"
 #include "ve.h"
-#include <time.h>
+#include "trace.h"
+#include "counters.h"
+#include "h264_bits.h"
 
-//#define TIME_MEAS 1
 #define FIELDINTRABUFSIZE     0x20000
 #define NEIGHBORINFOBUFSIZE   0x4000
 
-extern uint64_t get_time(void);
-
-static int find_startcode(CEDARV_MEMORY mem, int len, int start)
+// advance the VE bitstream pointer past the header parsed on the CPU,
+// the VLD removes emulation prevention bytes by itself
+static void skip_bits(void *regs, unsigned int num)
 {
-	int pos, zeros = 0;
-	uint8_t* data = (uint8_t*)cedarv_getPointer(mem);
-	
-	for (pos = start; pos < len; pos++)
+	while (num > 0)
 	{
-		if (data[pos] == 0x00)
-			zeros++;
-		else if (data[pos] == 0x01 && zeros >= 2)
-			return pos - 2;
-		else
-			zeros = 0;
-	}
-
-	return -1;
-}
-
-static uint32_t getVlcData(uint32_t triggerValue, void* regs)
-{
-  volatile uint32_t status;
-  char done = 0;
-  uint32_t value;
-  uint32_t round = 0;
-  
-  writel(triggerValue, regs + CEDARV_H264_TRIGGER);
-  while (! done && round++ < 1000000)
-  {
-    status = readl(regs + CEDARV_H264_STATUS);
-    if( status & VLD_BUSY)
-    {
-      if(status & VLD_DATA_REQ_INTERRUPT)
-      {
-        value = 0;
-        done = 1;
-      }
-    }
-    else
-    {
-      value = readl(regs + CEDARV_H264_BASIC_BITS);
-      done = 1;
-    }
-  };
-
-  return value;
-}
-
-static inline uint32_t get_u(void *regs, int num)
-{
-    return getVlcData(0x2 | (num << 8), regs);
-}
-
-
-static inline uint32_t get_ue(void *regs)
-{ 
-    return getVlcData(0x5, regs);
-}
-
-static inline int32_t get_se(void *regs)
-{
-    return getVlcData(0x4, regs);
-/*	writel(0x00000004, regs + CEDARV_H264_TRIGGER);
+		unsigned int n = min(num, 32u);
+		unsigned int round = 0;
 
-	while (readl(regs + CEDARV_H264_STATUS) & (1 << 8));
+		writel(0x3 | (n << 8), regs + CEDARV_H264_TRIGGER);
+		while ((readl(regs + CEDARV_H264_STATUS) & VLD_BUSY) && round++ < 1000000);
 
-	return readl(regs + CEDARV_H264_BASIC_BITS);
-    */
+		num -= n;
+	}
 }
 
 #define PIC_TOP_FIELD		0x1
@@ -163,6 +110,7 @@ typedef struct
 typedef struct
 {
 	void *regs;
+	h264_bits_t bits;
 	h264_header_t header;
 	VdpPictureInfoH264 const *info;
 	video_surface_ctx_t *output;
@@ -175,32 +123,67 @@ typedef struct
 	h264_picture_t ref_pic[16];
 } h264_context_t;
 
+// scratch buffers are leased from the device pool while the engine is held
 typedef struct
 {
-	CEDARV_MEMORY extra_data;
     CEDARV_MEMORY mbFieldIntraBuf;
     CEDARV_MEMORY mbNeighborInfoBuf;
     CEDARV_MEMORY deBlkDramBuf;
     CEDARV_MEMORY intraPredDramBuf;
+    int deBlkDramBufSize;
+    int intraPredDramBufSize;
 } h264_private_t;
 
 static void h264_private_free(decoder_ctx_t *decoder)
 {
 	h264_private_t *decoder_p = (h264_private_t *)decoder->private;
-	cedarv_free(decoder_p->extra_data);
-    cedarv_free(decoder_p->mbFieldIntraBuf);
-    cedarv_free(decoder_p->mbNeighborInfoBuf);
-    if(cedarv_isValid(decoder_p->deBlkDramBuf))
-      cedarv_free(decoder_p->deBlkDramBuf);
-    if(cedarv_isValid(decoder_p->intraPredDramBuf))
-      cedarv_free(decoder_p->intraPredDramBuf);
 	free(decoder_p);
 }
 
+static int h264_scratch_lease(decoder_ctx_t *decoder)
+{
+	h264_private_t *decoder_p = (h264_private_t *)decoder->private;
+
+	if (!decoder_scratch_lease(decoder, FIELDINTRABUFSIZE, &decoder_p->mbFieldIntraBuf))
+		return 0;
+	if (!decoder_scratch_lease(decoder, NEIGHBORINFOBUFSIZE, &decoder_p->mbNeighborInfoBuf))
+		goto err_neighbor;
+	if (decoder_p->deBlkDramBufSize)
+	{
+		if (!decoder_scratch_lease(decoder, decoder_p->deBlkDramBufSize, &decoder_p->deBlkDramBuf))
+			goto err_deblk;
+		if (!decoder_scratch_lease(decoder, decoder_p->intraPredDramBufSize, &decoder_p->intraPredDramBuf))
+			goto err_intra;
+	}
+	return 1;
+
+err_intra:
+	decoder_scratch_return(decoder, decoder_p->deBlkDramBuf);
+err_deblk:
+	decoder_scratch_return(decoder, decoder_p->mbNeighborInfoBuf);
+err_neighbor:
+	decoder_scratch_return(decoder, decoder_p->mbFieldIntraBuf);
+	return 0;
+}
+
+static void h264_scratch_return(decoder_ctx_t *decoder)
+{
+	h264_private_t *decoder_p = (h264_private_t *)decoder->private;
+
+	decoder_scratch_return(decoder, decoder_p->mbFieldIntraBuf);
+	decoder_scratch_return(decoder, decoder_p->mbNeighborInfoBuf);
+	if (decoder_p->deBlkDramBufSize)
+	{
+		decoder_scratch_return(decoder, decoder_p->deBlkDramBuf);
+		decoder_scratch_return(decoder, decoder_p->intraPredDramBuf);
+	}
+}
+
 #define PIC_TYPE_FRAME	0x0
 #define PIC_TYPE_FIELD	0x1
 #define PIC_TYPE_MBAFF	0x2
 
+// extra_data is the motion vector buffer pre-attached to the surface
 typedef struct
 {
 	CEDARV_MEMORY extra_data;
@@ -212,8 +195,50 @@ typedef struct
 static void h264_video_private_free(video_surface_ctx_t *surface)
 {
 	h264_video_private_t *surface_p = (h264_video_private_t *)surface->decoder_private;
-	cedarv_free(surface_p->extra_data);
 	free(surface_p);
+	surface->decoder_private = NULL;
+	surface->decoder_private_free = NULL;
+}
+
+static int mv_buffer_size(int width_mbs, int height_mbs, int frame_mbs_only_flag)
+{
+	int MvColBufSize = height_mbs * (2 - frame_mbs_only_flag);
+	MvColBufSize = (MvColBufSize + 1) / 2;
+	return width_mbs * MvColBufSize * 32 * 2;
+}
+
+int h264_mv_buffer_size(uint32_t width, uint32_t height)
+{
+	int frame = mv_buffer_size((width + 15) / 16, (height + 15) / 16, 1);
+	int field = mv_buffer_size((width + 15) / 16, ((height / 2) + 15) / 16, 0);
+	return frame > field ? frame : field;
+}
+
+static h264_video_private_t *h264_video_private_get(video_surface_ctx_t *surface, int len)
+{
+	h264_video_private_t *surface_p = (h264_video_private_t *)surface->decoder_private;
+
+	if (!surface_p)
+	{
+		surface_p = calloc(1, sizeof(h264_video_private_t));
+		if (!surface_p)
+			return NULL;
+
+		surface->decoder_private = surface_p;
+		surface->decoder_private_free = h264_video_private_free;
+	}
+
+	// only surfaces not created for 4:2:0 or of a different size end up here
+	if (surface->mv_data_len < len)
+	{
+		surface_pool_put(surface->device, surface->mv_data, surface->mv_data_len);
+		surface->mv_data = surface_pool_get(surface->device, len);
+		surface->mv_data_len = cedarv_isValid(surface->mv_data) ? len : 0;
+	}
+
+	surface_p->extra_data = surface->mv_data;
+	surface_p->extra_data_len = len;
+	return surface_p;
 }
 
 static void ref_pic_list_modification(h264_context_t *c)
@@ -223,11 +248,11 @@ static void ref_pic_list_modification(h264_context_t *c)
 	const int MaxFrameNum = 1 << (info->log2_max_frame_num_minus4 + 4);
 	const int MaxPicNum = (info->field_pic_flag) ? 2 * MaxFrameNum : MaxFrameNum;
 
-	void *cedarv_regs = cedarv_get_regs();
+	h264_bits_t *bs = &c->bits;
 
 	if (h->slice_type != SLICE_TYPE_I && h->slice_type != SLICE_TYPE_SI)
 	{
-		int ref_pic_list_modification_flag_l0 = get_u(cedarv_regs, 1);
+		int ref_pic_list_modification_flag_l0 = get_u(bs, 1);
 		if (ref_pic_list_modification_flag_l0)
 		{
 			unsigned int modification_of_pic_nums_idc;
@@ -240,10 +265,10 @@ static void ref_pic_list_modification(h264_context_t *c)
 
 			do
 			{
-				modification_of_pic_nums_idc = get_ue(cedarv_regs);
+				modification_of_pic_nums_idc = get_ue(bs);
 				if (modification_of_pic_nums_idc == 0 || modification_of_pic_nums_idc == 1)
 				{
-					unsigned int abs_diff_pic_num_minus1 = get_ue(cedarv_regs);
+					unsigned int abs_diff_pic_num_minus1 = get_ue(bs);
 
 					if (modification_of_pic_nums_idc == 0)
 						picNumL0 -= (abs_diff_pic_num_minus1 + 1);
@@ -284,7 +309,7 @@ static void ref_pic_list_modification(h264_context_t *c)
 				else if (modification_of_pic_nums_idc == 2)
 				{
 					VDPAU_DBG("NOT IMPLEMENTED: modification_of_pic_nums_idc == 2");
-					unsigned int long_term_pic_num = get_ue(cedarv_regs);
+					unsigned int long_term_pic_num = get_ue(bs);
 				}
 			} while (modification_of_pic_nums_idc != 3 && --backout > 0);
 		}
@@ -292,21 +317,21 @@ static void ref_pic_list_modification(h264_context_t *c)
 
 	if (h->slice_type == SLICE_TYPE_B)
 	{
-		int ref_pic_list_modification_flag_l1 = get_u(cedarv_regs, 1);
+		int ref_pic_list_modification_flag_l1 = get_u(bs, 1);
 		if (ref_pic_list_modification_flag_l1)
 		{
 			VDPAU_DBG("NOT IMPLEMENTED: ref_pic_list_modification_flag_l1 == 1");
 			unsigned int modification_of_pic_nums_idc;
 			do
 			{
-				modification_of_pic_nums_idc = get_ue(cedarv_regs);
+				modification_of_pic_nums_idc = get_ue(bs);
 				if (modification_of_pic_nums_idc == 0 || modification_of_pic_nums_idc == 1)
 				{
-					unsigned int abs_diff_pic_num_minus1 = get_ue(cedarv_regs);
+					unsigned int abs_diff_pic_num_minus1 = get_ue(bs);
 				}
 				else if (modification_of_pic_nums_idc == 2)
 				{
-					unsigned int long_term_pic_num = get_ue(cedarv_regs);
+					unsigned int long_term_pic_num = get_ue(bs);
 				}
 			} while (modification_of_pic_nums_idc != 3);
 		}
@@ -317,11 +342,12 @@ static void pred_weight_table(h264_context_t *c)
 {
 	h264_header_t *h = &c->header;
 	int i, j, ChromaArrayType = 1;
+	h264_bits_t *bs = &c->bits;
 	void* cedarv_regs = cedarv_get_regs();
 
-	h->luma_log2_weight_denom = get_ue(cedarv_regs);
+	h->luma_log2_weight_denom = get_ue(bs);
 	if (ChromaArrayType != 0)
-		h->chroma_log2_weight_denom = get_ue(cedarv_regs);
+		h->chroma_log2_weight_denom = get_ue(bs);
 
 	for (i = 0; i < 32; i++)
 	{
@@ -335,20 +361,20 @@ static void pred_weight_table(h264_context_t *c)
 
 	for (i = 0; i <= h->num_ref_idx_l0_active_minus1; i++)
 	{
-		int luma_weight_l0_flag = get_u(cedarv_regs, 1);
+		int luma_weight_l0_flag = get_u(bs, 1);
 		if (luma_weight_l0_flag)
 		{
-			h->luma_weight_l0[i] = get_se(cedarv_regs);
-			h->luma_offset_l0[i] = get_se(cedarv_regs);
+			h->luma_weight_l0[i] = get_se(bs);
+			h->luma_offset_l0[i] = get_se(bs);
 		}
 		if (ChromaArrayType != 0)
 		{
-			int chroma_weight_l0_flag = get_u(cedarv_regs, 1);
+			int chroma_weight_l0_flag = get_u(bs, 1);
 			if (chroma_weight_l0_flag)
 				for (j = 0; j < 2; j++)
 				{
-					h->chroma_weight_l0[i][j] = get_se(cedarv_regs);
-					h->chroma_offset_l0[i][j] = get_se(cedarv_regs);
+					h->chroma_weight_l0[i][j] = get_se(bs);
+					h->chroma_offset_l0[i][j] = get_se(bs);
 				}
 		}
 	}
@@ -356,20 +382,20 @@ static void pred_weight_table(h264_context_t *c)
 	if (h->slice_type == SLICE_TYPE_B)
 		for (i = 0; i <= h->num_ref_idx_l1_active_minus1; i++)
 		{
-			int luma_weight_l1_flag = get_u(cedarv_regs, 1);
+			int luma_weight_l1_flag = get_u(bs, 1);
 			if (luma_weight_l1_flag)
 			{
-				h->luma_weight_l1[i] = get_se(cedarv_regs);
-				h->luma_offset_l1[i] = get_se(cedarv_regs);
+				h->luma_weight_l1[i] = get_se(bs);
+				h->luma_offset_l1[i] = get_se(bs);
 			}
 			if (ChromaArrayType != 0)
 			{
-				int chroma_weight_l1_flag = get_u(cedarv_regs, 1);
+				int chroma_weight_l1_flag = get_u(bs, 1);
 				if (chroma_weight_l1_flag)
 					for (j = 0; j < 2; j++)
 					{
-						h->chroma_weight_l1[i][j] = get_se(cedarv_regs);
-						h->chroma_offset_l1[i][j] = get_se(cedarv_regs);
+						h->chroma_weight_l1[i][j] = get_se(bs);
+						h->chroma_offset_l1[i][j] = get_se(bs);
 					}
 			}
 		}
@@ -378,58 +404,62 @@ static void pred_weight_table(h264_context_t *c)
 		| ((h->luma_log2_weight_denom & 0xf) << 0)
 		, cedarv_regs + CEDARV_H264_PRED_WEIGHT);
 
-	writel(CEDARV_SRAM_H264_PRED_WEIGHT_TABLE, cedarv_regs + CEDARV_H264_RAM_WRITE_PTR);
+	uint32_t table[192], *t = table;
 	for (i = 0; i < 32; i++)
-		writel(((h->luma_offset_l0[i] & 0x1ff) << 16)
-			| (h->luma_weight_l0[i] & 0xff), cedarv_regs + CEDARV_H264_RAM_WRITE_DATA);
+		*t++ = ((h->luma_offset_l0[i] & 0x1ff) << 16) | (h->luma_weight_l0[i] & 0xff);
 	for (i = 0; i < 32; i++)
 		for (j = 0; j < 2; j++)
-			writel(((h->chroma_offset_l0[i][j] & 0x1ff) << 16)
-				| (h->chroma_weight_l0[i][j] & 0xff), cedarv_regs + CEDARV_H264_RAM_WRITE_DATA);
+			*t++ = ((h->chroma_offset_l0[i][j] & 0x1ff) << 16) | (h->chroma_weight_l0[i][j] & 0xff);
 	for (i = 0; i < 32; i++)
-		writel(((h->luma_offset_l1[i] & 0x1ff) << 16)
-			| (h->luma_weight_l1[i] & 0xff), cedarv_regs + CEDARV_H264_RAM_WRITE_DATA);
+		*t++ = ((h->luma_offset_l1[i] & 0x1ff) << 16) | (h->luma_weight_l1[i] & 0xff);
 	for (i = 0; i < 32; i++)
 		for (j = 0; j < 2; j++)
-			writel(((h->chroma_offset_l1[i][j] & 0x1ff) << 16)
-				| (h->chroma_weight_l1[i][j] & 0xff), cedarv_regs + CEDARV_H264_RAM_WRITE_DATA);
+			*t++ = ((h->chroma_offset_l1[i][j] & 0x1ff) << 16) | (h->chroma_weight_l1[i][j] & 0xff);
+
+	// default weights are the same for every slice
+	if (cedarv_table_cached(CEDARV_TABLE_H264_PRED_WEIGHT, table, 192))
+		return;
+
+	writel(CEDARV_SRAM_H264_PRED_WEIGHT_TABLE, cedarv_regs + CEDARV_H264_RAM_WRITE_PTR);
+	for (i = 0; i < 192; i++)
+		writel(table[i], cedarv_regs + CEDARV_H264_RAM_WRITE_DATA);
 }
 
 static void dec_ref_pic_marking(h264_context_t *c)
 {
-	void* cedarv_regs = cedarv_get_regs();
+	h264_bits_t *bs = &c->bits;
 
 	h264_header_t *h = &c->header;
 	// only reads bits to allow decoding, doesn't mark anything
 	if (h->nal_unit_type == 5)
 	{
-		get_u(cedarv_regs, 1);
-		get_u(cedarv_regs, 1);
+		get_u(bs, 1);
+		get_u(bs, 1);
 	}
 	else
 	{
-		int adaptive_ref_pic_marking_mode_flag = get_u(cedarv_regs, 1);
+		int adaptive_ref_pic_marking_mode_flag = get_u(bs, 1);
 		if (adaptive_ref_pic_marking_mode_flag)
 		{
 			unsigned int memory_management_control_operation;
 			do
 			{
-				memory_management_control_operation = get_ue(cedarv_regs);
+				memory_management_control_operation = get_ue(bs);
 				if (memory_management_control_operation == 1 || memory_management_control_operation == 3)
 				{
-					get_ue(cedarv_regs);
+					get_ue(bs);
 				}
 				if (memory_management_control_operation == 2)
 				{
-					get_ue(cedarv_regs);
+					get_ue(bs);
 				}
 				if (memory_management_control_operation == 3 || memory_management_control_operation == 6)
 				{
-					get_ue(cedarv_regs);
+					get_ue(bs);
 				}
 				if (memory_management_control_operation == 4)
 				{
-					get_ue(cedarv_regs);
+					get_ue(bs);
 				}
 			} while (memory_management_control_operation != 0);
 		}
@@ -552,62 +582,62 @@ static void fill_default_ref_pic_list(h264_context_t *c)
 
 static void decode_slice_header(h264_context_t *c)
 {
-	void* cedarv_regs = cedarv_get_regs();
+	h264_bits_t *bs = &c->bits;
 	h264_header_t *h = &c->header;
 	VdpPictureInfoH264 const *info = c->info;
 	h->num_ref_idx_l0_active_minus1 = info->num_ref_idx_l0_active_minus1;
 	h->num_ref_idx_l1_active_minus1 = info->num_ref_idx_l1_active_minus1;
 
-	h->first_mb_in_slice = get_ue(cedarv_regs);
-	h->slice_type = get_ue(cedarv_regs);
+	h->first_mb_in_slice = get_ue(bs);
+	h->slice_type = get_ue(bs);
 	if (h->slice_type >= 5)
 		h->slice_type -= 5;
-	h->pic_parameter_set_id = get_ue(cedarv_regs);
+	h->pic_parameter_set_id = get_ue(bs);
 
 	// separate_colour_plane_flag isn't available in VDPAU
 	/*if (separate_colour_plane_flag == 1)
 		colour_plane_id u(2)*/
 
-	h->frame_num = get_u(cedarv_regs, info->log2_max_frame_num_minus4 + 4);
+	h->frame_num = get_u(bs, info->log2_max_frame_num_minus4 + 4);
 
 	if (!info->frame_mbs_only_flag)
 	{
-		h->field_pic_flag = get_u(cedarv_regs, 1);
+		h->field_pic_flag = get_u(bs, 1);
 		if (h->field_pic_flag)
-			h->bottom_field_flag = get_u(cedarv_regs, 1);
+			h->bottom_field_flag = get_u(bs, 1);
 	}
 
 	if (h->nal_unit_type == 5)
-		h->idr_pic_id = get_ue(cedarv_regs);
+		h->idr_pic_id = get_ue(bs);
 
 	if (info->pic_order_cnt_type == 0)
 	{
-		h->pic_order_cnt_lsb = get_u(cedarv_regs, info->log2_max_pic_order_cnt_lsb_minus4 + 4);
+		h->pic_order_cnt_lsb = get_u(bs, info->log2_max_pic_order_cnt_lsb_minus4 + 4);
 		if (info->pic_order_present_flag && !info->field_pic_flag)
-			h->delta_pic_order_cnt_bottom = get_se(cedarv_regs);
+			h->delta_pic_order_cnt_bottom = get_se(bs);
 	}
 
 	if (info->pic_order_cnt_type == 1 && !info->delta_pic_order_always_zero_flag)
 	{
-		h->delta_pic_order_cnt[0] = get_se(cedarv_regs);
+		h->delta_pic_order_cnt[0] = get_se(bs);
 		if (info->pic_order_present_flag && !info->field_pic_flag)
-			h->delta_pic_order_cnt[1] = get_se(cedarv_regs);
+			h->delta_pic_order_cnt[1] = get_se(bs);
 	}
 
 	if (info->redundant_pic_cnt_present_flag)
-		h->redundant_pic_cnt = get_ue(cedarv_regs);
+		h->redundant_pic_cnt = get_ue(bs);
 
 	if (h->slice_type == SLICE_TYPE_B)
-		h->direct_spatial_mv_pred_flag = get_u(cedarv_regs, 1);
+		h->direct_spatial_mv_pred_flag = get_u(bs, 1);
 
 	if (h->slice_type == SLICE_TYPE_P || h->slice_type == SLICE_TYPE_SP || h->slice_type == SLICE_TYPE_B)
 	{
-		h->num_ref_idx_active_override_flag = get_u(cedarv_regs, 1);
+		h->num_ref_idx_active_override_flag = get_u(bs, 1);
 		if (h->num_ref_idx_active_override_flag)
 		{
-			h->num_ref_idx_l0_active_minus1 = get_ue(cedarv_regs);
+			h->num_ref_idx_l0_active_minus1 = get_ue(bs);
 			if (h->slice_type == SLICE_TYPE_B)
-				h->num_ref_idx_l1_active_minus1 = get_ue(cedarv_regs);
+				h->num_ref_idx_l1_active_minus1 = get_ue(bs);
 		}
 	}
 
@@ -625,24 +655,24 @@ static void decode_slice_header(h264_context_t *c)
 		dec_ref_pic_marking(c);
 
 	if (info->entropy_coding_mode_flag && h->slice_type != SLICE_TYPE_I && h->slice_type != SLICE_TYPE_SI)
-		h->cabac_init_idc = get_ue(cedarv_regs);
+		h->cabac_init_idc = get_ue(bs);
 
-	h->slice_qp_delta = get_se(cedarv_regs);
+	h->slice_qp_delta = get_se(bs);
 
 	if (h->slice_type == SLICE_TYPE_SP || h->slice_type == SLICE_TYPE_SI)
 	{
 		if (h->slice_type == SLICE_TYPE_SP)
-			h->sp_for_switch_flag = get_u(cedarv_regs, 1);
-		h->slice_qs_delta = get_se(cedarv_regs);
+			h->sp_for_switch_flag = get_u(bs, 1);
+		h->slice_qs_delta = get_se(bs);
 	}
 
 	if (info->deblocking_filter_control_present_flag)
 	{
-		h->disable_deblocking_filter_idc = get_ue(cedarv_regs);
+		h->disable_deblocking_filter_idc = get_ue(bs);
 		if (h->disable_deblocking_filter_idc != 1)
 		{
-			h->slice_alpha_c0_offset_div2 = get_se(cedarv_regs);
-			h->slice_beta_offset_div2 = get_se(cedarv_regs);
+			h->slice_alpha_c0_offset_div2 = get_se(bs);
+			h->slice_beta_offset_div2 = get_se(bs);
 		}
 	}
 
@@ -681,15 +711,13 @@ static void fill_frame_lists(h264_context_t *c)
                 		if (!surface_p)
 				{
 					VDPAU_DBG("non-existent reference frame, fake it");
-					surface_p = calloc(1, sizeof(h264_video_private_t));
-
-					surface_p->extra_data_len = (c->picture_width_in_mbs_minus1 + 1) * 
-									(c->picture_height_in_mbs_minus1 + 1) * 32;
-					surface_p->extra_data = cedarv_malloc(surface_p->extra_data_len);
-					surface_p->pos = 0;
-
-					surface->decoder_private = surface_p;
-					surface->decoder_private_free = h264_video_private_free;
+					surface_p = h264_video_private_get(surface, (c->picture_width_in_mbs_minus1 + 1) * 
+									(c->picture_height_in_mbs_minus1 + 1) * 32);
+					if (!surface_p)
+					{
+						handle_release(rf->surface);
+						continue;
+					}
 				}
 
 				c->ref_pic[c->ref_count].surface = surface;
@@ -754,8 +782,6 @@ static void fill_frame_lists(h264_context_t *c)
 	// sort reference frame list
 	//qsort(c->ref_pic, c->ref_count, sizeof(c->ref_pic[0]), &sort_ref_frames);
 }
-unsigned long num_pics=0;
-unsigned long num_longs=0;
 
 // VDPAU does not tell us if the scaling lists are default or custom
 static int check_scaling_lists(h264_context_t *c)
@@ -775,6 +801,22 @@ static int check_scaling_lists(h264_context_t *c)
 	return 1;
 }
 
+static void h264_slice_done(void *regs, void *arg)
+{
+	// clear status flags
+	unsigned long status = readl(regs + CEDARV_H264_STATUS);
+	writel(status, regs + CEDARV_H264_STATUS);
+	int error = readl(regs + CEDARV_H264_ERROR);
+	writel(error, regs + CEDARV_H264_ERROR);
+
+	// one count per slice, whichever of the two reports it
+	if ((status & 0x2) || error)
+	{
+		VDPAU_DBG("h264 status=0x%lX error=0x%X", status, error);
+		COUNTER_INC(h264_errors);
+	}
+}
+
 static VdpStatus h264_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info, const int len, video_surface_ctx_t *output)
 {
 	h264_private_t *decoder_p = (h264_private_t *)decoder->private;
@@ -791,21 +833,14 @@ static VdpStatus h264_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info
 	c->info = info;
 	c->output = output;
 
-	// create extra buffer
-	output_p = calloc(1, sizeof(h264_video_private_t));
-	if (!output_p)
-		return VDP_STATUS_RESOURCES;
-
-	if (!c->output->decoder_private)
+	// motion vector buffer, normally pre-attached at surface creation
+	output_p = h264_video_private_get(c->output, mv_buffer_size(c->picture_width_in_mbs_minus1 + 1,
+	                                  c->picture_height_in_mbs_minus1 + 1, c->info->frame_mbs_only_flag));
+	if (!output_p || ! cedarv_isValid(output_p->extra_data))
 	{
-        int MvColBufSize = (c->picture_height_in_mbs_minus1 + 1)*(2 - c->info->frame_mbs_only_flag);
-        MvColBufSize = (MvColBufSize+1)/2;
-        output_p->extra_data_len = (c->picture_width_in_mbs_minus1 + 1) * MvColBufSize * 32 * 2;
-		output_p->extra_data = cedarv_malloc(output_p->extra_data_len);
-        
-        c->output->decoder_private = output_p;
-        c->output->decoder_private_free = h264_video_private_free;
-    }
+		free(c);
+		return VDP_STATUS_RESOURCES;
+	}
 
     if (info->field_pic_flag)
       output_p->pic_type = PIC_TYPE_FIELD;
@@ -820,6 +855,12 @@ static VdpStatus h264_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info
     writel((readl(cedarv_regs + CEDARV_CTRL) & ~0xf) | 0x1
     | (decoder->width >= 2048 ? (0x1 << 21) : 0x0), cedarv_regs + CEDARV_CTRL);
 
+	if (!h264_scratch_lease(decoder))
+	{
+		cedarv_put();
+		free(c);
+		return VDP_STATUS_RESOURCES;
+	}
 
 	// some buffers
     uint32_t mbFieldIntraBuf = cedarv_virt2phys(decoder_p->mbFieldIntraBuf);
@@ -836,17 +877,18 @@ static VdpStatus h264_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info
 	// write custom scaling lists
 	if (!(c->default_scaling_lists = check_scaling_lists(c)))
 	{
-		const uint32_t *sl4 = (uint32_t *)&c->info->scaling_lists_4x4[0][0];
-		const uint32_t *sl8 = (uint32_t *)&c->info->scaling_lists_8x8[0][0];
-
-		writel(CEDARV_SRAM_H264_SCALING_LISTS, cedarv_regs + CEDARV_H264_RAM_WRITE_PTR);
+		uint32_t sl[2 * 64 / 4 + 6 * 16 / 4];
+		memcpy(sl, &c->info->scaling_lists_8x8[0][0], 2 * 64);
+		memcpy(sl + 2 * 64 / 4, &c->info->scaling_lists_4x4[0][0], 6 * 16);
 
-		int i;
-		for (i = 0; i < 2 * 64 / 4; i++)
-			writel(sl8[i], cedarv_regs + CEDARV_H264_RAM_WRITE_DATA);
+		if (!cedarv_table_cached(CEDARV_TABLE_H264_SCALING_LISTS, sl, 2 * 64 / 4 + 6 * 16 / 4))
+		{
+			writel(CEDARV_SRAM_H264_SCALING_LISTS, cedarv_regs + CEDARV_H264_RAM_WRITE_PTR);
 
-		for (i = 0; i < 6 * 16 / 4; i++)
-			writel(sl4[i], cedarv_regs + CEDARV_H264_RAM_WRITE_DATA);
+			int i;
+			for (i = 0; i < 2 * 64 / 4 + 6 * 16 / 4; i++)
+				writel(sl[i], cedarv_regs + CEDARV_H264_RAM_WRITE_DATA);
+		}
 	}
 
 	// sdctrl
@@ -857,18 +899,22 @@ static VdpStatus h264_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info
     writel(0x00000000, cedarv_regs + CEDARV_H264_CUR_MB_NUM);
     writel(0x00000000, cedarv_regs + CEDARV_H264_MB_ADDR);
     
-	unsigned int slice, pos = 0;
+	unsigned int slice, pos = decoder->data_offset;
 	for (slice = 0; slice < info->slice_count; slice++)
 	{
+		TRACE_BEGIN(ts);
 		h264_header_t *h = &c->header;
 		memset(h, 0, sizeof(h264_header_t));
 
-		pos = find_startcode(decoder->data, len, pos) + 3;
+		uint8_t nal_header = 0;
+		int next = decoder_find_startcode(decoder, len, pos, &nal_header);
+		pos = next + 1;
 
-		h->nal_unit_type = cedarv_byteAccess(decoder->data, pos++) & 0x1f;
+		h->nal_unit_type = nal_header & 0x1f;
 
-		if (h->nal_unit_type != 5 && h->nal_unit_type != 1)
+		if (next < 0 || (h->nal_unit_type != 5 && h->nal_unit_type != 1))
 		{
+			h264_scratch_return(decoder);
 			free(c);
 			cedarv_put();
 			return VDP_STATUS_ERROR;
@@ -881,14 +927,16 @@ static VdpStatus h264_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info
 		writel((len - pos) * 8, cedarv_regs + CEDARV_H264_VLD_LEN);
 		writel(pos * 8, cedarv_regs + CEDARV_H264_VLD_OFFSET);
 		uint32_t input_addr = cedarv_virt2phys(decoder->data);
-		writel(input_addr + VBV_SIZE - 1, cedarv_regs + CEDARV_H264_VLD_END);
+		writel(input_addr + decoder->data_size - 1, cedarv_regs + CEDARV_H264_VLD_END);
 		writel((input_addr & 0x0ffffff0) | (input_addr >> 28) | (0x7 << 28), cedarv_regs + CEDARV_H264_VLD_ADDR);
 
 		writel(0x7, cedarv_regs + CEDARV_H264_TRIGGER);
 
 		int i;
 
+		bits_init(&c->bits, decoder->host_data, pos, len);
 		decode_slice_header(c);
+		skip_bits(cedarv_regs, c->bits.count);
 
 #if 1 
 		// write RefPicLists
@@ -986,38 +1034,28 @@ static VdpStatus h264_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info
 		// SHOWTIME
 		writel(0x8, cedarv_regs + CEDARV_H264_TRIGGER);
 
-		++num_pics;
-#if TIME_MEAS
-uint64_t tv, tv2;
-		tv = get_time();
-#endif
-		cedarv_wait(1);
-
-#if TIME_MEAS
-		tv2 = get_time();
-		if (tv2-tv > 20000000) {
-			printf("cedarv_wait, longer than 20ms:%lld, pics=%ld, longs=%ld\n", tv2-tv, num_pics, ++num_longs);
+		// the last slice completes asynchronously
+		if (slice == info->slice_count - 1)
+		{
+			TRACE_END_ARG(ts, "h264_slice", slice);
+			break;
 		}
-#endif
 
-		// clear status flags
-        unsigned long status = readl(cedarv_regs + CEDARV_H264_STATUS);
-        if(status & 0x2)
-          printf("h264 status=0x%X\n", status);
-		writel(status, cedarv_regs + CEDARV_H264_STATUS);
-        int error = readl(cedarv_regs + CEDARV_H264_ERROR);
-        //if(error)
-          //printf("got error=%d while decoding frame=%ld\n", error, num_pics);
-        writel(error, cedarv_regs + CEDARV_H264_ERROR);
+		cedarv_wait(1);
+		h264_slice_done(cedarv_regs, NULL);
 
 		pos = (readl(cedarv_regs + CEDARV_H264_VLD_OFFSET) / 8) - 3;
+		TRACE_END_ARG(ts, "h264_slice", slice);
 	}
 
-#if 1 
-	// stop H264 engine
-	//writel((readl(cedarv_regs + CEDARV_CTRL) & ~0xf) | 0x7, cedarv_regs + CEDARV_CTRL);
-        cedarv_put();
-#endif
+	COUNTER_ADD(h264_slices, info->slice_count);
+	COUNTER_MAX(h264_slices_max, info->slice_count);
+
+	h264_scratch_return(decoder);
+	if (info->slice_count > 0)
+		decoder_submit(decoder, c->output, h264_slice_done, NULL);
+	else
+		cedarv_put();
         c->output->frame_decoded = 1;
 	free(c);
 	return VDP_STATUS_OK;
@@ -1029,66 +1067,11 @@ VdpStatus new_decoder_h264(decoder_ctx_t *decoder)
 	if (!decoder_p)
 		return VDP_STATUS_RESOURCES;
 
-	int extra_data_size = 320 * 1024;
 	if (cedarv_get_version() == 0x1625 || decoder->width >= 2048)
 	{
-      size_t len = ((decoder->width + 15) / 16 + 31) * 16 * 12;
-      decoder_p->deBlkDramBuf = cedarv_malloc(len);
-      if(! cedarv_isValid(decoder_p->deBlkDramBuf))
-      {
-        free(decoder_p);
-        return VDP_STATUS_RESOURCES;
-      }
-      cedarv_memset(decoder_p->deBlkDramBuf, 0, len);
-      cedarv_flush_cache(decoder_p->mbFieldIntraBuf, len);
-
-      len = ((decoder->width + 15) / 16 + 63) * 16 * 5;
-      decoder_p->intraPredDramBuf = cedarv_malloc(len);
-      if(! cedarv_isValid(decoder_p->intraPredDramBuf))
-      {
-        cedarv_free(decoder_p->deBlkDramBuf);
-        free(decoder_p);
-        return VDP_STATUS_RESOURCES;
-      }
-      cedarv_memset(decoder_p->intraPredDramBuf, 0, len);
-      cedarv_flush_cache(decoder_p->intraPredDramBuf, len);
-	}
-
-	decoder_p->extra_data = cedarv_malloc(extra_data_size);
-	if (! cedarv_isValid(decoder_p->extra_data))
-	{
-		free(decoder_p);
-		return VDP_STATUS_RESOURCES;
+		decoder_p->deBlkDramBufSize = ((decoder->width + 15) / 16 + 31) * 16 * 12;
+		decoder_p->intraPredDramBufSize = ((decoder->width + 15) / 16 + 63) * 16 * 5;
 	}
-    decoder_p->mbFieldIntraBuf = cedarv_malloc(FIELDINTRABUFSIZE);
-    if(! cedarv_isValid(decoder_p->mbFieldIntraBuf))
-    {
-      if(cedarv_isValid(decoder_p->deBlkDramBuf))
-         cedarv_free(decoder_p->deBlkDramBuf);
-      if(cedarv_isValid(decoder_p->intraPredDramBuf))
-        cedarv_free(decoder_p->intraPredDramBuf);
-      cedarv_free(decoder_p->extra_data);
-      free(decoder_p);
-      return VDP_STATUS_RESOURCES;
-    }
-
-    cedarv_memset(decoder_p->mbFieldIntraBuf, 0, FIELDINTRABUFSIZE);
-    cedarv_flush_cache(decoder_p->mbFieldIntraBuf, FIELDINTRABUFSIZE);
-        
-    decoder_p->mbNeighborInfoBuf = cedarv_malloc(NEIGHBORINFOBUFSIZE);
-    if(! cedarv_isValid(decoder_p->mbNeighborInfoBuf))
-    {
-      if(cedarv_isValid(decoder_p->deBlkDramBuf))
-         cedarv_free(decoder_p->deBlkDramBuf);
-      if(cedarv_isValid(decoder_p->intraPredDramBuf))
-        cedarv_free(decoder_p->intraPredDramBuf);
-      cedarv_free(decoder_p->mbFieldIntraBuf);
-      cedarv_free(decoder_p->extra_data);
-      free(decoder_p);
-      return VDP_STATUS_RESOURCES;
-    }
-    cedarv_memset(decoder_p->mbNeighborInfoBuf, 0, NEIGHBORINFOBUFSIZE);
-    cedarv_flush_cache(decoder_p->mbNeighborInfoBuf, NEIGHBORINFOBUFSIZE);
 
 	decoder->decode = h264_decode;
 	decoder->private = decoder_p;
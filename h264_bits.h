@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __H264_BITS_H__
+#define __H264_BITS_H__
+
+#include <stdint.h>
+
+/*
+ * Exp-Golomb reader for H.264 headers on the mapped bitstream. It skips
+ * emulation_prevention_three_byte, count is the number of RBSP bits read,
+ * which is what the VLD has to skip afterwards. Reads past length return
+ * zero bits.
+ */
+
+typedef struct
+{
+	const uint8_t *data;
+	unsigned int length;
+	unsigned int pos;
+	unsigned int bit;
+	unsigned int zeros;
+	unsigned int count;
+} h264_bits_t;
+
+static inline void bits_init(h264_bits_t *bs, const uint8_t *data, unsigned int pos, unsigned int length)
+{
+	bs->data = data;
+	bs->length = length;
+	bs->pos = pos;
+	bs->bit = 0;
+	bs->zeros = 0;
+	bs->count = 0;
+}
+
+static inline void bits_next_byte(h264_bits_t *bs)
+{
+	bs->zeros = bs->data[bs->pos] == 0x00 ? bs->zeros + 1 : 0;
+	bs->bit = 0;
+	bs->pos++;
+
+	// skip emulation_prevention_three_byte
+	if (bs->zeros >= 2 && bs->pos < bs->length && bs->data[bs->pos] == 0x03)
+	{
+		bs->zeros = 0;
+		bs->pos++;
+	}
+}
+
+static inline uint32_t get_u(h264_bits_t *bs, int num)
+{
+	uint32_t value = 0;
+
+	bs->count += num;
+	while (num > 0)
+	{
+		if (bs->pos >= bs->length)
+			return num < 32 ? value << num : 0;
+
+		int n = num < 8 - (int)bs->bit ? num : 8 - (int)bs->bit;
+		uint32_t byte = bs->data[bs->pos];
+
+		value = (value << n) | ((byte >> (8 - bs->bit - n)) & ((1 << n) - 1));
+		num -= n;
+		bs->bit += n;
+		if (bs->bit == 8)
+			bits_next_byte(bs);
+	}
+
+	return value;
+}
+
+static inline uint32_t get_ue(h264_bits_t *bs)
+{
+	int leading_zeros = 0;
+
+	while (get_u(bs, 1) == 0 && leading_zeros < 31 && bs->pos < bs->length)
+		leading_zeros++;
+
+	return ((1u << leading_zeros) - 1) + get_u(bs, leading_zeros);
+}
+
+static inline int32_t get_se(h264_bits_t *bs)
+{
+	uint32_t value = get_ue(bs);
+
+	return (value & 1) ? (int32_t)((value + 1) / 2) : -(int32_t)(value / 2);
+}
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Writes random sequences of u(n), ue(v) and se(v) elements, biased to
+ * zero bytes so 00 00 03 escapes are frequent and with ue codes of up to
+ * 31 leading zeros, adds emulation prevention and reads them back with
+ * h264_bits.h. Every element has to come back with the RBSP bit count
+ * after it. The escaped stream is then cut at random lengths, elements
+ * before the cut still have to match, reads after it have to return
+ * zero bits without reading past length.
+ *
+ *   h264_bits_test [streams]
+ *
+ * Exits with 1 on the first mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "h264_bits.h"
+
+#define MAX_ELEMENTS 256
+#define MAX_RBSP (MAX_ELEMENTS * 8)
+#define MAX_EBSP (MAX_RBSP * 3 / 2 + 4)
+#define CUTS 16
+
+enum { U, UE, SE };
+
+typedef struct
+{
+	int type;
+	int bits;		// for U
+	uint32_t value;
+	unsigned int end;	// RBSP bit position after the element
+} element_t;
+
+typedef struct
+{
+	uint8_t data[MAX_RBSP];
+	unsigned int bitpos;
+} writer_t;
+
+static void put_bits(writer_t *w, uint32_t value, int bits)
+{
+	while (bits--)
+	{
+		if ((value >> bits) & 1)
+			w->data[w->bitpos / 8] |= 0x80 >> (w->bitpos % 8);
+		w->bitpos++;
+	}
+}
+
+static void put_ue(writer_t *w, uint32_t value)
+{
+	uint64_t code = (uint64_t)value + 1;
+	int len = 0;
+
+	while ((code >> (len + 1)) != 0)
+		len++;
+
+	put_bits(w, 0, len);
+	put_bits(w, 1, 1);
+	put_bits(w, (uint32_t)code, len);
+}
+
+// mostly zeros and short codes, some long ones
+static void random_element(element_t *e)
+{
+	int r = rand() % 16;
+
+	if (r < 7)
+	{
+		e->type = U;
+		e->bits = 1 + rand() % 32;
+		e->value = r < 4 ? 0 : (((uint32_t)rand() << 16) ^ rand());
+		if (e->bits < 32)
+			e->value &= (1u << e->bits) - 1;
+	}
+	else if (r < 13)
+	{
+		// the reader stops at 31 leading zeros, the longest code is for 2^32 - 2
+		int len = r < 11 ? rand() % 4 : rand() % 32;
+		e->type = UE;
+		e->value = ((1u << len) - 1) + (len ? ((uint32_t)rand() & ((1u << len) - 1)) : 0);
+		if (len == 31 && e->value == 0xffffffff)
+			e->value--;
+	}
+	else
+	{
+		int32_t v = (rand() % 2 ? 1 : -1) * (rand() % (r == 15 ? 1 << 30 : 8));
+		e->type = SE;
+		e->value = (uint32_t)v;
+	}
+}
+
+static void write_element(writer_t *w, element_t *e)
+{
+	int32_t v;
+
+	switch (e->type)
+	{
+	case U:
+		put_bits(w, e->value, e->bits);
+		break;
+	case UE:
+		put_ue(w, e->value);
+		break;
+	case SE:
+		v = (int32_t)e->value;
+		put_ue(w, v > 0 ? 2 * (uint32_t)v - 1 : 2 * (uint32_t)-v);
+		break;
+	}
+	e->end = w->bitpos;
+}
+
+static uint32_t read_element(h264_bits_t *bs, const element_t *e)
+{
+	switch (e->type)
+	{
+	case U:
+		return get_u(bs, e->bits);
+	case UE:
+		return get_ue(bs);
+	default:
+		return (uint32_t)get_se(bs);
+	}
+}
+
+// what an encoder does to the RBSP, returns the number of escapes
+static unsigned int escape(const uint8_t *rbsp, unsigned int len, uint8_t *ebsp, unsigned int *ebsp_len)
+{
+	unsigned int i, j = 0, zeros = 0, escapes = 0;
+
+	for (i = 0; i < len; i++)
+	{
+		if (zeros >= 2 && rbsp[i] <= 0x03)
+		{
+			ebsp[j++] = 0x03;
+			zeros = 0;
+			escapes++;
+		}
+		ebsp[j++] = rbsp[i];
+		zeros = rbsp[i] == 0x00 ? zeros + 1 : 0;
+	}
+
+	*ebsp_len = j;
+	return escapes;
+}
+
+static const char *type_name(int type)
+{
+	return type == U ? "u" : type == UE ? "ue" : "se";
+}
+
+static int run(unsigned int stream, unsigned int *escapes)
+{
+	static element_t el[MAX_ELEMENTS];
+	static writer_t w;
+	static uint8_t ebsp[MAX_EBSP];
+	unsigned int i, c, count = 1 + rand() % MAX_ELEMENTS, rbsp_len, ebsp_len;
+	h264_bits_t bs;
+
+	memset(&w, 0, sizeof(w));
+	for (i = 0; i < count; i++)
+	{
+		random_element(&el[i]);
+		write_element(&w, &el[i]);
+	}
+	rbsp_len = (w.bitpos + 7) / 8;
+	*escapes += escape(w.data, rbsp_len, ebsp, &ebsp_len);
+
+	// whole stream, each element and the bit count after it
+	bits_init(&bs, ebsp, 0, ebsp_len);
+	for (i = 0; i < count; i++)
+	{
+		uint32_t value = read_element(&bs, &el[i]);
+		if (value != el[i].value || bs.count != el[i].end)
+		{
+			fprintf(stderr, "stream %u element %u: %s returned 0x%08x after %u bits instead of 0x%08x after %u\n",
+			        stream, i, type_name(el[i].type), value, bs.count, el[i].value, el[i].end);
+			return 0;
+		}
+	}
+
+	// cut streams in a buffer of their own size, so overreads are visible to a checker
+	for (c = 0; c < CUTS; c++)
+	{
+		unsigned int len = rand() % (ebsp_len + 1);
+		uint8_t *cut = malloc(len ? len : 1);
+		if (!cut)
+			return 0;
+		memcpy(cut, ebsp, len);
+
+		bits_init(&bs, cut, 0, len);
+		for (i = 0; i < count; i++)
+		{
+			unsigned int pos = bs.pos;
+			uint32_t value = read_element(&bs, &el[i]);
+
+			if (bs.pos > len)
+			{
+				fprintf(stderr, "stream %u cut at %u: element %u read up to byte %u\n", stream, len, i, bs.pos);
+				free(cut);
+				return 0;
+			}
+
+			// the reader did not reach the cut, or started behind it
+			if ((bs.pos < len && value != el[i].value) || (pos >= len && value != 0))
+			{
+				fprintf(stderr, "stream %u cut at %u: %s element %u is 0x%08x instead of 0x%08x\n",
+				        stream, len, type_name(el[i].type), i, value, pos >= len ? 0 : el[i].value);
+				free(cut);
+				return 0;
+			}
+		}
+		free(cut);
+	}
+
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, escapes = 0, streams = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000;
+
+	srand(1);
+	for (i = 0; i < streams; i++)
+		if (!run(i, &escapes))
+			return 1;
+
+	printf("%u streams with %u emulation prevention bytes read back, %u cuts each\n",
+	       streams, escapes, CUTS);
+	return 0;
+}
@@ -21,125 +21,209 @@
 #include <stdlib.h>
 #include <string.h>
 #include "vdpau_private.h"
+#include "trace.h"
+#include "counters.h"
 #include <stdio.h>
 
-#define INITIAL_SIZE 16
+/*
+ * A VdpHandle is (generation << INDEX_BITS) | (index + 1).
+ *
+ * Slots live in fixed size segments that are allocated on demand and
+ * never moved or freed, so handle_get()/handle_release() never need a
+ * lock. The generation and the refcount of a slot share one atomic word,
+ * a stale handle to a reused slot carries an old generation and fails.
+ * Only creation and the final release take the free-list mutex.
+ */
+
+#define INDEX_BITS	16
+#define INDEX_MASK	((1 << INDEX_BITS) - 1)
+#define SEGMENT_BITS	8
+#define SEGMENT_SIZE	(1 << SEGMENT_BITS)
+#define MAX_SEGMENTS	(1 << (INDEX_BITS - SEGMENT_BITS))
+/* keep index + 1 below INDEX_MASK, VDP_INVALID_HANDLE must stay unused */
+#define HANDLE_SLOTS	(INDEX_MASK - 1)
+
+#define STATE_GEN(s)	((s) >> 16)
+#define STATE_REF(s)	((s) & 0xffff)
+#define NO_INDEX	0xffffffff
 
 struct dataVault
 {
-   void*    data;
-   uint32_t refCnt;
-   enum HandleType type;
+	void *data;
+	uint32_t state;
+	enum HandleType type;
+	uint32_t next_free;
 };
 
 static struct
 {
-        struct dataVault *data;
-	size_t size;
-	pthread_rwlock_t lock;
-} ht = { .lock = PTHREAD_RWLOCK_INITIALIZER,
+	struct dataVault *segments[MAX_SEGMENTS];
+	uint32_t size;
+	uint32_t free_head;
+	pthread_mutex_t lock;
+} ht = { .lock = PTHREAD_MUTEX_INITIALIZER,
          .size = 0,
-         .data = NULL };
+         .free_head = NO_INDEX };
 
-void *handle_create(size_t size, VdpHandle *handle, enum HandleType type)
+static struct dataVault *slot_get(uint32_t index)
 {
-   unsigned int index;
-   void *data = NULL;
-   *handle = VDP_INVALID_HANDLE;
+	struct dataVault *segment;
 
-	if (pthread_rwlock_wrlock(&ht.lock))
+	if (index >= HANDLE_SLOTS)
 		return NULL;
 
-	for (index = 0; index < ht.size; index++)
-		if (ht.data[index].refCnt == 0)
-			break;
+	segment = __atomic_load_n(&ht.segments[index >> SEGMENT_BITS], __ATOMIC_ACQUIRE);
+	if (!segment)
+		return NULL;
+
+	return &segment[index & (SEGMENT_SIZE - 1)];
+}
+
+static int slot_alloc(uint32_t *index)
+{
+	if (ht.free_head != NO_INDEX)
+	{
+		*index = ht.free_head;
+		ht.free_head = slot_get(*index)->next_free;
+		return 1;
+	}
+
+	if (ht.size >= HANDLE_SLOTS)
+		return 0;
 
-	if (index >= ht.size)
+	if ((ht.size & (SEGMENT_SIZE - 1)) == 0)
 	{
-		int new_size = ht.size ? ht.size * 2 : INITIAL_SIZE;
-                struct dataVault *new_data = realloc(ht.data, new_size * sizeof(struct dataVault));
-		if (!new_data)
-			goto out;
-
-		memset(new_data + ht.size, 0, (new_size - ht.size) * sizeof(struct dataVault));
-		ht.data = new_data;
-		ht.size = new_size;
+		struct dataVault *segment = calloc(SEGMENT_SIZE, sizeof(struct dataVault));
+		if (!segment)
+			return 0;
+
+		__atomic_store_n(&ht.segments[ht.size >> SEGMENT_BITS], segment, __ATOMIC_RELEASE);
 	}
 
+	*index = ht.size++;
+	return 1;
+}
+
+void *handle_create(size_t size, VdpHandle *handle, enum HandleType type)
+{
+	uint32_t index, gen;
+	struct dataVault *slot;
+	void *data;
+	*handle = VDP_INVALID_HANDLE;
+
 	data = calloc(1, size);
 	if (!data)
-		goto out;
+		return NULL;
 
-	ht.data[index].data = data;
-        ht.data[index].refCnt = 1;
-        ht.data[index].type = type;
-	*handle = index + 1;
+	if (pthread_mutex_lock(&ht.lock))
+		goto err;
 
-out:
-	pthread_rwlock_unlock(&ht.lock);
+	if (!slot_alloc(&index))
+	{
+		pthread_mutex_unlock(&ht.lock);
+		goto err;
+	}
+
+	pthread_mutex_unlock(&ht.lock);
+
+	slot = slot_get(index);
+	slot->data = data;
+	slot->type = type;
+
+	// publish the slot, data and type have to be visible before the refcount
+	gen = STATE_GEN(__atomic_load_n(&slot->state, __ATOMIC_RELAXED));
+	__atomic_store_n(&slot->state, (gen << 16) | 1, __ATOMIC_RELEASE);
+
+	*handle = (gen << INDEX_BITS) | (index + 1);
+	COUNTER_INC(live_handles[type % COUNTER_HANDLE_TYPES]);
 	return data;
+
+err:
+	free(data);
+	return NULL;
 }
 
 void *handle_get(VdpHandle handle)
 {
-   unsigned int index = handle - 1;
-   void *data = NULL;
-      if (handle == VDP_INVALID_HANDLE)
+	uint32_t index = (handle & INDEX_MASK) - 1;
+	uint32_t gen = handle >> INDEX_BITS;
+	struct dataVault *slot;
+	uint32_t state;
+	TRACE_BEGIN(t);
+
+	if (handle == VDP_INVALID_HANDLE)
 		return NULL;
 
-	if (pthread_rwlock_rdlock(&ht.lock))
+	slot = slot_get(index);
+	if (!slot)
 		return NULL;
 
-        if (index >= 0 && index < ht.size && ht.data[index].refCnt > 0)
-        {
-		data = ht.data[index].data;
-                if(data)
-                    ht.data[index].refCnt++;
-        }
+	state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+	do
+	{
+		if (STATE_GEN(state) != gen || STATE_REF(state) == 0 || STATE_REF(state) == 0xffff)
+			return NULL;
+	} while (!__atomic_compare_exchange_n(&slot->state, &state, state + 1, 1,
+	                                      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
 
-	pthread_rwlock_unlock(&ht.lock);
-	return data;
+	TRACE_END(t, "handle_get");
+	return slot->data;
 }
 
 void handle_destroy(VdpHandle handle)
 {
-   int index = handle - 1;
-   if (pthread_rwlock_wrlock(&ht.lock))
-		return;
-
+	uint32_t index = (handle & INDEX_MASK) - 1;
+	uint32_t gen = handle >> INDEX_BITS;
+	struct dataVault *slot = slot_get(index);
+	uint32_t state;
 
-	if (index >= 0 && index < ht.size)
+	if (!slot || handle == VDP_INVALID_HANDLE)
 	{
-#if 1	
-           if(ht.data[index].refCnt > 0)
-           {
-              ht.data[index].refCnt--;
-              if(ht.data[index].refCnt == 0 && ht.data[index].data)
-              {
-                 free(ht.data[index].data);
-                 ht.data[index].data = NULL;
-              }
-           }
-#endif
+		printf("wrong handle %X\n", handle);
+		return;
 	}
-        else
-        {
-           printf("wrong handle %X\n", handle);
-        }
-	pthread_rwlock_unlock(&ht.lock);
+
+	state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+	do
+	{
+		if (STATE_GEN(state) != gen || STATE_REF(state) == 0)
+		{
+			printf("stale handle %X\n", handle);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&slot->state, &state, state - 1, 1,
+	                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	if (STATE_REF(state) != 1)
+		return;
+
+	// last reference, nobody can get the slot anymore
+	free(slot->data);
+	slot->data = NULL;
+	COUNTER_DEC(live_handles[slot->type % COUNTER_HANDLE_TYPES]);
+
+	// bump the generation so stale copies of this handle fail
+	__atomic_store_n(&slot->state, ((gen + 1) & 0xffff) << 16, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&ht.lock);
+	slot->next_free = ht.free_head;
+	ht.free_head = index;
+	pthread_mutex_unlock(&ht.lock);
 }
+
 void handle_release (VdpHandle handle)
 {
-   handle_destroy(handle);
+	handle_destroy(handle);
 }
 
 void handles_print()
 {
-	int i;
-	for(i=0; i < ht.size; ++i)
+	uint32_t i, size = ht.size;
+	for (i = 0; i < size; ++i)
 	{
-		printf("handle %d=%p\n", i+1, ht.data[i].data);
+		struct dataVault *slot = slot_get(i);
+		uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (STATE_REF(state))
+			printf("handle %X=%p refs %u\n", (STATE_GEN(state) << INDEX_BITS) | (i + 1), slot->data, STATE_REF(state));
 	}
-
 }
-
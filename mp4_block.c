@@ -382,7 +382,8 @@ int blockInter(bitstream *bs, mp4_private_t *priv, int block_num, int coded)
 
 /***/
 
-static int getDCsizeLum(bitstream *bs)
+/* reference decoders, only used to build the lookup tables */
+static int refDCsizeLum(bitstream *bs)
 {
 	int code;
 
@@ -447,7 +448,7 @@ static int getDCsizeLum(bitstream *bs)
 	return 0;
 }
 
-static int getDCsizeChr(bitstream *bs)
+static int refDCsizeChr(bitstream *bs)
 {
 	// [Ag][note] bad code
 
@@ -495,6 +496,57 @@ static int getDCsizeChr(bitstream *bs)
 	return (3 - get_bits(bs, 2));
 }
 
+static vlc_table vlcDCsizeLum, vlcDCsizeChr;
+
+static tab_type refDCsize(int code, int (*ref)(bitstream *))
+{
+	uint8_t data[2] = { code >> 4, code << 4 };
+	bitstream bs = { .data = data, .length = 2, .bitpos = 0 };
+	tab_type tab;
+
+	tab.val = ref(&bs);
+	tab.len = bs.bitpos;
+	return tab;
+}
+
+static tab_type refTableDCsizeLum(int code)
+{
+	return refDCsize(code, refDCsizeLum);
+}
+
+static tab_type refTableDCsizeChr(int code)
+{
+	return refDCsize(code, refDCsizeChr);
+}
+
+void block_init_tables(void)
+{
+	vlc_table_build(&vlcDCsizeLum, refTableDCsizeLum);
+	vlc_table_build(&vlcDCsizeChr, refTableDCsizeChr);
+}
+
+int block_check_tables(void)
+{
+	return vlc_table_check(&vlcDCsizeLum, refTableDCsizeLum, "dct_dc_size_luminance") +
+	       vlc_table_check(&vlcDCsizeChr, refTableDCsizeChr, "dct_dc_size_chrominance");
+}
+
+static int getDCsizeLum(bitstream *bs)
+{
+	const tab_type *tab = vlc_lookup(&vlcDCsizeLum, show_bits(bs, 12));
+
+	flush_bits(bs, tab->len);
+	return tab->val;
+}
+
+static int getDCsizeChr(bitstream *bs)
+{
+	const tab_type *tab = vlc_lookup(&vlcDCsizeChr, show_bits(bs, 12));
+
+	flush_bits(bs, tab->len);
+	return tab->val;
+}
+
 /***/
 
 static int getDCdiff(bitstream *bs, int dct_dc_size)
@@ -69,24 +69,6 @@ void save_tables(MP4_TABLES * tables)
 	memcpy(tables->zig_zag_scan, zig_zag_scan, sizeof(zig_zag_scan));
 	memcpy(tables->alternate_vertical_scan, alternate_vertical_scan, sizeof(alternate_vertical_scan));
 	memcpy(tables->alternate_horizontal_scan, alternate_horizontal_scan, sizeof(alternate_horizontal_scan));
-	memcpy(tables->intra_quant_matrix, intra_quant_matrix, sizeof(intra_quant_matrix));
-	memcpy(tables->nonintra_quant_matrix, nonintra_quant_matrix, sizeof(nonintra_quant_matrix));
-	memcpy(tables->msk, msk, sizeof(msk));
-	memcpy(tables->roundtab, roundtab, sizeof(roundtab));
-	memcpy(tables->saiAcLeftIndex, saiAcLeftIndex, sizeof( saiAcLeftIndex));
-	memcpy(tables->DQtab, DQtab, sizeof( DQtab));
-	memcpy(tables->MCBPCtabIntra, MCBPCtabIntra, sizeof( MCBPCtabIntra));
-	memcpy(tables->MCBPCtabInter, MCBPCtabInter, sizeof( MCBPCtabInter));
-	memcpy(tables->CBPYtab, CBPYtab, sizeof( CBPYtab));
-	memcpy(tables->MVtab0, MVtab0, sizeof( MVtab0));
-	memcpy(tables->MVtab1, MVtab1, sizeof( MVtab1));
-	memcpy(tables->MVtab2, MVtab2, sizeof( MVtab2));
-	memcpy(tables->tableB16_1, tableB16_1, sizeof( tableB16_1));
-	memcpy(tables->tableB16_2, tableB16_2, sizeof( tableB16_2));
-	memcpy(tables->tableB16_3, tableB16_3, sizeof( tableB16_3));
-	memcpy(tables->tableB17_1, tableB17_1, sizeof( tableB17_1));
-	memcpy(tables->tableB17_2, tableB17_2, sizeof( tableB17_2));
-	memcpy(tables->tableB17_3, tableB17_3, sizeof( tableB17_3));
 
 	// ftables = fopen("mp4_tables.bin", "wb");	
 	// fwrite(tables, sizeof(char), sizeof(MP4_TABLES), ftables);
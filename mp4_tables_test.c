@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Builds the MPEG-4 VLC lookup tables and compares the symbol and length
+ * of every 12 bit code (9 and 6 bits for MCBPC and CBPY) with the
+ * reference decoders they are built from. The two level tables decode
+ * codes >= 512 by their first 7 bits only, this catches a code that does
+ * not fit.
+ *
+ *   mp4_tables_test
+ *
+ * Exits with 1 if a code differs.
+ */
+
+#include <stdio.h>
+#include "mpeg4.h"
+
+int main(void)
+{
+	int errors = mpeg4_check_tables();
+
+	if (errors)
+	{
+		fprintf(stderr, "%d codes differ from the reference decoders\n", errors);
+		return 1;
+	}
+
+	printf("MPEG-4 VLC tables match the reference decoders\n");
+	return 0;
+}
@@ -38,8 +38,8 @@
 #include "mp4_vld.h"
 #include "mpeg4.h"
 
-tab_type *vldTableB16(bitstream *bs, mp4_private_t *priv, int code);
-tab_type *vldTableB17(bitstream *bs, mp4_private_t *priv, int code);
+const tab_type *vldTableB16(bitstream *bs, mp4_private_t *priv, int code);
+const tab_type *vldTableB17(bitstream *bs, mp4_private_t *priv, int code);
 event_t vld_intra_dct(bitstream *bs, mp4_private_t *priv);
 event_t vld_inter_dct(bitstream *bs, mp4_private_t *priv);
 event_t vld_event(bitstream *bs, mp4_private_t *priv, int intraFlag);
@@ -75,7 +75,7 @@ tab_type tableB17_3[] = { {4114,11}, {4114,11}, {4099,11}, {4099,11}, {11,11}, {
 event_t vld_intra_dct(bitstream *bs, mp4_private_t *priv) 
 {
 	event_t event;
-	tab_type *tab = (tab_type *) NULL;
+	const tab_type *tab = (tab_type *) NULL;
 	int lmax, rmax;
 
 	tab = vldTableB16(bs, priv, show_bits(bs, 12));
@@ -149,7 +149,7 @@ event_t vld_intra_dct(bitstream *bs, mp4_private_t *priv)
 event_t vld_inter_dct(bitstream *bs, mp4_private_t *priv) 
 {
 	event_t event;
-	tab_type *tab = (tab_type *) NULL;
+	const tab_type *tab = (tab_type *) NULL;
 	int lmax, rmax;
 
 	tab = vldTableB17(bs, priv, show_bits(bs, 12));
@@ -371,16 +371,86 @@ int vldTableB22(int last, int level) {
 
 /***/
 
-tab_type *vldTableB16(bitstream *bs, mp4_private_t *priv, int code) {
-	tab_type *tab;
+static vlc_table vlcB16, vlcB17;
+
+/* reference decoders, only used to build the lookup tables */
+static tab_type refTableB16(int code) {
+	tab_type invalid = { 0, 0 };
+
+	if (code >= 512) {
+		return tableB16_1[(code >> 5) - 16];
+	} else if (code >= 128) {
+		return tableB16_2[(code >> 2) - 32];
+	} else if (code >= 8) {
+		return tableB16_3[(code >> 0) - 8];
+	} else {
+		/* invalid Huffman code */
+		return invalid;
+	}
+}
+
+static tab_type refTableB17(int code) {
+	tab_type invalid = { 0, 0 };
 
 	if (code >= 512) {
-		tab = &(priv->tables.tableB16_1[(code >> 5) - 16]);
+		return tableB17_1[(code >> 5) - 16];
 	} else if (code >= 128) {
-		tab = &(priv->tables.tableB16_2[(code >> 2) - 32]);
+		return tableB17_2[(code >> 2) - 32];
 	} else if (code >= 8) {
-		tab = &(priv->tables.tableB16_3[(code >> 0) - 8]);
+		return tableB17_3[(code >> 0) - 8];
 	} else {
+		/* invalid Huffman code */
+		return invalid;
+	}
+}
+
+/***/
+
+void vlc_table_build(vlc_table *t, tab_type (*ref)(int code)) {
+	int code;
+
+	/* codes >= 512 are at most 7 bits long, all 32 codes of an l1 entry agree */
+	for (code = 0; code < 4096; code++) {
+		if (code >= 512)
+			t->l1[code >> 5] = ref(code);
+		else
+			t->l2[code] = ref(code);
+	}
+}
+
+void vld_init_tables(void) {
+	vlc_table_build(&vlcB16, refTableB16);
+	vlc_table_build(&vlcB17, refTableB17);
+}
+
+int vlc_table_check(const vlc_table *t, tab_type (*ref)(int code), const char *name) {
+	int code, errors = 0;
+
+	for (code = 0; code < 4096; code++) {
+		const tab_type *tab = vlc_lookup(t, code);
+		tab_type expected = ref(code);
+
+		if (tab->val != expected.val || tab->len != expected.len) {
+			if (errors++ < 8)
+				printf("%s: code 0x%03x decodes to %d/%d instead of %d/%d\n", name, code,
+				       tab->val, tab->len, expected.val, expected.len);
+		}
+	}
+
+	return errors;
+}
+
+int vld_check_tables(void) {
+	return vlc_table_check(&vlcB16, refTableB16, "B-16") +
+	       vlc_table_check(&vlcB17, refTableB17, "B-17");
+}
+
+/***/
+
+const tab_type *vldTableB16(bitstream *bs, mp4_private_t *priv, int code) {
+	const tab_type *tab = vlc_lookup(&vlcB16, code);
+
+	if (!tab->len) {
 		/* invalid Huffman code */
 		return (tab_type *) NULL;
 	}
@@ -390,16 +460,10 @@ tab_type *vldTableB16(bitstream *bs, mp4_private_t *priv, int code) {
 
 /***/
 
-tab_type *vldTableB17(bitstream *bs, mp4_private_t *priv, int code) {
-	tab_type *tab;
+const tab_type *vldTableB17(bitstream *bs, mp4_private_t *priv, int code) {
+	const tab_type *tab = vlc_lookup(&vlcB17, code);
 
-	if (code >= 512) {
-		tab = &(priv->tables.tableB17_1[(code >> 5) - 16]);
-	} else if (code >= 128) {
-		tab = &(priv->tables.tableB17_2[(code >> 2) - 32]);
-	} else if (code >= 8) {
-		tab = &(priv->tables.tableB17_3[(code >> 0) - 8]);
-	} else {
+	if (!tab->len) {
 		/* invalid Huffman code */
 		return (tab_type *) NULL;
 	}
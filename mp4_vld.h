@@ -44,6 +44,32 @@ typedef struct {
 	int val, len;
 } tab_type;
 
+/*
+ * Two level lookup of 12 bit VLCs, codes >= 512 are decoded by their
+ * first 7 bits, codes with three leading zeros by all 12 bits. Built
+ * once from a reference decoder returning the symbol of a 12 bit code.
+ */
+typedef struct {
+	tab_type l1[128];
+	tab_type l2[512];
+} vlc_table;
+
+static inline const tab_type *vlc_lookup(const vlc_table *t, int code)
+{
+	return code >= 512 ? &t->l1[code >> 5] : &t->l2[code];
+}
+
+void vlc_table_build(vlc_table *t, tab_type (*ref)(int code));
+void vld_init_tables(void);
+void block_init_tables(void);
+
+/* compare every code of the built tables with the reference decoders,
+   return the number of differences */
+int vlc_table_check(const vlc_table *t, tab_type (*ref)(int code), const char *name);
+int vld_check_tables(void);
+int block_check_tables(void);
+int mpeg4_check_tables(void);
+
 /***/
 
 typedef struct {
@@ -69,34 +95,12 @@ extern tab_type tableB17_3[];
 
 /***/
 
+/* per decoder copies, the VLCs decode through the shared vlc_tables */
 typedef struct _MP4_TABLES_
 {
 	unsigned int zig_zag_scan[64];
 	unsigned int alternate_vertical_scan[64];
 	unsigned int alternate_horizontal_scan[64];
-	unsigned int intra_quant_matrix[64];
-	unsigned int nonintra_quant_matrix[64];
-
-	unsigned int msk[33];
-
-	int roundtab[16];
-	int saiAcLeftIndex[8];
-	int DQtab[4];
-
-	tab_type MCBPCtabIntra[32];
-	tab_type MCBPCtabInter[256];
-	tab_type CBPYtab[48];
-
-	tab_type MVtab0[14];
-	tab_type MVtab1[96];
-	tab_type MVtab2[124];
-
-	tab_type tableB16_1[112];
-	tab_type tableB16_2[96];
-	tab_type tableB16_3[120];
-	tab_type tableB17_1[112];
-	tab_type tableB17_2[96];
-	tab_type tableB17_3[120];
 } MP4_TABLES;
 
 
@@ -36,57 +36,53 @@ static const uint8_t zigzag_scan[64] =
 };
 
 
-static int mpeg_find_startcode(CEDARV_MEMORY mem, int len)
+static int mpeg_find_startcode(decoder_ctx_t *decoder, int len)
 {
-	int pos = 0;
-	uint8_t *data = cedarv_getPointer(mem);
-	while (pos < len)
-	{
-		int zeros = 0;
-		for ( ; pos < len; pos++)
-		{
-			if (data[pos] == 0x00)
-				zeros++;
-			else if (data[pos] == 0x01 && zeros >= 2)
-			{
-				pos++;
-				break;
-			}
-			else
-				zeros = 0;
-		}
-
-		uint8_t marker = data[pos++];
+	int pos = decoder->data_offset;
+	uint8_t marker;
 
+	// first slice start code
+	while ((pos = decoder_find_startcode(decoder, len, pos, &marker)) >= 0)
+	{
 		if (marker >= 0x01 && marker <= 0xaf)
-			return pos - 4;
+			return pos - 3;
 	}
-	return 0;
+	return decoder->data_offset;
+}
+
+static void mpeg12_done(void *regs, void *arg)
+{
+	// clean interrupt flag
+	writel(0x0000c00f, regs + CEDARV_MPEG_STATUS);
 }
-static unsigned long num_pics=0;
-static unsigned long num_longs=0;
 
 static VdpStatus mpeg12_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info, const int len, video_surface_ctx_t *output)
 {
 	VdpPictureInfoMPEG1Or2 const *info = (VdpPictureInfoMPEG1Or2 const *)_info;
-	int start_offset = mpeg_find_startcode(decoder->data, len);
+	int start_offset = mpeg_find_startcode(decoder, len);
 
 	int i;
+	uint32_t iq[128];
+
+	for (i = 0; i < 64; i++)
+	{
+		iq[i] = (uint32_t)(64 + zigzag_scan[i]) << 8 | info->intra_quantizer_matrix[i];
+		iq[64 + i] = (uint32_t)(zigzag_scan[i]) << 8 | info->non_intra_quantizer_matrix[i];
+	}
 
 	// activate MPEG engine
 	void *cedarv_regs = cedarv_get(CEDARV_ENGINE_MPEG, 0);
 
 	// set quantisation tables
-	for (i = 0; i < 64; i++)
-		writel((uint32_t)(64 + zigzag_scan[i]) << 8 | info->intra_quantizer_matrix[i], cedarv_regs + CEDARV_MPEG_IQ_MIN_INPUT);
-	for (i = 0; i < 64; i++)
-		writel((uint32_t)(zigzag_scan[i]) << 8 | info->non_intra_quantizer_matrix[i], cedarv_regs + CEDARV_MPEG_IQ_MIN_INPUT);
+	if (!cedarv_table_cached(CEDARV_TABLE_MPEG_IQ, iq, 128))
+		for (i = 0; i < 128; i++)
+			writel(iq[i], cedarv_regs + CEDARV_MPEG_IQ_MIN_INPUT);
 
 	// set size
 	uint16_t width = (decoder->width + 15) / 16;
 	uint16_t height = (decoder->height + 15) / 16;
-	writel((width << 8) | height, cedarv_regs + CEDARV_MPEG_SIZE);
-	writel(((width * 16) << 16) | (height * 16), cedarv_regs + CEDARV_MPEG_FRAME_SIZE);
+	cedarv_writel_cached((width << 8) | height, CEDARV_MPEG_SIZE);
+	cedarv_writel_cached(((width * 16) << 16) | (height * 16), CEDARV_MPEG_FRAME_SIZE);
 
 	// set picture header
 	uint32_t pic_header = 0;
@@ -148,7 +144,7 @@ static VdpStatus mpeg12_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_in
 
 	// input end
 	uint32_t input_addr = cedarv_virt2phys(decoder->data);
-	writel(input_addr + VBV_SIZE - 1, cedarv_regs + CEDARV_MPEG_VLD_END);
+	writel(input_addr + decoder->data_size - 1, cedarv_regs + CEDARV_MPEG_VLD_END);
 
 	// set input buffer
 	writel((input_addr & 0x0ffffff0) | (input_addr >> 28) | (0x7 << 28), cedarv_regs + CEDARV_MPEG_VLD_ADDR);
@@ -156,22 +152,8 @@ static VdpStatus mpeg12_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_in
 	// trigger
 	writel((((decoder->profile == VDP_DECODER_PROFILE_MPEG1) ? 1 : 2) << 24) | 0x8000000f, cedarv_regs + CEDARV_MPEG_TRIGGER);
 
-	// wait for interrupt
-	++num_pics;
-uint64_t tv, tv2;
-	tv = get_time();
-	cedarv_wait(1);
-	tv2 = get_time();
-	if (tv2-tv > 10000000) {
-		printf("cedarv_wait, longer than 10ms:%lld, pics=%ld, longs=%ld\n", tv2-tv, num_pics, ++num_longs);
-		}
-	
-
-	// clean interrupt flag
-	writel(0x0000c00f, cedarv_regs + CEDARV_MPEG_STATUS);
-
-	// stop MPEG engine
-	cedarv_put();
+	// release the engine, the interrupt is handled when the surface is consumed
+	decoder_submit(decoder, output, mpeg12_done, NULL);
         output->frame_decoded = 1;
         
 	return VDP_STATUS_OK;
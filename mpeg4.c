@@ -21,6 +21,8 @@
 #include "vdpau_private.h"
 #include "ve.h"
 #include "veisp.h"
+#include "trace.h"
+#include "counters.h"
 #include <time.h>
 #include <assert.h>
 #include "bitstream.h"
@@ -29,8 +31,7 @@
 #include "mp4_vars.h"
 #include <stdio.h>
 #include <unistd.h>
-
-//#define TIMEMEAS 1
+#include <pthread.h>
 
 #define USE_ISP_HW 0
 #define USE_XY_CONV 0
@@ -38,133 +39,15 @@
 #define USE_ISP_SW 0
 
 static int mpeg4_calcResyncMarkerLength(mp4_private_t *decoder_p);
-uint32_t show_bits_aligned(bitstream *bs, int n, int aligned);
-
-static int find_startcode(bitstream *bs)
-{
-	unsigned int pos, zeros = 0;
-	for (pos = bs->bitpos / 8; pos < bs->length; pos++)
-	{
-		if (bs->data[pos] == 0x00)
-			zeros++;
-		else if (bs->data[pos] == 0x01 && zeros >= 2)
-		{
-			bs->bitpos = (pos + 1) * 8;
-			return 1;
-		}
-		else
-			zeros = 0;
-	}
-
-	return 0;
-}
-
-uint32_t show_bits(bitstream *bs, int n)
-{
-    return show_bits_aligned(bs, n, 0);
-
-#if 0
-    uint32_t bits = 0;
-    int remaining_bits = n;
-    int save_bitpos = bs->bitpos;
-
-    while (remaining_bits > 0)
-    {
-            int bits_in_current_byte = 8 - (bs->bitpos & 7);
 
-            int trash_bits = 0;
-            if (remaining_bits < bits_in_current_byte)
-                    trash_bits = bits_in_current_byte - remaining_bits;
-
-            int useful_bits = bits_in_current_byte - trash_bits;
-
-            bits = (bits << useful_bits) | (bs->data[bs->bitpos / 8] >> trash_bits);
-
-            remaining_bits -= useful_bits;
-            bs->bitpos += useful_bits;
-    }
-
-    bs->bitpos = save_bitpos;
-
-    return bits & ((1 << n) - 1);
-#endif
-}
-
-uint32_t show_bits_aligned(bitstream *bs, int n, int aligned)
+static int find_startcode(decoder_ctx_t *decoder, bitstream *bs)
 {
-    uint32_t bits = 0;
-    int remaining_bits = n;
-    int bitpos;
-
-    if(aligned)
-        bitpos = (bs->bitpos+7) & ~7;
-    else
-        bitpos = bs->bitpos;
-
-    while (remaining_bits > 0)
-    {
-        int bits_in_current_byte = 8 - (bs->bitpos & 7);
-
-        int trash_bits = 0;
-        if (remaining_bits < bits_in_current_byte)
-                trash_bits = bits_in_current_byte - remaining_bits;
-
-        int useful_bits = bits_in_current_byte - trash_bits;
-
-        bits = (bits << useful_bits) | (bs->data[bitpos / 8] >> trash_bits);
-
-        remaining_bits -= useful_bits;
-        bitpos += useful_bits;
-    }
-
-    return bits & ((1 << n) - 1);
-}
-
-uint32_t get_bits(bitstream *bs, int n)
-{
-    uint32_t bits = 0;
-    int remaining_bits = n;
-
-    while (remaining_bits > 0)
-    {
-            int bits_in_current_byte = 8 - (bs->bitpos & 7);
-
-            int trash_bits = 0;
-            if (remaining_bits < bits_in_current_byte)
-                    trash_bits = bits_in_current_byte - remaining_bits;
-
-            int useful_bits = bits_in_current_byte - trash_bits;
-
-            bits = (bits << useful_bits) | (bs->data[bs->bitpos / 8] >> trash_bits);
-
-            remaining_bits -= useful_bits;
-            bs->bitpos += useful_bits;
-    }
-
-    return bits & ((1 << n) - 1);
-}
+	int pos = decoder_find_startcode(decoder, bs->length, bs->bitpos / 8, NULL);
+	if (pos < 0)
+		return 0;
 
-int bytealign(bitstream *bs)
-{
-    bs->bitpos = ((bs->bitpos+7) >> 3) << 3;
-    if(bs->bitpos > bs->length * 8)
-    {
-        bs->bitpos = bs->length * 8;
-        return 1;
-    }
-    return 0;
-}
-int  bytealigned(bitstream *bs, int nbit)
-{
-    return (((bs->bitpos + nbit) % 8) == 0);
-}
-void flush_bits(bitstream *bs, int nbit)
-{
-    bs->bitpos += nbit;
-}
-int bits_left(bitstream *bs)
-{
-    return(bs->bitpos/8 < bs->length);
+	bs->bitpos = pos * 8;
+	return 1;
 }
 
 int nextbits_bytealigned(bitstream *bs, int nbit)
@@ -234,6 +117,8 @@ static void mp4_private_free(decoder_ctx_t *decoder)
     cedarv_free(decoder_p->mbh_buffer);
     cedarv_free(decoder_p->dcac_buffer);
     cedarv_free(decoder_p->ncf_buffer);
+    free(decoder_p->packets);
+    free(decoder_p->mv_rows);
     free(decoder_p);
 }
 
@@ -343,116 +228,183 @@ static int get_gob_height(int height)
     return gob_height;
 }
 
-static int getMCBPC(bitstream *bs, mp4_private_t *priv)
+// built once, shared read-only by all decoders
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static tab_type mcbpcIntra[512], mcbpcInter[512], cbpy[64];
+static vlc_table vlcMV;
+
+/* reference decoders of the lookup tables, code is the next 9, 6 or 12 bits */
+static tab_type refMCBPCIntra(int code)
 {
-    vop_header_t *h = &priv->vop_header;
+    tab_type tab = { -1, 0 };
 
-	if (h->vop_coding_type == VOP_I)
-	{
-		int code = show_bits(bs, 9);
+    if (code == 1) {
+        tab.val = 0; // stuffing
+        tab.len = 9;
+    }
+    else if (code >= 256) {
+        tab.val = 3;
+        tab.len = 1;
+    }
+    else if (code >= 8) {
+        tab.val = MCBPCtabIntra[code >> 3].val;
+        tab.len = MCBPCtabIntra[code >> 3].len;
+    }
+    return tab;
+}
 
-		if (code == 1) {
-			get_bits(bs, 9); // stuffing
-			return 0;
-		}
-		else if (code < 8) {
-			return -1;
-		}
+static tab_type refMCBPCInter(int code)
+{
+    tab_type tab = { -1, 0 };
 
-		code >>= 3;
-		if (code >= 32) {
-			get_bits(bs, 1);
-			return 3;
-		}
-		
-		get_bits(bs, MCBPCtabIntra[code].len);
-		return MCBPCtabIntra[code].val;
-	}
-	else
-	{
-		int code = show_bits(bs, 9);
+    if (code == 1) {
+        tab.val = 0; // stuffing
+        tab.len = 9;
+    }
+    else if (code >= 256) {
+        tab.val = 0;
+        tab.len = 1;
+    }
+    else if (code != 0) {
+        tab.val = MCBPCtabInter[code].val;
+        tab.len = MCBPCtabInter[code].len;
+    }
+    return tab;
+}
 
-		if (code == 1) {
-			get_bits(bs, 9); // stuffing
-			return 0;
-		}
-		else if (code == 0)	{
-			return -1;
-		}
-		
-		if (code >= 256)
-		{
-			get_bits(bs, 1);
-			return 0;
-		}
-		
-		get_bits(bs, MCBPCtabInter[code].len);
-		return MCBPCtabInter[code].val;
-	}
+static tab_type refCBPY(int code)
+{
+    tab_type tab = { -1, 0 };
+
+    if (code >= 48) {
+        tab.val = 15;
+        tab.len = 2;
+    }
+    else if (code >= 2) {
+        tab.val = CBPYtab[code].val;
+        tab.len = CBPYtab[code].len;
+    }
+    return tab;
+}
+
+static tab_type refMV(int code)
+{
+    tab_type tab = { 0, 0 };
+    const VLCtabMb *mv = NULL;
+
+    if (code >= 512)
+        mv = &MVtab0[(code >> 8) - 2];
+    else if (code >= 128)
+        mv = &MVtab1[(code >> 2) - 32];
+    else if (code >= 4)
+        mv = &MVtab2[code - 4];
+
+    if (mv) {
+        tab.val = mv->val;
+        tab.len = mv->len;
+    }
+    return tab;
+}
+
+static void mpeg4_init_tables(void)
+{
+    int code;
+
+    for (code = 0; code < 512; code++)
+    {
+        mcbpcIntra[code] = refMCBPCIntra(code);
+        mcbpcInter[code] = refMCBPCInter(code);
+    }
+    for (code = 0; code < 64; code++)
+        cbpy[code] = refCBPY(code);
+
+    vlc_table_build(&vlcMV, refMV);
+    vld_init_tables();
+    block_init_tables();
+}
+
+static int check_flat(const tab_type *t, tab_type (*ref)(int code), int bits, const char *name)
+{
+    int code, errors = 0;
+
+    for (code = 0; code < (1 << bits); code++)
+    {
+        tab_type expected = ref(code);
+        if (t[code].val != expected.val || t[code].len != expected.len)
+        {
+            if (errors++ < 8)
+                printf("%s: code 0x%03x decodes to %d/%d instead of %d/%d\n", name, code,
+                       t[code].val, t[code].len, expected.val, expected.len);
+        }
+    }
+
+    return errors;
+}
+
+// for tests, builds the tables like the first decoder would
+int mpeg4_check_tables(void)
+{
+    pthread_once(&tables_once, mpeg4_init_tables);
+
+    return check_flat(mcbpcIntra, refMCBPCIntra, 9, "mcbpc intra") +
+           check_flat(mcbpcInter, refMCBPCInter, 9, "mcbpc inter") +
+           check_flat(cbpy, refCBPY, 6, "cbpy") +
+           vlc_table_check(&vlcMV, refMV, "motion_code") +
+           vld_check_tables() +
+           block_check_tables();
+}
+
+static int getMCBPC(bitstream *bs, mp4_private_t *priv)
+{
+    vop_header_t *h = &priv->vop_header;
+    const tab_type *tab = h->vop_coding_type == VOP_I ? &mcbpcIntra[show_bits(bs, 9)] : &mcbpcInter[show_bits(bs, 9)];
+
+    flush_bits(bs, tab->len);
+    return tab->val;
 }
 
 static int getCBPY(bitstream *bs, mp4_private_t *priv)
 {
     vop_header_t *h = &priv->vop_header;
-    int cbpy;
-    int code = show_bits(bs, 6);
+    const tab_type *tab = &cbpy[show_bits(bs, 6)];
 
-    if (code < 2) {
+    if (tab->val < 0)
         return -1;
-    }
-                        
-    if (code >= 48) {
-        get_bits(bs,2);
-        cbpy = 15;
-    } else {
-        get_bits(bs, CBPYtab[code].len);
-        cbpy = CBPYtab[code].val;
-    }
 
+    flush_bits(bs, tab->len);
     if (!((h->derived_mb_type == 3) ||
         (h->derived_mb_type == 4)))
-            cbpy = 15 - cbpy;
+            return 15 - tab->val;
 
-  return cbpy;
+    return tab->val;
 }
 static int getMVdata(bitstream *bs, mp4_private_t *priv)
 {
-	int code;
+	const tab_type *tab;
 
 	if (get_bits(bs, 1)) {
 		return 0; // hor_mv_data == 0
   }
-	
-	code = show_bits(bs, 12);
 
-	if (code >= 512)
-  {
-		code = (code >> 8) - 2;
-		get_bits(bs, MVtab0[code].len);
-		return MVtab0[code].val;
-  }
-	
-	if (code >= 128)
-  {
-		code = (code >> 2) - 32;
-		get_bits(bs, MVtab1[code].len);
-		return MVtab1[code].val;
-  }
-
-	code -= 4; 
-
-	assert(code >= 0);
+	tab = vlc_lookup(&vlcMV, show_bits(bs, 12));
+	assert(tab->len);
 
-	get_bits(bs, MVtab2[code].len);
-	return MVtab2[code].val;
+	flush_bits(bs, tab->len);
+	return tab->val;
 }
+// y and x include the border, row y - 1 is only valid while decoding row y
+static inline int16_t *mv_at(mp4_private_t *priv, int comp, int block, int y, int x)
+{
+	return &priv->mv_rows[(y & 1) * priv->mv_stride + x].mv[comp][block];
+}
+
 static int find_pmv (bitstream *bs, mp4_private_t *priv, int block, int comp)
 {
   int p1, p2, p3;
   int xin1, xin2, xin3;
   int yin1, yin2, yin3;
   int vec1, vec2, vec3;
-  video_packet_header_t *vp = &priv->vop_header;
+  video_packet_header_t *vp = &priv->pkt_hdr;
 
 	int x = vp->mb_xpos;
 	int y = vp->mb_ypos;
@@ -462,9 +414,9 @@ static int find_pmv (bitstream *bs, mp4_private_t *priv, int block, int comp)
 		if ((x == 0) && (block == 0))
 			return 0;
 		else if (block == 1)
-			return priv->MV[comp][0][y+1][x+1];
+			return *mv_at(priv, comp, 0, y+1, x+1);
 		else // block == 0
-			return priv->MV[comp][1][y+1][x+1-1];
+			return *mv_at(priv, comp, 1, y+1, x+1-1);
 	}
 	else
 	{
@@ -495,15 +447,27 @@ static int find_pmv (bitstream *bs, mp4_private_t *priv, int block, int comp)
 				vec3 = 1;	yin3 = y;		xin3 = x;
 				break;
 		}
-		p1 = priv->MV[comp][vec1][yin1][xin1];
-		p2 = priv->MV[comp][vec2][yin2][xin2];
-		p3 = priv->MV[comp][vec3][yin3][xin3];
+		p1 = *mv_at(priv, comp, vec1, yin1, xin1);
+		p2 = *mv_at(priv, comp, vec2, yin2, xin2);
+		p3 = *mv_at(priv, comp, vec3, yin3, xin3);
 
 		// return p1 + p2 + p3 - mmax (p1, mmax (p2, p3)) - mmin (p1, mmin (p2, p3));
 		return mmin(mmax(p1, p2), mmin(mmax(p2, p3), mmax(p1, p3)));
 	}
 }
 
+int16_t *mpeg4_mv_at(mp4_private_t *priv, int comp, int block, int y, int x)
+{
+	return mv_at(priv, comp, block, y, x);
+}
+
+int mpeg4_find_pmv(mp4_private_t *priv, int mb_x, int mb_y, int block, int comp)
+{
+	priv->pkt_hdr.mb_xpos = mb_x;
+	priv->pkt_hdr.mb_ypos = mb_y;
+	return find_pmv(NULL, priv, block, comp);
+}
+
 static int setMV(bitstream *bs, mp4_private_t *priv, int block_num)
 {
     vop_header_t *h = &priv->vop_header;
@@ -577,13 +541,13 @@ static int setMV(bitstream *bs, mp4_private_t *priv, int block_num)
 	if (block_num == -1) {
 		int i;
 		for (i = 0; i < 4; i++) {
-			priv->MV[0][i][vp->mb_ypos+1][vp->mb_xpos+1] = mv_x;
-			priv->MV[1][i][vp->mb_ypos+1][vp->mb_xpos+1] = mv_y;
+			*mv_at(priv, 0, i, vp->mb_ypos+1, vp->mb_xpos+1) = mv_x;
+			*mv_at(priv, 1, i, vp->mb_ypos+1, vp->mb_xpos+1) = mv_y;
 		}
 	}
 	else {
-		priv->MV[0][block_num][vp->mb_ypos+1][vp->mb_xpos+1] = mv_x;
-		priv->MV[1][block_num][vp->mb_ypos+1][vp->mb_xpos+1] = mv_y;
+		*mv_at(priv, 0, block_num, vp->mb_ypos+1, vp->mb_xpos+1) = mv_x;
+		*mv_at(priv, 1, block_num, vp->mb_ypos+1, vp->mb_xpos+1) = mv_y;
 	}
 
 //  _Print("Hor MotV: %d\n", mv_x);
@@ -669,8 +633,8 @@ static int macroblock(bitstream *bs, mp4_private_t *priv)
                                     int i;
     #if 1
                                     for (i = 0; i < 4; i++) {
-                                            priv->MV[0][i][vp->mb_ypos+1][vp->mb_xpos+1] = 0;
-                                            priv->MV[1][i][vp->mb_ypos+1][vp->mb_xpos+1] = 0;
+                                            *mv_at(priv, 0, i, vp->mb_ypos+1, vp->mb_xpos+1) = 0;
+                                            *mv_at(priv, 1, i, vp->mb_ypos+1, vp->mb_xpos+1) = 0;
                                     }
     #endif
                             }
@@ -708,14 +672,14 @@ static int macroblock(bitstream *bs, mp4_private_t *priv)
     
             // not coded macroblock
             else {
-                    priv->MV[0][0][vp->mb_ypos+1][vp->mb_xpos+1] = 
-            priv->MV[0][1][vp->mb_ypos+1][vp->mb_xpos+1] =
-                    priv->MV[0][2][vp->mb_ypos+1][vp->mb_xpos+1] = 
-            priv->MV[0][3][vp->mb_ypos+1][vp->mb_xpos+1] = 0;
-                    priv->MV[1][0][vp->mb_ypos+1][vp->mb_xpos+1] = 
-            priv->MV[1][1][vp->mb_ypos+1][vp->mb_xpos+1] =
-                    priv->MV[1][2][vp->mb_ypos+1][vp->mb_xpos+1] = 
-            priv->MV[1][3][vp->mb_ypos+1][vp->mb_xpos+1] = 0;
+                    *mv_at(priv, 0, 0, vp->mb_ypos+1, vp->mb_xpos+1) = 
+            *mv_at(priv, 0, 1, vp->mb_ypos+1, vp->mb_xpos+1) =
+                    *mv_at(priv, 0, 2, vp->mb_ypos+1, vp->mb_xpos+1) = 
+            *mv_at(priv, 0, 3, vp->mb_ypos+1, vp->mb_xpos+1) = 0;
+                    *mv_at(priv, 1, 0, vp->mb_ypos+1, vp->mb_xpos+1) = 
+            *mv_at(priv, 1, 1, vp->mb_ypos+1, vp->mb_xpos+1) =
+                    *mv_at(priv, 1, 2, vp->mb_ypos+1, vp->mb_xpos+1) = 
+            *mv_at(priv, 1, 3, vp->mb_ypos+1, vp->mb_xpos+1) = 0;
     
     #if 0
                     //mp4_state->modemap[mp4_state->hdr.mb_ypos+1][mp4_state->hdr.mb_xpos+1] = NOT_CODED; // [Review] used only in P-VOPs
@@ -1205,23 +1169,53 @@ static int mpeg4_process_macroblock(bitstream *bs, decoder_ctx_t *decoder)
     h->num_gop_mbas = mba;
 }
 
-static int decode_vop_header(bitstream *bs, VdpPictureInfoMPEG4Part2 const *info, decoder_ctx_t *decoder)
+/*
+ * Reads modulo_time_base and vop_time_increment, the result counts in
+ * ticks of vop_time_increment_resolution from the last full second of the
+ * previous I- or P-VOP.
+ */
+static int vop_time(bitstream *bs, VdpPictureInfoMPEG4Part2 const *info)
 {
-    int dummy;
-    mp4_private_t *priv = (mp4_private_t *)decoder->private;
-    vop_header_t *h = &priv->vop_header;
-    VdpDecoderMpeg4VolHeader *vol = &priv->mpeg4VolHdr;
-
-	h->vop_coding_type = get_bits(bs, 2);
+	int seconds = 0;
 
 	// modulo_time_base
-	while (get_bits(bs, 1) != 0);
+	while (get_bits(bs, 1) != 0)
+		seconds++;
 
 	if (get_bits(bs, 1) != 1)
 		VDPAU_DBG("vop header marker error");
 
 	// vop_time_increment
-	get_bits(bs, 32 - __builtin_clz(info->vop_time_increment_resolution));
+	return seconds * info->vop_time_increment_resolution +
+	       get_bits(bs, 32 - __builtin_clz(info->vop_time_increment_resolution));
+}
+
+/*
+ * Returns the vop_coded flag of the VOP header at bs and its time without
+ * changing the decoder state, bs is passed by value.
+ */
+static int vop_is_coded(bitstream bs, VdpPictureInfoMPEG4Part2 const *info, int *time)
+{
+	// vop_coding_type
+	flush_bits(&bs, 2);
+
+	*time = vop_time(&bs, info);
+
+	// marker
+	flush_bits(&bs, 1);
+
+	return get_bits(&bs, 1);
+}
+
+static int decode_vop_header(bitstream *bs, VdpPictureInfoMPEG4Part2 const *info, decoder_ctx_t *decoder)
+{
+    int dummy;
+    mp4_private_t *priv = (mp4_private_t *)decoder->private;
+    vop_header_t *h = &priv->vop_header;
+    VdpDecoderMpeg4VolHeader *vol = &priv->mpeg4VolHdr;
+
+	h->vop_coding_type = get_bits(bs, 2);
+	h->vop_time = vop_time(bs, info);
 
 	if (get_bits(bs, 1) != 1)
 		VDPAU_DBG("vop header marker error");
@@ -1482,6 +1476,7 @@ int mpeg4_decode_packet_header(bitstream *gb, VdpPictureInfoMPEG4Part2 const *in
             }
         }
     }
+    return 0;
 }
 #endif
 
@@ -1508,22 +1503,63 @@ static int mpeg4_calcResyncMarkerLength(mp4_private_t *decoder_p)
     return marker_length;
 }
 
+/*
+ * Finds the next resync marker after bs and decodes the video packet
+ * header behind it into pkt. Returns 0 if prev is the last packet.
+ */
+static int mpeg4_next_packet(bitstream *bs, VdpPictureInfoMPEG4Part2 const *info, decoder_ctx_t *decoder,
+                             int marker_length, const mp4_packet_t *prev, mp4_packet_t *pkt)
+{
+    mp4_private_t *decoder_p = (mp4_private_t *)decoder->private;
+
+    if (!find_resynccode(bs, marker_length))
+        return 0;
+
+    if (mpeg4_decode_packet_header(bs, info, decoder, decoder_p) < 0 ||
+        decoder_p->pkt_hdr.mb_num <= prev->mb_num)
+        return 0;
+
+    decoder_p->vop_header.quantizer = decoder_p->vop_header.vop_quant;
+
+    pkt->bitpos = bs->bitpos;
+    pkt->mb_num = decoder_p->pkt_hdr.mb_num;
+    pkt->mb_x = decoder_p->pkt_hdr.mb_x;
+    pkt->mb_y = decoder_p->pkt_hdr.mb_y;
+    pkt->quant = decoder_p->vop_header.vop_quant;
+    return 1;
+}
+
 static unsigned long num_pics=0;
-static unsigned long num_longs=0;
+
+static void mpeg4_done(void *regs, void *arg)
+{
+    // clean interrupt flag
+    writel(0x0000c00f, regs + CEDARV_MPEG_STATUS);
+    int error = readl(regs + CEDARV_MPEG_ERROR);
+    if(error)
+    {
+        VDPAU_DBG("got error=%d while decoding frame=%ld", error, num_pics);
+        COUNTER_INC(mpeg_errors);
+    }
+    writel(0x0, regs + CEDARV_MPEG_ERROR);
+
+    ++num_pics;
+
+    writel(readl(regs + CEDARV_MPEG_CTRL) | 0x7C, regs + CEDARV_MPEG_CTRL);
+}
+
 int mpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info, const int len, video_surface_ctx_t *output)
 {
-    VdpPictureInfoMPEG4Part2 const *info = (VdpPictureInfoMPEG4Part2 const *)_info;
     mp4_private_t *decoder_p = (mp4_private_t *)decoder->private;
+    VdpPictureInfoMPEG4Part2 const *info = decoder_p->packed_pending ? &decoder_p->packed_info : _info;
+    decoder_p->packed_pending = 0;
     VdpDecoderMpeg4VolHeader *vol = &decoder_p->mpeg4VolHdr;
 
     uint32_t    startcode;
-    int        more_mbs = 1;
     uint32_t   mp4mbaAddr_reg = 0;
     decoder_p->pkt_hdr.mb_xpos = 0;
     decoder_p->pkt_hdr.mb_ypos = 0;
-    uint32_t mba_reg = 0x0;
     static int vop_s_frame_seen = 0;
-    int last_mba = 0;
     static int image_saved = 0;
     uint16_t width;
     uint16_t height;
@@ -1542,18 +1578,55 @@ int mpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info,
         	return VDP_STATUS_ERROR;
 	}
 */
-	int i;
+	int i, decoded = 0;
 	void *cedarv_regs = cedarv_get_regs();
-	bitstream bs = { .data = cedarv_getPointer(decoder->data), .length = len, .bitpos = 0 };
+	bitstream bs = { .data = decoder->host_data, .length = len, .bitpos = decoder->data_offset * 8 };
     
-	while (find_startcode(&bs))
+	while (find_startcode(decoder, &bs))
 	{
+            unsigned int vop_start = bs.bitpos / 8 - 3;
             startcode = get_bits(&bs, 8);
             if ( startcode != 0xb6)
                             continue;
 
+            // packed bitstream (DivX B-frames), the next coded VOP is the
+            // B-VOP between the forward_reference of this call and the P-VOP
+            // just decoded. It stays in the VBV and is decoded by the next
+            // render call instead of its N-VOP, with this call's picture info
+            // and references, since the next call describes the N-VOP. Not
+            // coded VOPs behind a decoded one are dropped.
+            if (decoded)
+            {
+                int time;
+                if (!vop_is_coded(bs, info, &time))
+                    continue;
+
+                VdpPictureInfoMPEG4Part2 *packed = &decoder_p->packed_info;
+                *packed = *info;
+                packed->backward_reference = decoder->target;
+                packed->rounding_control = 0;
+
+                // trd of the P-VOP is the distance of the references
+                int trb = info->trd[0] - (decoder_p->vop_header.vop_time - time);
+                if (trb > 0 && trb < info->trd[0])
+                    packed->trb[0] = trb;
+                decoder_p->packed_pending = 1;
+
+                VDPAU_DBG("packed bitstream, keeping VOP at %u for the next frame", vop_start);
+                decoder->data_offset = vop_start;
+                decoder->data_keep = 1;
+                break;
+            }
+
             if (!decode_vop_header(&bs, info, decoder))
                     continue;
+            unsigned int vop_data = bs.bitpos;
+
+            if (info == &decoder_p->packed_info)
+            {
+                decoder_p->packed_info.vop_fcode_forward = decoder_p->vop_header.fcode_forward;
+                decoder_p->packed_info.vop_fcode_backward = decoder_p->vop_header.fcode_backward;
+            }
 
 #if 0
             bitstream bs1 = bs;
@@ -1566,10 +1639,15 @@ int mpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info,
             
 #if 1
             // set quantisation tables
+            uint32_t iq[128];
             for (i = 0; i < 64; i++)
-                writel((uint32_t)(64 + i) << 8 | info->intra_quantizer_matrix[i], cedarv_regs + CEDARV_MPEG_IQ_MIN_INPUT);
-            for (i = 0; i < 64; i++)
-                writel((uint32_t)(i) << 8 | info->non_intra_quantizer_matrix[i], cedarv_regs + CEDARV_MPEG_IQ_MIN_INPUT);
+            {
+                iq[i] = (uint32_t)(64 + i) << 8 | info->intra_quantizer_matrix[i];
+                iq[64 + i] = (uint32_t)(i) << 8 | info->non_intra_quantizer_matrix[i];
+            }
+            if (!cedarv_table_cached(CEDARV_TABLE_MPEG_IQ, iq, 128))
+                for (i = 0; i < 128; i++)
+                    writel(iq[i], cedarv_regs + CEDARV_MPEG_IQ_MIN_INPUT);
 #endif
 
             // set forward/backward predicion buffers
@@ -1621,8 +1699,8 @@ int mpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info,
                 height = ((decoder->height + 15) / 16);
             }
 
-            writel((width <<16) | (width << 8) | height, cedarv_regs + CEDARV_MPEG_SIZE);
-            writel(((width * 16) << 16) | (height * 16), cedarv_regs + CEDARV_MPEG_FRAME_SIZE);
+            cedarv_writel_cached((width <<16) | (width << 8) | height, CEDARV_MPEG_SIZE);
+            cedarv_writel_cached(((width * 16) << 16) | (height * 16), CEDARV_MPEG_FRAME_SIZE);
 
             // set buffers
             writel(cedarv_virt2phys(decoder_p->mbh_buffer), cedarv_regs + CEDARV_MPEG_MBH_ADDR);
@@ -1677,8 +1755,22 @@ int mpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info,
             writel(mp4mbaAddr_reg, cedarv_regs + CEDARV_MPEG_MBA);
 
             int marker_length = mpeg4_calcResyncMarkerLength(decoder_p);
-
-            while(more_mbs == 1) {
+            int pending = 0;
+            int packet;
+
+            // the packet table is filled one packet ahead of the VE, the
+            // size of a packet is only known from the header of the next
+            mp4_packet_t *packets = decoder_p->packets;
+            int num_packets = 1;
+            packets[0].bitpos = bs.bitpos;
+            packets[0].mb_num = packets[0].mb_x = packets[0].mb_y = 0;
+            packets[0].quant = decoder_p->vop_header.vop_quant;
+            if (!info->resync_marker_disable && decoder_p->max_packets > 1)
+                num_packets += mpeg4_next_packet(&bs, info, decoder, marker_length, &packets[0], &packets[1]);
+
+            for (packet = 0; packet < num_packets; packet++) {
+                TRACE_BEGIN(tp);
+                mp4_packet_t *pkt = &packets[packet];
 
                 //workaround: currently it is unclear what the meaning of bit 20/21 is
                 if(decoder_p->vop_header.vop_coding_type == VOP_S)
@@ -1717,22 +1809,22 @@ int mpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info,
 
                 decoder_p->vop_header.last_coding_type = decoder_p->vop_header.vop_coding_type;
 
-                writel(decoder_p->vop_header.vop_quant, cedarv_regs + CEDARV_MPEG_QP_INPUT);
+                writel(pkt->quant, cedarv_regs + CEDARV_MPEG_QP_INPUT);
 
-                writel(mba_reg, cedarv_regs + CEDARV_MPEG_MBA);
+                writel(pkt->mb_y | (pkt->mb_x << 8), cedarv_regs + CEDARV_MPEG_MBA);
 
                 //clean up everything
                 writel(0xffffffff, cedarv_regs + CEDARV_MPEG_STATUS);
 
                 // set input offset in bits
-                writel(bs.bitpos, cedarv_regs + CEDARV_MPEG_VLD_OFFSET);
+                writel(pkt->bitpos, cedarv_regs + CEDARV_MPEG_VLD_OFFSET);
 
                 // set input length in bits
-                writel(((len*8 - bs.bitpos)+31) & ~0x1f, cedarv_regs + CEDARV_MPEG_VLD_LEN);
+                writel(((len*8 - pkt->bitpos)+31) & ~0x1f, cedarv_regs + CEDARV_MPEG_VLD_LEN);
 
                 // input end
                 uint32_t input_addr = cedarv_virt2phys(decoder->data);
-                writel(input_addr + VBV_SIZE - 1, cedarv_regs + CEDARV_MPEG_VLD_END);
+                writel(input_addr + decoder->data_size - 1, cedarv_regs + CEDARV_MPEG_VLD_END);
 
                 // set input buffer
                 writel((input_addr & 0x0ffffff0) | (input_addr >> 28) | (0x7 << 28), cedarv_regs + CEDARV_MPEG_VLD_ADDR);
@@ -1769,27 +1861,8 @@ int mpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info,
                     writel(mv6, cedarv_regs + CEDARV_MPEG_MV6);
                 }
                 // trigger
-                bitstream bs_saved = bs;
-                int marker_length = mpeg4_calcResyncMarkerLength(decoder_p);
-                mp4_private_t _priv = *decoder_p;
-                if(find_resynccode(&bs, marker_length))
-                        mpeg4_decode_packet_header(&bs,
-                                        info,
-                                        decoder,
-                                        &_priv);
-                decoder_p->pkt_hdr.curr_mb_num = _priv.pkt_hdr.mb_num;
-                bs = bs_saved;
-
-                int num_mba = decoder_p->pkt_hdr.curr_mb_num; 
-		if(num_mba == 0)
-			num_mba = height * width;
-                int vbv_size = num_mba - last_mba; // * width;
-		if(vbv_size == 0)
-		{
-			num_mba = height * width;
-			vbv_size = num_mba - last_mba;
-		}
-		last_mba = num_mba;
+                int num_mba = packet + 1 < num_packets ? packets[packet + 1].mb_num : height * width;
+                int vbv_size = num_mba - pkt->mb_num;
                 uint32_t mpeg_trigger = 0;
                 uint32_t error_disable = 1;
                 mpeg_trigger |= vbv_size << 8;
@@ -1799,68 +1872,53 @@ int mpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info,
 
                 writel(mpeg_trigger, cedarv_regs + CEDARV_MPEG_TRIGGER);
 
+                // nothing has to be read back after the last packet of the
+                // VOP, it completes asynchronously
+                if (packet + 1 == num_packets)
+                {
+                    pending = 1;
+                    TRACE_END_ARG(tp, "mpeg4_packet", packet);
+                    break;
+                }
+
+                // parse the packet after the next one while the VE is busy
+                if (packet + 2 == num_packets && num_packets < decoder_p->max_packets)
+                    num_packets += mpeg4_next_packet(&bs, info, decoder, marker_length,
+                                                     &packets[packet + 1], &packets[packet + 2]);
+
                 // wait for interrupt
-#ifdef TIMEMEAS
-            uint64_t tv, tv2;
-                tv = get_time();
-#endif
                 cedarv_wait(1);
-#ifdef TIMEMEAS                
-                tv2 = get_time();
-                if (tv2-tv > 10000000) {
-                    printf("cedarv_wait, longer than 10ms:%lld, pics=%ld, longs=%ld\n", tv2-tv, num_pics, ++num_longs);
-                }
-#endif
                 // clean interrupt flag
                 writel(0x0000c00f, cedarv_regs + CEDARV_MPEG_STATUS);
                 int error = readl(cedarv_regs + CEDARV_MPEG_ERROR);
                 if(error)
-                    printf("got error=%d while decoding frame=%ld\n", error, num_pics);
+                {
+                    VDPAU_DBG("got error=%d while decoding frame=%ld", error, num_pics);
+                    COUNTER_INC(mpeg_errors);
+                }
                 writel(0x0, cedarv_regs + CEDARV_MPEG_ERROR);
 
                 ++num_pics;
 
-                int veCurPos = readl(cedarv_regs + CEDARV_MPEG_VLD_OFFSET);
-                int byteCurPos = (veCurPos+7) / 8;
-
-                more_mbs = 0;
-                if (veCurPos < (len*8) && !info->resync_marker_disable)
-                {
-                    bs.bitpos = veCurPos / 8 * 8;
-                    if(bytealign(&bs) == 0)
-                    {
-                        if(find_resynccode(&bs, marker_length)) {
-                            mpeg4_decode_packet_header(&bs, 
-                                                 info,
-                                                 decoder, 
-                                                 decoder_p);
-                            int result;
-//                            bitstream bs1 = bs;
-                            decoder_p->vop_header.quantizer = decoder_p->vop_header.vop_quant;
-
-/*
-                            int mba=0;
-                            int num_macroblock_in_gob = decoder_p->pkt_hdr.mb_width * 
-                                            get_gob_height(decoder_p->mpeg4VolHdr.video_object_layer_height);
-                            do {
-                                result = macroblock(&bs, decoder_p);
-                                mba++;
-                            } while(bits_left(&bs) && (nextbits_bytealigned(&bs, 23) != 0) &&
-                                    mba <= num_macroblock_in_gob);
-                            bs = bs1;
-*/
-                            more_mbs=1;
-                            //last_mba = mba_reg;
-                            mba_reg = decoder_p->pkt_hdr.mb_y | (decoder_p->pkt_hdr.mb_x << 8);
-                        }
-                    }
-                }
-                writel(readl(cedarv_regs + CEDARV_MPEG_CTRL) | 0x7C, cedarv_regs + CEDARV_MPEG_CTRL);            
+                writel(readl(cedarv_regs + CEDARV_MPEG_CTRL) | 0x7C, cedarv_regs + CEDARV_MPEG_CTRL);
+                TRACE_END_ARG(tp, "mpeg4_packet", packet);
+            }
+            if (pending)
+            {
+                decoder_submit(decoder, output, mpeg4_done, NULL);
+            }
+            else
+            {
+                // stop MPEG engine
+                writel((readl(cedarv_regs + CEDARV_CTRL) & ~0xf) | 0x7, cedarv_regs + CEDARV_CTRL);
+                cedarv_put();
             }
-            // stop MPEG engine
-            writel((readl(cedarv_regs + CEDARV_CTRL) & ~0xf) | 0x7, cedarv_regs + CEDARV_CTRL);
-            cedarv_put();
             output->frame_decoded = 1;
+            decoded = 1;
+            info = _info;
+
+            // the packet search may have read into the next start code
+            bs.bitpos = vop_data;
     	}
 	return VDP_STATUS_OK;
 }
@@ -1874,6 +1932,21 @@ VdpStatus mpeg4_setVideoControlData(decoder_ctx_t *decoder, VdpDecoderControlDat
         if(data->mpeg4VolHdr.struct_version != VDP_MPEG4_STRUCT_VERSION)
             return VDP_STATUS_INVALID_STRUCT_VERSION;
 
+        // motion vector prediction state for the macroblock width of the VOL
+        int mb_width = (data->mpeg4VolHdr.video_object_layer_width + 15) / 16;
+        if (mb_width == 0)
+            mb_width = (decoder->width + 15) / 16;
+        if (mb_width + 2 != decoder_p->mv_stride)
+        {
+            mp4_mb_mv_t *mv_rows = calloc(2 * (mb_width + 2), sizeof(mp4_mb_mv_t));
+            if (!mv_rows)
+                return VDP_STATUS_RESOURCES;
+
+            free(decoder_p->mv_rows);
+            decoder_p->mv_rows = mv_rows;
+            decoder_p->mv_stride = mb_width + 2;
+        }
+
         decoder_p->mpeg4VolHdr = data->mpeg4VolHdr;
         decoder_p->mpeg4VolHdrSet = 1;
         
@@ -1904,15 +1977,24 @@ VdpStatus new_decoder_mpeg4(decoder_ctx_t *decoder)
 	if (! cedarv_isValid(decoder_p->ncf_buffer))
 		goto err_ncf;
 
+	// at most one video packet per macroblock
+	decoder_p->max_packets = width * height;
+	decoder_p->packets = malloc(decoder_p->max_packets * sizeof(mp4_packet_t));
+	if (!decoder_p->packets)
+		goto err_packets;
+
 	decoder->decode = mpeg4_decode;
 	decoder->private = decoder_p;
 	decoder->private_free = mp4_private_free;
     decoder->setVideoControlData = mpeg4_setVideoControlData;
 
     save_tables(&decoder_p->tables);
+    pthread_once(&tables_once, mpeg4_init_tables);
 
 	return VDP_STATUS_OK;
 
+err_packets:
+	cedarv_free(decoder_p->ncf_buffer);
 err_ncf:
 	cedarv_free(decoder_p->dcac_buffer);
 err_dcac:
@@ -80,12 +80,32 @@ typedef struct {
     int 	curr_mb_num;
 } video_packet_header_t;
 
+/*
+ * Motion vectors of the four luma blocks of a macroblock. Prediction only
+ * looks at the current and the previous macroblock row, so two rows with a
+ * zero border column on each side are kept and reused alternately.
+ */
+typedef struct
+{
+    int16_t     mv[2][4];       // [comp][block]
+} mp4_mb_mv_t;
+
+typedef struct
+{
+    uint32_t    bitpos;         // first bit after the video packet header
+    int         mb_num;
+    int         mb_x;
+    int         mb_y;
+    int         quant;
+} mp4_packet_t;
+
 typedef struct
 {
     int vop_coding_type;
     int last_coding_type;
     int intra_dc_vlc_thr;
     int vop_quant;
+    int vop_time;               // modulo_time_base * resolution + vop_time_increment
     int quantizer;
     int fcode_forward;
     int fcode_backward;
@@ -156,9 +176,15 @@ typedef struct
     VdpDecoderMpeg4VolHeader    mpeg4VolHdr;
     int                         mpeg4VolHdrSet;
     vop_header_t                vop_header;
-    int                         MV[2][6][DEC_MBR+1][DEC_MBC+2];
+    mp4_mb_mv_t                 *mv_rows;       // 2 rows of mv_stride macroblocks
+    int                         mv_stride;
     MP4_TABLES                  tables;
     int                         dc_scaler;
+    int                         vop_len;
+    mp4_packet_t                *packets;       // video packets of the current VOP
+    int                         max_packets;
+    VdpPictureInfoMPEG4Part2    packed_info;    // for the VOP kept from a packed bitstream
+    int                         packed_pending;
 } mp4_private_t;
 
 #define VOP_I	0
@@ -178,4 +204,8 @@ typedef struct {
 #define INTRA_Q	 	4
 #define STUFFING	7
 
+// for tests, motion vector prediction of the macroblock parser
+int16_t *mpeg4_mv_at(mp4_private_t *priv, int comp, int block, int y, int x);
+int mpeg4_find_pmv(mp4_private_t *priv, int mb_x, int mb_y, int block, int comp);
+
 #endif
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Stores random motion vectors in raster order, as the macroblock parser
+ * does for not coded, 1MV and 4MV macroblocks, and compares every
+ * prediction of find_pmv() on the two rolling rows of the decoder with
+ * the full frame array they replaced. The current row is stored over
+ * row y - 2, (y & 1) in mv_at(), the previous row above a macroblock is
+ * still intact because each macroblock is predicted before it is stored.
+ * One decoder is reused for all VOL sizes and several VOPs per size
+ * without clearing the rows, a border column that keeps vectors of an
+ * earlier VOL or VOP changes the predictions at the edges.
+ *
+ *   mpeg4_mv_test [sizes]
+ *
+ * Exits with 1 on the first prediction that differs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpeg4.h"
+
+#define VOPS_PER_SIZE 3
+#define MAX_MB_WIDTH 120
+#define MAX_MB_HEIGHT 68
+
+// the old int MV[2][6][DEC_MBR+1][DEC_MBC+2], sized for the VOP
+static int *ref_mv;
+static int ref_width, ref_height;
+
+static int *ref_at(int comp, int block, int y, int x)
+{
+	return &ref_mv[((comp * 4 + block) * (ref_height + 1) + y) * (ref_width + 2) + x];
+}
+
+// find_pmv as it was on the full frame array
+static int ref_find_pmv(int x, int y, int block, int comp)
+{
+	int p1, p2, p3;
+	int xin1, xin2, xin3;
+	int yin1, yin2, yin3;
+	int vec1, vec2, vec3;
+
+	if ((y == 0) && ((block == 0) || (block == 1)))
+	{
+		if ((x == 0) && (block == 0))
+			return 0;
+		else if (block == 1)
+			return *ref_at(comp, 0, y+1, x+1);
+		else // block == 0
+			return *ref_at(comp, 1, y+1, x+1-1);
+	}
+
+	x++;
+	y++;
+
+	switch (block)
+	{
+	case 0:
+		vec1 = 1;	yin1 = y;	xin1 = x-1;
+		vec2 = 2;	yin2 = y-1;	xin2 = x;
+		vec3 = 2;	yin3 = y-1;	xin3 = x+1;
+		break;
+	case 1:
+		vec1 = 0;	yin1 = y;	xin1 = x;
+		vec2 = 3;	yin2 = y-1;	xin2 = x;
+		vec3 = 2;	yin3 = y-1;	xin3 = x+1;
+		break;
+	case 2:
+		vec1 = 3;	yin1 = y;	xin1 = x-1;
+		vec2 = 0;	yin2 = y;	xin2 = x;
+		vec3 = 1;	yin3 = y;	xin3 = x;
+		break;
+	default: // case 3
+		vec1 = 2;	yin1 = y;	xin1 = x;
+		vec2 = 0;	yin2 = y;	xin2 = x;
+		vec3 = 1;	yin3 = y;	xin3 = x;
+		break;
+	}
+
+	p1 = *ref_at(comp, vec1, yin1, xin1);
+	p2 = *ref_at(comp, vec2, yin2, xin2);
+	p3 = *ref_at(comp, vec3, yin3, xin3);
+
+	return mmin(mmax(p1, p2), mmin(mmax(p2, p3), mmax(p1, p3)));
+}
+
+static int predict(mp4_private_t *priv, int x, int y, int block)
+{
+	int comp;
+
+	for (comp = 0; comp < 2; comp++)
+	{
+		int got = mpeg4_find_pmv(priv, x, y, block, comp);
+		int expected = ref_find_pmv(x, y, block, comp);
+		if (got != expected)
+		{
+			fprintf(stderr, "%dx%d: macroblock %d,%d block %d comp %d predicted %d instead of %d\n",
+			        ref_width, ref_height, x, y, block, comp, got, expected);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void store(mp4_private_t *priv, int x, int y, int block, int mv_x, int mv_y)
+{
+	*mpeg4_mv_at(priv, 0, block, y + 1, x + 1) = *ref_at(0, block, y + 1, x + 1) = mv_x;
+	*mpeg4_mv_at(priv, 1, block, y + 1, x + 1) = *ref_at(1, block, y + 1, x + 1) = mv_y;
+}
+
+static int random_mv(void)
+{
+	return rand() % 4096 - 2048;
+}
+
+static int check_vop(mp4_private_t *priv)
+{
+	int x, y, block;
+
+	for (y = 0; y < ref_height; y++)
+		for (x = 0; x < ref_width; x++)
+		{
+			int mv_x = random_mv(), mv_y = random_mv();
+
+			switch (rand() % 4)
+			{
+			case 0:
+				// not coded
+				for (block = 0; block < 4; block++)
+					store(priv, x, y, block, 0, 0);
+				break;
+
+			case 1:
+				// 1MV, predicted from block 0
+				if (!predict(priv, x, y, 0))
+					return 0;
+				for (block = 0; block < 4; block++)
+					store(priv, x, y, block, mv_x, mv_y);
+				break;
+
+			default:
+				// 4MV, each block is predicted after the ones before it are stored
+				for (block = 0; block < 4; block++)
+				{
+					if (!predict(priv, x, y, block))
+						return 0;
+					store(priv, x, y, block, random_mv(), random_mv());
+				}
+				break;
+			}
+		}
+
+	return 1;
+}
+
+static int check_size(VdpDecoder decoder, int width, int height)
+{
+	VdpDecoderControlData vol;
+	decoder_ctx_t *dec;
+	int vop, ret = 0;
+
+	memset(&vol, 0, sizeof(vol));
+	vol.mpeg4VolHdr.struct_version = VDP_MPEG4_STRUCT_VERSION;
+	vol.mpeg4VolHdr.video_object_layer_width = width * 16;
+	vol.mpeg4VolHdr.video_object_layer_height = height * 16;
+	if (vdp_decoder_set_video_control_data(decoder, VDP_MPEG4_VOL_HEADER, &vol) != VDP_STATUS_OK)
+	{
+		fprintf(stderr, "could not set a VOL header for %dx%d macroblocks\n", width, height);
+		return 0;
+	}
+
+	// the rows keep the vectors of the last size, the reference starts empty
+	ref_width = width;
+	ref_height = height;
+	ref_mv = calloc(2 * 4 * (height + 1) * (width + 2), sizeof(int));
+	dec = handle_get(decoder);
+	if (!ref_mv || !dec)
+		goto out;
+
+	for (vop = 0; vop < VOPS_PER_SIZE; vop++)
+		if (!check_vop((mp4_private_t *)dec->private))
+			goto out;
+
+	ret = 1;
+
+out:
+	if (dec)
+		handle_release(decoder);
+	free(ref_mv);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int fixed[][2] = { { 1, 1 }, { 1, 68 }, { 120, 1 }, { 45, 36 }, { 120, 68 } };
+	unsigned int i, sizes = argc > 1 ? strtoul(argv[1], NULL, 0) : 200;
+	VdpDevice dev;
+	VdpGetProcAddress *get_proc_address;
+	VdpDecoder decoder;
+
+	setenv("VDPAU_VE_BACKEND", "sim", 0);
+
+	if (vdp_imp_device_create_x11(NULL, 0, &dev, &get_proc_address) != VDP_STATUS_OK ||
+	    vdp_decoder_create(dev, VDP_DECODER_PROFILE_MPEG4_PART2_ASP, MAX_MB_WIDTH * 16, MAX_MB_HEIGHT * 16,
+	                       2, &decoder) != VDP_STATUS_OK)
+	{
+		fprintf(stderr, "could not set up the decoder\n");
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+		if (!check_size(decoder, fixed[i][0], fixed[i][1]))
+			return 1;
+
+	srand(1);
+	for (i = 0; i < sizes; i++)
+	{
+		// some sizes repeat, the rows are not reallocated for them
+		int width = i % 4 ? 1 + rand() % MAX_MB_WIDTH : 45;
+		if (!check_size(decoder, width, 1 + rand() % MAX_MB_HEIGHT))
+			return 1;
+	}
+
+	printf("rolling row predictions match the full frame array for %u VOL sizes\n",
+	       sizes + (unsigned int)(sizeof(fixed) / sizeof(fixed[0])));
+
+	vdp_decoder_destroy(decoder);
+	vdp_device_destroy(dev);
+	return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Decodes random MPEG-4 I-VOPs split into video packets on the VE
+ * simulator and checks the MBA, QP, VLD_OFFSET and TRIGGER registers of
+ * every job against the packets that were written: one job per packet,
+ * starting behind its header at its first macroblock with its quantizer,
+ * and sized up to the first macroblock of the next packet. This is the
+ * sequence the decoder wrote when it decoded packet by packet and scanned
+ * for the next resync marker from the VE read position.
+ *
+ * The simulator runs with VDPAU_SIM_MPEG=log,resync, jobs stop at the
+ * next resync marker like on the VE, so a decoder that reads the position
+ * back gets the same answer as from hardware.
+ *
+ *   mpeg4_packet_test [vops]
+ *
+ * Exits with 1 on the first job that differs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "vdpau_private.h"
+
+#define WIDTH 320
+#define HEIGHT 240
+#define MB_WIDTH (WIDTH / 16)
+#define MBS (MB_WIDTH * (HEIGHT / 16))
+#define MB_NUM_BITS 9
+#define MAX_PACKETS 16
+#define MAX_VOPS 10000
+#define MAX_VOP_SIZE (MAX_PACKETS * 256)
+
+typedef struct
+{
+	uint32_t mba;
+	uint32_t qp;
+	uint32_t offset;
+	uint32_t trigger;
+} job_t;
+
+typedef struct
+{
+	uint8_t data[MAX_VOP_SIZE];
+	unsigned int bitpos;
+} writer_t;
+
+static job_t *expected;
+static unsigned int expected_count;
+
+static void put_bits(writer_t *w, uint32_t value, int bits)
+{
+	while (bits--)
+	{
+		if ((value >> bits) & 1)
+			w->data[w->bitpos / 8] |= 0x80 >> (w->bitpos % 8);
+		w->bitpos++;
+	}
+}
+
+// byte aligned macroblock data that never has two zero bytes in a row,
+// it starts with a non-zero byte as the header may end in one
+static void put_data(writer_t *w, unsigned int bytes)
+{
+	uint8_t b = 0x00;
+
+	w->bitpos = (w->bitpos + 7) & ~7;
+	while (bytes--)
+	{
+		b = b && rand() % 8 == 0 ? 0x00 : 0x01 + rand() % 0xff;
+		put_bits(w, b, 8);
+	}
+	put_bits(w, 0x5a, 8);
+}
+
+static void add_job(unsigned int mb_num, unsigned int next_mb_num, unsigned int quant, unsigned int offset)
+{
+	job_t *job = &expected[expected_count++];
+
+	job->mba = (mb_num / MB_WIDTH) | ((mb_num % MB_WIDTH) << 8);
+	job->qp = quant;
+	job->offset = offset;
+	job->trigger = 0x8400000d | ((next_mb_num - mb_num) << 8);
+}
+
+// an I-VOP of 1 to MAX_PACKETS packets, with their jobs
+static void write_vop(writer_t *w, unsigned int vop, int *resync_marker_disable)
+{
+	unsigned int i, packets = 1 + rand() % MAX_PACKETS;
+	unsigned int mb_num[MAX_PACKETS + 1], quant[MAX_PACKETS], offset[MAX_PACKETS];
+
+	*resync_marker_disable = rand() % 8 == 0;
+	if (*resync_marker_disable)
+		packets = 1;
+
+	// increasing first macroblocks, packet 0 starts at 0
+	mb_num[0] = 0;
+	for (i = 1; i < packets; i++)
+		mb_num[i] = mb_num[i - 1] + 1 + rand() % ((MBS - mb_num[i - 1] - 1) / (packets - i));
+	mb_num[packets] = MBS;
+
+	memset(w, 0, sizeof(*w));
+	put_bits(w, 0x000001b6, 32);
+	put_bits(w, 0, 2);			// vop_coding_type I
+	put_bits(w, 0, 1);			// modulo_time_base
+	put_bits(w, 1, 1);
+	put_bits(w, vop % 25, 5);		// vop_time_increment
+	put_bits(w, 1, 1);
+	put_bits(w, 1, 1);			// vop_coded
+	put_bits(w, 0, 3);			// intra_dc_vlc_thr
+	quant[0] = 1 + rand() % 31;
+	put_bits(w, quant[0], 5);
+	offset[0] = w->bitpos;
+
+	for (i = 0; i < packets; i++)
+	{
+		if (i > 0)
+		{
+			quant[i] = 1 + rand() % 31;
+			put_bits(w, 1, 17);		// resync_marker
+			put_bits(w, mb_num[i], MB_NUM_BITS);
+			put_bits(w, quant[i], 5);
+			put_bits(w, 0, 1);		// header_extension_code
+			offset[i] = w->bitpos;
+		}
+		put_data(w, 8 + rand() % 200);
+	}
+
+	for (i = 0; i < packets; i++)
+		add_job(mb_num[i], mb_num[i + 1], quant[i], offset[i]);
+}
+
+static int capture_begin(FILE **f)
+{
+	int saved;
+
+	fflush(stdout);
+	*f = tmpfile();
+	if (!*f || (saved = dup(STDOUT_FILENO)) == -1)
+		return -1;
+
+	dup2(fileno(*f), STDOUT_FILENO);
+	return saved;
+}
+
+// compares the jobs the simulator printed with the expected ones
+static int capture_check(FILE *f, int saved)
+{
+	char line[256];
+	unsigned int count = 0;
+	job_t job;
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	rewind(f);
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "ve sim: mpeg job mba 0x%x qp %u offset %u trigger 0x%x",
+		           &job.mba, &job.qp, &job.offset, &job.trigger) != 4)
+			continue;
+
+		if (count >= expected_count)
+		{
+			fprintf(stderr, "more than the %u expected jobs\n", expected_count);
+			goto err;
+		}
+
+		if (memcmp(&job, &expected[count], sizeof(job)) != 0)
+		{
+			fprintf(stderr, "job %u: mba 0x%04x qp %u offset %u trigger 0x%08x instead of "
+			        "mba 0x%04x qp %u offset %u trigger 0x%08x\n", count,
+			        job.mba, job.qp, job.offset, job.trigger, expected[count].mba,
+			        expected[count].qp, expected[count].offset, expected[count].trigger);
+			goto err;
+		}
+		count++;
+	}
+	fclose(f);
+
+	if (count != expected_count)
+	{
+		fprintf(stderr, "%u jobs instead of %u\n", count, expected_count);
+		return 0;
+	}
+
+	return 1;
+
+err:
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, vops = argc > 1 ? strtoul(argv[1], NULL, 0) : 500;
+	VdpDevice dev;
+	VdpGetProcAddress *get_proc_address;
+	VdpVideoSurface surface;
+	VdpDecoder decoder;
+	VdpDecoderControlData vol;
+	VdpPictureInfoMPEG4Part2 info;
+	static writer_t w;
+	FILE *f;
+	int saved;
+
+	setenv("VDPAU_VE_BACKEND", "sim", 0);
+	setenv("VDPAU_SIM_MPEG", "log,resync", 1);
+
+	if (vops > MAX_VOPS ||
+	    !(expected = malloc(vops * MAX_PACKETS * sizeof(job_t))) ||
+	    vdp_imp_device_create_x11(NULL, 0, &dev, &get_proc_address) != VDP_STATUS_OK ||
+	    vdp_video_surface_create(dev, VDP_CHROMA_TYPE_420, WIDTH, HEIGHT, &surface) != VDP_STATUS_OK ||
+	    vdp_decoder_create(dev, VDP_DECODER_PROFILE_MPEG4_PART2_ASP, WIDTH, HEIGHT, 2, &decoder) != VDP_STATUS_OK)
+	{
+		fprintf(stderr, "could not set up the decoder\n");
+		return 1;
+	}
+
+	memset(&vol, 0, sizeof(vol));
+	vol.mpeg4VolHdr.struct_version = VDP_MPEG4_STRUCT_VERSION;
+	vol.mpeg4VolHdr.video_object_layer_width = WIDTH;
+	vol.mpeg4VolHdr.video_object_layer_height = HEIGHT;
+	vol.mpeg4VolHdr.quant_precision = 5;
+	vol.mpeg4VolHdr.vop_time_increment_resolution = 25;
+	vol.mpeg4VolHdr.complexity_estimation_disable = 1;
+	if (vdp_decoder_set_video_control_data(decoder, VDP_MPEG4_VOL_HEADER, &vol) != VDP_STATUS_OK)
+	{
+		fprintf(stderr, "could not set the VOL header\n");
+		return 1;
+	}
+
+	saved = capture_begin(&f);
+	if (saved == -1)
+		return 1;
+
+	srand(1);
+	for (i = 0; i < vops; i++)
+	{
+		unsigned int job, first_job = expected_count;
+		int resync_marker_disable;
+		write_vop(&w, i, &resync_marker_disable);
+
+		VdpBitstreamBuffer buffer = { VDP_BITSTREAM_BUFFER_VERSION, w.data, (w.bitpos + 7) / 8 };
+		memset(&info, 0, sizeof(info));
+		info.forward_reference = VDP_INVALID_HANDLE;
+		info.backward_reference = VDP_INVALID_HANDLE;
+		info.vop_time_increment_resolution = 25;
+		info.resync_marker_disable = resync_marker_disable;
+		vdp_decoder_render(decoder, surface, (VdpPictureInfo *)&info, 1, &buffer);
+
+		// the VBV is a ring, offsets count from its start
+		decoder_ctx_t *dec = handle_get(decoder);
+		for (job = first_job; job < expected_count; job++)
+			expected[job].offset += dec->data_offset * 8;
+		handle_release(decoder);
+	}
+
+	// the last packet of a VOP completes with the next job or here
+	vdp_decoder_destroy(decoder);
+	if (!capture_check(f, saved))
+		return 1;
+
+	printf("%u VOPs with %u video packets decoded with the expected jobs\n", vops, expected_count);
+
+	vdp_video_surface_destroy(surface);
+	vdp_device_destroy(dev);
+	free(expected);
+	return 0;
+}
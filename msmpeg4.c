@@ -20,6 +20,7 @@
 #include <string.h>
 #include "vdpau_private.h"
 #include "ve.h"
+#include "counters.h"
 #include <time.h>
 #include <assert.h>
 #include "bitstream.h"
@@ -30,14 +31,6 @@
 
 #define MBAC_BITRATE 50*1024
 
-extern uint32_t show_bits(bitstream *bs, int n);
-extern uint32_t get_bits(bitstream *bs, int n);
-extern int bytealign(bitstream *bs);
-extern int  bytealigned(bitstream *bs, int nbit);
-extern void flush_bits(bitstream *bs, int nbit);
-extern int bits_left(bitstream *bs);
-extern int nextbits_bytealigned(bitstream *bs, int nbit);
-
 static void dumpData(char* data)
 {
     int pos=0;
@@ -289,8 +282,35 @@ static int decode_vop_header(bitstream *bs, VdpPictureInfoMPEG4Part2 const *info
     return 1;
 }
 
-static unsigned long num_pics=0;
-static unsigned long num_longs=0;
+static void msmpeg4_done(void *regs, void *arg)
+{
+    decoder_ctx_t *decoder = (decoder_ctx_t *)arg;
+    mp4_private_t *decoder_p = (mp4_private_t *)decoder->private;
+    int len = decoder_p->vop_len;
+
+    // clean interrupt flag
+    writel(0x0000c00f, regs + CEDARV_MPEG_STATUS);
+    int error = readl(regs + CEDARV_MPEG_ERROR);
+    if(error)
+    {
+        VDPAU_DBG("got error=%d while decoding frame", error);
+        COUNTER_INC(mpeg_errors);
+    }
+    writel(0x0, regs + CEDARV_MPEG_ERROR);
+
+    int veCurPos = readl(regs + CEDARV_MPEG_VLD_OFFSET);
+
+    if (decoder_p->vop_header.vop_coding_type == VOP_I && veCurPos+17 <= (len*8) )
+    {
+        bitstream bs = { .data = decoder->host_data, .length = len, .bitpos = veCurPos };
+        //fps
+        (void)get_bits(&bs, 5);
+        decoder_p->vop_header.bit_rate = get_bits(&bs, 11);
+        decoder_p->vop_header.flipflop_rounding = get_bits(&bs, 1);
+    }
+    writel(readl(regs + CEDARV_MPEG_CTRL) | 0x7C, regs + CEDARV_MPEG_CTRL);
+}
+
 int msmpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info, 
 			const int len, video_surface_ctx_t *output,
 			uint32_t * bitstream_pos_returned)
@@ -300,12 +320,13 @@ int msmpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info
     vop_header_t *h = &decoder_p->vop_header;
 
     uint32_t   mp4mbaAddr_reg = 0;
-    int error=0;
 
     int i;
     void *cedarv_regs = cedarv_get_regs();
-    bitstream bs = { .data = cedarv_getPointer(decoder->data), .length = len, .bitpos = 0 };
+    bitstream bs = { .data = decoder->host_data, .length = len, .bitpos = decoder->data_offset * 8 };
 
+    // msmpeg4_done of the previous frame still updates the vop header
+    cedarv_sync(decoder->fence);
         
     if (!decode_vop_header(&bs, info, decoder_p))
             return 0;
@@ -319,10 +340,15 @@ int msmpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info
             
     #if 1
             // set quantisation tables
+            uint32_t iq[128];
             for (i = 0; i < 64; i++)
-                    writel((uint32_t)(64 + i) << 8 | info->intra_quantizer_matrix[i], cedarv_regs + CEDARV_MPEG_IQ_MIN_INPUT);
-            for (i = 0; i < 64; i++)
-                    writel((uint32_t)(i) << 8 | info->non_intra_quantizer_matrix[i], cedarv_regs + CEDARV_MPEG_IQ_MIN_INPUT);
+            {
+                    iq[i] = (uint32_t)(64 + i) << 8 | info->intra_quantizer_matrix[i];
+                    iq[64 + i] = (uint32_t)(i) << 8 | info->non_intra_quantizer_matrix[i];
+            }
+            if (!cedarv_table_cached(CEDARV_TABLE_MPEG_IQ, iq, 128))
+                    for (i = 0; i < 128; i++)
+                            writel(iq[i], cedarv_regs + CEDARV_MPEG_IQ_MIN_INPUT);
     #endif
 
     // set forward/backward predicion buffers
@@ -369,8 +395,8 @@ int msmpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info
             height = ((decoder->height + 15) / 16);
     }
 
-    writel(((width+1) <<16) | (width << 8) | height, cedarv_regs + CEDARV_MPEG_SIZE);
-    writel(((width * 16) << 16) | (height * 16), cedarv_regs + CEDARV_MPEG_FRAME_SIZE);
+    cedarv_writel_cached(((width+1) <<16) | (width << 8) | height, CEDARV_MPEG_SIZE);
+    cedarv_writel_cached(((width * 16) << 16) | (height * 16), CEDARV_MPEG_FRAME_SIZE);
 
     // set buffers
     writel(cedarv_virt2phys(decoder_p->mbh_buffer), cedarv_regs + CEDARV_MPEG_MBH_ADDR);
@@ -460,11 +486,11 @@ int msmpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info
     writel(bs.bitpos, cedarv_regs + CEDARV_MPEG_VLD_OFFSET);
 
     // set input length in bits
-    writel(((len*8)+0x1F) & ~0x1F, cedarv_regs + CEDARV_MPEG_VLD_LEN);
+    writel((((len - decoder->data_offset)*8)+0x1F) & ~0x1F, cedarv_regs + CEDARV_MPEG_VLD_LEN);
 
     // input end
     uint32_t input_addr = cedarv_virt2phys(decoder->data);
-    writel(input_addr + VBV_SIZE - 1, cedarv_regs + CEDARV_MPEG_VLD_END);
+    writel(input_addr + decoder->data_size - 1, cedarv_regs + CEDARV_MPEG_VLD_END);
 
     // set input buffer
     writel((input_addr & 0x0ffffff0) | (input_addr >> 28) | (0x7 << 28), cedarv_regs + CEDARV_MPEG_VLD_ADDR);
@@ -498,50 +524,13 @@ int msmpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info
     mpeg_trigger |= (0x4000000);
     writel(mpeg_trigger, cedarv_regs + CEDARV_MPEG_TRIGGER);
 
-        // wait for interrupt
-#ifdef TIMEMEAS
-    ++num_pics;
-    uint64_t tv, tv2;
-    tv = get_time();
-#endif
-    cedarv_wait(1);
-#ifdef TIMEMEAS                
-    tv2 = get_time();
-    if (tv2-tv > 10000000) {
-        printf("cedarv_wait, longer than 10ms:%lld, pics=%ld, longs=%ld\n", tv2-tv, num_pics, ++num_longs);
-    }
-#endif
-    // clean interrupt flag
-    writel(0x0000c00f, cedarv_regs + CEDARV_MPEG_STATUS);
-    error = readl(cedarv_regs + CEDARV_MPEG_ERROR);
-    if(error)
-        printf("got error=%d while decoding frame\n", error);
-    writel(0x0, cedarv_regs + CEDARV_MPEG_ERROR);
-
-    int veCurPos = readl(cedarv_regs + CEDARV_MPEG_VLD_OFFSET);
-    int veCurPosAligned = (veCurPos+7) & ~ 0x7;
-    int byteCurPos = veCurPosAligned / 8;
-
-    if (decoder_p->vop_header.vop_coding_type == VOP_I && veCurPos+17 <= (len*8) )
-    {
-        bs.bitpos = veCurPos;
-        //fps
-        (void)get_bits(&bs, 5);
-        decoder_p->vop_header.bit_rate = get_bits(&bs, 11);
-        decoder_p->vop_header.flipflop_rounding = get_bits(&bs, 1);
-    }
-    writel(readl(cedarv_regs + CEDARV_MPEG_CTRL) | 0x7C, cedarv_regs + CEDARV_MPEG_CTRL);            
-    // stop MPEG engine
-    //writel((readl(cedarv_regs + CEDARV_CTRL) & ~0xf) | 0x7, cedarv_regs + CEDARV_CTRL);
-    cedarv_put();
+    // bit_rate and flipflop_rounding are read back from behind the
+    // I-VOP once the engine is done, before the next header is parsed
+    decoder_p->vop_len = len;
+    decoder_submit(decoder, output, msmpeg4_done, decoder);
 
-    if (error)
-	return VDP_STATUS_ERROR;
-    else
-    {
-        output->frame_decoded = 1;
-        return VDP_STATUS_OK;
-    }
+    output->frame_decoded = 1;
+    return VDP_STATUS_OK;
 }
 
 VdpStatus new_decoder_msmpeg4(decoder_ctx_t *decoder)
@@ -40,7 +40,38 @@
 #include <EGL/fbdev_window.h>
 #include <stdlib.h>
 
-#define USE_TILE 0
+/*
+ * Sampler for surfaces mapped with tiled textures. Each tiled plane is
+ * bound as is, one 32x32 tile per texture row: luma as LUMINANCE of
+ * 1024 texels width, chroma as LUMINANCE_ALPHA of 512 texels width with
+ * U in .r and V in .a. For a plane of the video surface
+ *   tiles = ALIGN(width, 32) / 32
+ *   rows  = tiles * ALIGN(plane height, 32) / 32
+ *   bpp   = 1 for luma, 2 for chroma
+ * and pos is the texel position in the detiled plane. mediump only has
+ * a relative precision of 2^-10, which can put the row coordinate
+ * rows / 1024 texels off, more than half a texel from 512 rows on and
+ * 720p luma has 920. So the math is highp, tiled_texel() in tiled_yuv.c
+ * does the same in float and make bench checks it against the software
+ * detiler.
+ */
+static const char tiled_sampler_glsl[] =
+   "highp vec2 tiled_texcoord(highp vec2 pos, highp float tiles, highp float rows, highp float bpp)\n"
+   "{\n"
+   "   highp float tw = 32.0 / bpp;\n"
+   "   highp vec2 tile = floor(pos / vec2(tw, 32.0));\n"
+   "   highp vec2 in_tile = pos - tile * vec2(tw, 32.0);\n"
+   "   highp float row = tile.y * tiles + tile.x;\n"
+   "   highp float col = in_tile.y * tw + in_tile.x;\n"
+   "   return vec2((col + 0.5) / (32.0 * tw), (row + 0.5) / rows);\n"
+   "}\n"
+   "\n"
+   "vec4 tiled_texture2D(sampler2D tex, highp vec2 pos, highp float tiles, highp float rows, highp float bpp)\n"
+   "{\n"
+   "   return texture2D(tex, tiled_texcoord(floor(pos), tiles, rows, bpp));\n"
+   "}\n";
+
+static int use_tiled = 0;
 
 static PFNEGLCREATEIMAGEKHRPROC peglCreateImageKHR = NULL;
 static PFNEGLDESTROYIMAGEKHRPROC peglDestroyImageKHR = NULL;
@@ -53,6 +84,8 @@ static EGLSurface    eglSurface = EGL_NO_SURFACE;
 static void (*Log)(int loglevel, const char *format, ...);
 
 void glVDPAUUnmapSurfacesNV(GLsizei numSurfaces, const vdpauSurfaceNV *surfaces);
+static void images_create(surface_nv_ctx_t *nv, video_surface_ctx_t *vs);
+static void images_destroy(surface_nv_ctx_t *nv);
 
 static int TestEGLError(const char* pszLocation){
 
@@ -140,6 +173,27 @@ void glVDPAUInitNV(const void *vdpDevice, const void *getProcAddress, EGLContext
   cedarv_disp_init();
 }
 
+/*
+ * A consumer that asks for the sampler gets tiled textures for surfaces
+ * registered afterwards. Mapping them is free, there is no conversion
+ * through the display scaler. Returns NULL if fragment shaders have no
+ * highp, the surfaces are converted then.
+ */
+const char *glVDPAUGetTiledSamplerNV(void)
+{
+   GLint range[2], precision = 0;
+
+   glGetShaderPrecisionFormat(GL_FRAGMENT_SHADER, GL_HIGH_FLOAT, range, &precision);
+   if (precision < 16)
+   {
+      printf("no highp in fragment shaders, tiled sampler not available\n");
+      return NULL;
+   }
+
+   use_tiled = 1;
+   return tiled_sampler_glsl;
+}
+
 void glVDPAUFiniNV(void)
 {
    eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext);
@@ -184,20 +238,28 @@ vdpauSurfaceNV glVDPAURegisterVideoSurfaceNV (const void *vdpSurface, uint32_t t
    memset(nv->textureNames, 0, sizeof(nv->textureNames));
    memcpy(nv->textureNames, textureNames, sizeof(uint) * numTextureNames);
    
-   nv->convY = cedarv_malloc(vs->plane_size);
-   nv->convU = cedarv_malloc(vs->plane_size/4);
-   nv->convV = cedarv_malloc(vs->plane_size/4);
-   nv->conv_width 	= (vs->width + 15) & ~15;
-   nv->conv_height	= (vs->height + 15) & ~15;
-
-   if (! cedarv_isValid(nv->convY) || ! cedarv_isValid(nv->convU) || ! cedarv_isValid(nv->convV))
+   nv->tiled		= use_tiled;
+   cedarv_setBufferInvalid(nv->convY);
+   cedarv_setBufferInvalid(nv->convU);
+   cedarv_setBufferInvalid(nv->convV);
+   if (!nv->tiled)
    {
-      handle_release(nv->surface);
-      handle_destroy(surfaceNV);
-      return 0;
+      nv->convY = cedarv_malloc(vs->plane_size);
+      nv->convU = cedarv_malloc(vs->plane_size/4);
+      nv->convV = cedarv_malloc(vs->plane_size/4);
+      nv->conv_width 	= (vs->width + 15) & ~15;
+      nv->conv_height	= (vs->height + 15) & ~15;
+
+      if (! cedarv_isValid(nv->convY) || ! cedarv_isValid(nv->convU) || ! cedarv_isValid(nv->convV))
+      {
+         handle_release(nv->surface);
+         handle_destroy(surfaceNV);
+         return 0;
+      }
    }
 
    //handle_release(vdpSurface);
+   images_create(nv, vs);
  
    return surfaceNV;
 }
@@ -224,6 +286,8 @@ void glVDPAUUnregisterSurfaceNV (vdpauSurfaceNV surface)
       glVDPAUUnmapSurfacesNV(1, surf);
    }
 
+   images_destroy(nv);
+
    vs->vdpNvState = VdpauNVState_Unregistered;
    if(nv->surface)
    {
@@ -273,53 +337,49 @@ static void createTexture2D(fbdev_pixmap *pm, surface_nv_ctx_t *nv, video_surfac
    int height = 0;
 
 
-   switch(cp)
+   if (nv->tiled)
    {
-      case(y_plane):
-#if USE_TILE
+      // tiled planes as is, one tile per texture row, see tiled_sampler_glsl
+      unsigned int tiles = (vs->width + 31) / 32;
+      if (cp == y_plane)
+      {
          mem = vs->dataY;
-         width = vs->width;
-         height = vs->height;
-#else
+         width = 1024;
+         height = tiles * ((vs->height + 31) / 32);
+      }
+      else
+      {
+         buf_size = 16;
+         alpha_size = 8;
+         format = GL_LUMINANCE_ALPHA;
+         mem = vs->dataU;
+         width = 512;
+         height = tiles * ((vs->height / 2 + 31) / 32);
+      }
+   }
+   else switch(cp)
+   {
+      case(y_plane):
          mem = nv->convY;
          width = nv->conv_width;
          height = nv->conv_height;
-#endif
          break;
       case(u_plane):
-#if USE_TILE
-         mem = vs->dataU;
-         width = (vs->width + 1)/2;
-         height = (vs->height + 1)/2;
-#else
          mem = nv->convU;
          width = (nv->conv_width + 1) / 2;
          height = (nv->conv_height+1) / 2;
-#endif
          break;
       case(v_plane):
-#if USE_TILE
-         mem = vs->dataV;
-         width = (vs->width + 1) / 2;
-         height = (vs->height + 1) / 2;
-#else
          mem = nv->convV;
          width = (nv->conv_width + 1) / 2;
          height = (nv->conv_height + 1) / 2;
-#endif
          break;
       case(uv_plane):
          buf_size = 16;
          lum_size = 8;
          alpha_size = 8;
          format = GL_LUMINANCE_ALPHA;
-#if USE_TILE
-         mem = vs->dataU;
-         width = (vs->width + 1) / 2;
-         height = vs->height;
-#else
          mem = nv->convU;
-#endif
    }
 
    pm->bytes_per_pixel 	= buf_size / 8;
@@ -341,70 +401,120 @@ static void createTexture2D(fbdev_pixmap *pm, surface_nv_ctx_t *nv, video_surfac
                  pm->height, 0, format, GL_UNSIGNED_BYTE, NULL);
    TestEGLError("createTexture2D");
 }
+/*
+ * The EGLImages and the texture bindings of a registered surface are
+ * made once and kept across map/unmap. They are only rebuilt when the
+ * planes behind them moved, which is checked by physical address.
+ */
+static void images_create(surface_nv_ctx_t *nv, video_surface_ctx_t *vs)
+{
+  int i;
+  const EGLint renderImageAttrs[] = {
+    EGL_IMAGE_PRESERVED_KHR, EGL_FALSE, 
+    EGL_NONE
+  };
+
+  for(i = 0; i < nv->numTextureNames; i++)
+  {
+    glActiveTexture(GL_TEXTURE0 + nv->textureNames[i]);
+    EGLint iErr = eglGetError();
+    assert (iErr == EGL_SUCCESS);
+    
+    glBindTexture(GL_TEXTURE_2D, nv->textureNames[i]);
+    iErr = eglGetError();
+    assert (iErr == EGL_SUCCESS);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    iErr = eglGetError();
+    assert (iErr == EGL_SUCCESS);
+    // tiled textures must not be filtered across tiles
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, nv->tiled ? GL_NEAREST : GL_LINEAR);
+    if (i == 0 || i == 1 )
+    {
+      createTexture2D(&nv->cMemPixmap[i], nv, vs, y_plane);
+    }
+    else if(i == 2 || i == 3) 
+    {
+      if(nv->numTextureNames == 6)
+         createTexture2D(&nv->cMemPixmap[i], nv, vs, u_plane);
+      else
+         createTexture2D(&nv->cMemPixmap[i], nv, vs, uv_plane);
+    }
+    else
+    {
+         createTexture2D(&nv->cMemPixmap[i], nv, vs, v_plane);
+    }
+    //create the chrominance egl image
+    nv->eglImage[i] = peglCreateImageKHR(eglDisplay,
+			EGL_NO_CONTEXT,  
+			EGL_NATIVE_PIXMAP_KHR,
+			&nv->cMemPixmap[i],
+			renderImageAttrs);
+    iErr = eglGetError();
+    assert (iErr == EGL_SUCCESS);
+    pglEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)nv->eglImage[i]);
+    iErr = glGetError();
+//    assert (iErr == GL_NO_ERROR);
+  }
+
+  nv->image_y = cedarv_virt2phys(nv->tiled ? vs->dataY : nv->convY);
+  nv->image_uv = cedarv_virt2phys(nv->tiled ? vs->dataU : nv->convU);
+  nv->images_valid = 1;
+}
+
+static void images_destroy(surface_nv_ctx_t *nv)
+{
+  int i;
+
+  if (!nv->images_valid)
+    return;
+
+  for(i = 0; i < nv->numTextureNames; i++)
+  {
+    glActiveTexture(GL_TEXTURE0 + nv->textureNames[i]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    if(nv->eglImage[i])
+    {
+      peglDestroyImageKHR(eglDisplay, nv->eglImage[i]);
+      nv->eglImage[i] = 0;
+    }
+    ump_reference_release(nv->cMemPixmap[i].data);
+    //cedarv_setBufferInvalid((CEDARV_MEMORY)nv->cMemPixmap[i].data);
+  }
+  nv->images_valid = 0;
+}
+
 void glVDPAUMapSurfacesNV(GLsizei numSurfaces, const vdpauSurfaceNV *surfaces)
 {
-  int i, j;
+  int j;
   glEnable(GL_TEXTURE_2D);
 
   for(j = 0; j < numSurfaces; j++)
   {
     surface_nv_ctx_t *nv = handle_get(surfaces[j]);
     assert(nv);
-    const EGLint renderImageAttrs[] = {
-      EGL_IMAGE_PRESERVED_KHR, EGL_FALSE, 
-      EGL_NONE
-    };
 
     video_surface_ctx_t *vs = handle_get(nv->surface);
     assert(vs);
 
-    //Log(0, "glVDPAUMapSurfacesNV: starting MB2Yuv planar convert");
-    cedarv_disp_convertMb2Yuv420(nv->conv_width, nv->conv_height,
-                            vs->dataY, vs->dataU, nv->convY, nv->convU, nv->convV);
-    //Log(0, "glVDPAUMapSurfacesNV: finished MB2Yuv planar convert");
+    cedarv_sync(vs->fence);
 
-    for(i = 0; (nv->vdpNvState == VdpauNVState_Registered) && (i < nv->numTextureNames); i++)
+    if (!nv->tiled)
     {
-
-      glActiveTexture(GL_TEXTURE0 + nv->textureNames[i]);
-      EGLint iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      
-      glBindTexture(GL_TEXTURE_2D, nv->textureNames[i]);
-      iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-      if (i == 0 || i == 1 )
-      {
-        createTexture2D(&nv->cMemPixmap[i], nv, vs, y_plane);
-      }
-      else if(i == 2 || i == 3) 
-      {
-        if(nv->numTextureNames == 6)
-           createTexture2D(&nv->cMemPixmap[i], nv, vs, u_plane);
-        else
-           createTexture2D(&nv->cMemPixmap[i], nv, vs, uv_plane);
-      }
-      else
-      {
-           createTexture2D(&nv->cMemPixmap[i], nv, vs, v_plane);
-      }
-      vs->vdpNvState = VdpauNVState_Mapped;
-      //create the chrominance egl image
-      nv->eglImage[i] = peglCreateImageKHR(eglDisplay,
-			  EGL_NO_CONTEXT,  
-			  EGL_NATIVE_PIXMAP_KHR,
-			  &nv->cMemPixmap[i],
-			  renderImageAttrs);
-      iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      pglEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)nv->eglImage[i]);
-      iErr = glGetError();
-//      assert (iErr == GL_NO_ERROR);
+      //Log(0, "glVDPAUMapSurfacesNV: starting MB2Yuv planar convert");
+      cedarv_disp_convertMb2Yuv420(nv->conv_width, nv->conv_height,
+                              vs->dataY, vs->dataU, nv->convY, nv->convU, nv->convV);
+      //Log(0, "glVDPAUMapSurfacesNV: finished MB2Yuv planar convert");
     }
+
+    if (nv->images_valid &&
+        (nv->image_y != cedarv_virt2phys(nv->tiled ? vs->dataY : nv->convY) ||
+         nv->image_uv != cedarv_virt2phys(nv->tiled ? vs->dataU : nv->convU)))
+      images_destroy(nv);
+
+    if (nv->vdpNvState == VdpauNVState_Registered && !nv->images_valid)
+      images_create(nv, vs);
+
+    vs->vdpNvState = VdpauNVState_Mapped;
     handle_release(nv->surface);
     nv->vdpNvState = VdpauNVState_Mapped;
     handle_release(surfaces[j]);
@@ -413,31 +523,22 @@ void glVDPAUMapSurfacesNV(GLsizei numSurfaces, const vdpauSurfaceNV *surfaces)
 
 void glVDPAUUnmapSurfacesNV(GLsizei numSurfaces, const vdpauSurfaceNV *surfaces)
 {
-  int i,j;
+  int j;
   
   for(j = 0; j < numSurfaces; j++)
   {
     surface_nv_ctx_t *nv  = handle_get(surfaces[j]);
     assert(nv);
     
-    for(i = 0; (nv->vdpNvState == VdpauNVState_Mapped) && (i < nv->numTextureNames); i++)
+    // the images stay, see images_create()
+    if (nv->vdpNvState == VdpauNVState_Mapped)
     {
       video_surface_ctx_t *vs = handle_get(nv->surface);
       assert(vs);
       vs->vdpNvState = VdpauNVState_Registered;
-      glActiveTexture(GL_TEXTURE0 + nv->textureNames[i]);
-      glBindTexture(GL_TEXTURE_2D, 0);
-      if(nv->eglImage[i])
-      {
-	peglDestroyImageKHR(eglDisplay, nv->eglImage[i]);
-	nv->eglImage[i] = 0;
-      }
-      ump_reference_release(nv->cMemPixmap[i].data);
-      //cedarv_setBufferInvalid((CEDARV_MEMORY)nv->cMemPixmap[i].data);
       handle_release(nv->surface);
     }
     nv->vdpNvState = VdpauNVState_Registered;
     handle_release(surfaces[j]);
   }
 }
-
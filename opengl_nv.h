@@ -25,6 +25,10 @@ typedef struct surface_nv_ctx_struct
   CEDARV_MEMORY         convV;
   uint32_t              conv_width;
   uint32_t              conv_height;
+  int                   tiled;
+  int                   images_valid;	// eglImage/cMemPixmap are set up
+  uint32_t              image_y;	// planes they were made for
+  uint32_t              image_uv;
 
 } surface_nv_ctx_t;
 
@@ -22,9 +22,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
+#include <linux/fb.h>
+#include <poll.h>
 #include "sunxi_disp_ioctl.h"
 #include "ve.h"
+#include "trace.h"
+#include "counters.h"
 #include <errno.h>
 
 uint64_t get_time(void)
@@ -37,6 +42,286 @@ uint64_t get_time(void)
 	return (uint64_t)tp.tv_sec * 1000000000ULL + (uint64_t)tp.tv_nsec;
 }
 
+static void sleep_until(VdpTime t)
+{
+	struct timespec ts = { t / 1000000000ULL, t % 1000000000ULL };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/*
+ * /dev/disp and /dev/fb0 are used through a backend like the VE.
+ * VDPAU_DISP_BACKEND=stub replaces both with a stand-in that accepts
+ * every command, paces vsync at 60 Hz and counts the ioctls per
+ * command. The counts are printed when the layer is closed, so
+ * changes to the display path can be checked without a display.
+ */
+struct disp_backend
+{
+	const char *name;
+	int (*open)(const char *path);
+	void (*close)(int fd);
+	int (*ioctl)(int fd, unsigned long cmd, void *arg);
+};
+
+static int hw_open(const char *path)
+{
+	return open(path, O_RDWR);
+}
+
+static void hw_close(int fd)
+{
+	close(fd);
+}
+
+static int hw_ioctl(int fd, unsigned long cmd, void *arg)
+{
+	return ioctl(fd, cmd, arg);
+}
+
+static const struct disp_backend hw_backend =
+{
+	.name = "disp",
+	.open = hw_open,
+	.close = hw_close,
+	.ioctl = hw_ioctl,
+};
+
+#define STUB_CMDS	0x200
+#define STUB_FD		0x7ffff000
+#define STUB_LAYER	0x65
+#define STUB_VSYNC_PERIOD	(1000000000ULL / 60)
+
+static struct
+{
+	unsigned int counts[STUB_CMDS];
+	unsigned int vsyncs;
+	unsigned int other;
+} stub;
+
+static int stub_open(const char *path)
+{
+	return STUB_FD;
+}
+
+static void stub_close(int fd)
+{
+	int i;
+
+	printf("disp stub: %u vsync waits, %u other\n", stub.vsyncs, stub.other);
+	for (i = 0; i < STUB_CMDS; i++)
+		if (stub.counts[i])
+			printf("disp stub: cmd 0x%03x %u\n", i, stub.counts[i]);
+}
+
+static int stub_ioctl(int fd, unsigned long cmd, void *arg)
+{
+	if (cmd == FBIO_WAITFORVSYNC)
+	{
+		sleep_until((get_time() / STUB_VSYNC_PERIOD + 1) * STUB_VSYNC_PERIOD);
+		__atomic_fetch_add(&stub.vsyncs, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (cmd >= STUB_CMDS)
+	{
+		__atomic_fetch_add(&stub.other, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	__atomic_fetch_add(&stub.counts[cmd], 1, __ATOMIC_RELAXED);
+	switch (cmd)
+	{
+	case DISP_CMD_LAYER_REQUEST:
+		return STUB_LAYER;
+	case DISP_CMD_SCN_GET_WIDTH:
+		return 1920;
+	case DISP_CMD_SCN_GET_HEIGHT:
+		return 1080;
+	default:
+		return 0;
+	}
+}
+
+static const struct disp_backend stub_backend =
+{
+	.name = "stub",
+	.open = stub_open,
+	.close = stub_close,
+	.ioctl = stub_ioctl,
+};
+
+static const struct disp_backend *disp = &hw_backend;
+
+/*
+ * The overlay has to follow the drawable on screen. A private X
+ * connection gets ConfigureNotify, ReparentNotify and Expose for the
+ * drawable and its ancestors, and a thread keeps the absolute position
+ * in qt->position. display reads it without an X round-trip.
+ */
+#define POSITION(x, y)	(((uint64_t)(uint32_t)(x) << 32) | (uint32_t)(y))
+#define POSITION_X(p)	((int32_t)((p) >> 32))
+#define POSITION_Y(p)	((int32_t)(p))
+
+/*
+ * The drawable or a window manager frame can be destroyed between an event
+ * and the requests that follow it. Xlib's default handler exits on the
+ * BadWindow, so errors of the tracking connection of the calling thread
+ * are only recorded, everything else goes to the previous handler.
+ */
+static __thread Display *x11_checked;
+static __thread int x11_failed;
+static XErrorHandler x11_prev_handler;
+static pthread_once_t x11_handler_once = PTHREAD_ONCE_INIT;
+
+static int x11_error_handler(Display *display, XErrorEvent *ev)
+{
+	if (display == x11_checked)
+	{
+		x11_failed = 1;
+		return 0;
+	}
+
+	return x11_prev_handler ? x11_prev_handler(display, ev) : 0;
+}
+
+static void x11_install_handler(void)
+{
+	x11_prev_handler = XSetErrorHandler(x11_error_handler);
+}
+
+// keeps the last position if a window went away meanwhile
+static void x11_update_position(queue_target_ctx_t *qt)
+{
+	Window root = None, parent, *children, w, child;
+	unsigned int n;
+	int x, y, ok = 0;
+
+	x11_failed = 0;
+
+	// a reparenting window manager changes the ancestors, select them again
+	for (w = qt->drawable; XQueryTree(qt->display, w, &root, &parent, &children, &n); w = parent)
+	{
+		if (children)
+			XFree(children);
+		if (w != qt->drawable)
+			XSelectInput(qt->display, w, StructureNotifyMask);
+		if (parent == root || parent == None)
+			break;
+	}
+
+	if (root != None)
+		ok = XTranslateCoordinates(qt->display, qt->drawable, root, 0, 0, &x, &y, &child);
+
+	// errors of XSelectInput arrive asynchronously, collect them here
+	XSync(qt->display, False);
+
+	if (ok && !x11_failed)
+		__atomic_store_n(&qt->position, POSITION(x, y), __ATOMIC_RELAXED);
+}
+
+static void *x11_thread(void *arg)
+{
+	queue_target_ctx_t *qt = arg;
+	struct pollfd fds[2] = {
+		{ .fd = ConnectionNumber(qt->display), .events = POLLIN },
+		{ .fd = qt->x11_pipe[0], .events = POLLIN },
+	};
+	XEvent ev;
+
+	x11_checked = qt->display;
+
+	while (1)
+	{
+		int changed = 0;
+
+		// drain everything first, a move sends a burst of events
+		while (XPending(qt->display))
+		{
+			XNextEvent(qt->display, &ev);
+			if (ev.type == DestroyNotify && ev.xdestroywindow.window == qt->drawable)
+				return NULL;
+			changed = 1;
+		}
+
+		if (changed)
+		{
+			x11_update_position(qt);
+
+			// the round-trips may have queued new events, the socket
+			// has nothing left to wake poll() for them
+			if (XEventsQueued(qt->display, QueuedAlready) > 0)
+				continue;
+		}
+
+		if (poll(fds, 2, -1) == -1 && errno != EINTR)
+			return NULL;
+		if (fds[1].revents)
+			return NULL;
+	}
+}
+
+static void x11_track_start(queue_target_ctx_t *qt, Display *display)
+{
+	qt->display = XOpenDisplay(XDisplayString(display));
+	if (!qt->display)
+	{
+		printf("could not open X display, overlay will not follow the window\n");
+		return;
+	}
+
+	pthread_once(&x11_handler_once, x11_install_handler);
+
+	x11_checked = qt->display;
+	XSelectInput(qt->display, qt->drawable, StructureNotifyMask | ExposureMask);
+	x11_update_position(qt);
+	x11_checked = NULL;
+
+	if (pipe(qt->x11_pipe) == -1)
+		goto err;
+
+	if (pthread_create(&qt->x11_thread, NULL, x11_thread, qt) != 0)
+	{
+		close(qt->x11_pipe[0]);
+		close(qt->x11_pipe[1]);
+		goto err;
+	}
+
+	return;
+
+err:
+	XCloseDisplay(qt->display);
+	qt->display = NULL;
+}
+
+static void x11_track_stop(queue_target_ctx_t *qt)
+{
+	if (!qt->display)
+		return;
+
+	write(qt->x11_pipe[1], "", 1);
+	pthread_join(qt->x11_thread, NULL);
+	close(qt->x11_pipe[0]);
+	close(qt->x11_pipe[1]);
+	XCloseDisplay(qt->display);
+	qt->display = NULL;
+}
+
+/*
+ * What was last handed to the display engine for a target. A flip that
+ * only changes the buffer addresses goes through the video path with
+ * DISP_CMD_VIDEO_SET_FB, anything else is sent as one command cache
+ * batch so geometry and enhance changes apply at the same vsync.
+ */
+struct layer_state
+{
+	int open;
+	int video_started;
+	int no_video;
+	int32_t frame_id;
+	__disp_layer_info_t layer_info;
+};
+
 VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable drawable, VdpPresentationQueueTarget *target)
 {
     uint32_t tmp[4];
@@ -47,6 +332,10 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
+    char *env_vdpau_disp_backend = getenv("VDPAU_DISP_BACKEND");
+    if (env_vdpau_disp_backend && strcmp(env_vdpau_disp_backend, "stub") == 0)
+        disp = &stub_backend;
+
     queue_target_ctx_t *qt = handle_create(sizeof(*qt), target, htype_presentation_target);
     if (!qt)
     {
@@ -55,7 +344,8 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
     }
 
     qt->drawable = drawable;
-    qt->fd = open("/dev/disp", O_RDWR);
+    qt->users = 1;
+    qt->fd = disp->open("/dev/disp");
     if (qt->fd == -1)
     {
         handle_release(device);
@@ -63,29 +353,29 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
         return VDP_STATUS_ERROR;
     }
 
-    dev->fb_fd = open("/dev/fb0", O_RDWR);
+    dev->fb_fd = disp->open("/dev/fb0");
     if (dev->fb_fd == -1)
     {
-        close(qt->fd);
+        disp->close(qt->fd);
         handle_release(device);
         handle_destroy(*target);
         return VDP_STATUS_ERROR;
     }
 
     int ver = SUNXI_DISP_VERSION;
-    if (ioctl(qt->fd, DISP_CMD_VERSION, &ver) < 0)
+    if (disp->ioctl(qt->fd, DISP_CMD_VERSION, &ver) < 0)
     {
-        close(qt->fd);
-        close(dev->fb_fd);
+        disp->close(qt->fd);
+        disp->close(dev->fb_fd);
         handle_release(device);
         handle_destroy(*target);
         return VDP_STATUS_ERROR;
     }
 
-    if (ioctl(dev->fb_fd, FBIOGET_LAYER_HDL_0, &dev->fb_layer_id))
+    if (disp->ioctl(dev->fb_fd, FBIOGET_LAYER_HDL_0, &dev->fb_layer_id))
     {
-        close(qt->fd);
-        close(dev->fb_fd);
+        disp->close(qt->fd);
+        disp->close(dev->fb_fd);
         handle_release(device);
         handle_destroy(*target);
         return VDP_STATUS_ERROR;
@@ -99,15 +389,15 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
        args[1] = i;
        args[2] = 0;
        args[3] = 0;
-       ioctl(qt->fd, DISP_CMD_LAYER_RELEASE, &args[0]);
+       disp->ioctl(qt->fd, DISP_CMD_LAYER_RELEASE, &args[0]);
     }
 
     args[1] = DISP_LAYER_WORK_MODE_SCALER;
-    qt->layer = ioctl(qt->fd, DISP_CMD_LAYER_REQUEST, args);
+    qt->layer = disp->ioctl(qt->fd, DISP_CMD_LAYER_REQUEST, args);
     if (qt->layer == 0)
     {
-            close(qt->fd);
-            close(dev->fb_fd);
+            disp->close(qt->fd);
+            disp->close(dev->fb_fd);
             handle_release(device);
             handle_destroy(*target);
             return VDP_STATUS_RESOURCES;
@@ -128,14 +418,14 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
 
     args[0] = dev->fb_id;
     args[1] = (unsigned long)(&ck);
-    ioctl(qt->fd, DISP_CMD_SET_COLORKEY, args);
+    disp->ioctl(qt->fd, DISP_CMD_SET_COLORKEY, args);
 
     tmp[0] = dev->fb_id;
     int ret;
-    ret = ioctl(qt->fd, DISP_CMD_SCN_GET_WIDTH, tmp);
+    ret = disp->ioctl(qt->fd, DISP_CMD_SCN_GET_WIDTH, tmp);
     qt->screen_width = ret;
 
-    ret = ioctl(qt->fd, DISP_CMD_SCN_GET_HEIGHT, tmp);
+    ret = disp->ioctl(qt->fd, DISP_CMD_SCN_GET_HEIGHT, tmp);
     qt->screen_height = ret;
 
 #if 1
@@ -144,14 +434,14 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
     tmp[1] = dev->fb_layer_id;
     tmp[2] = (unsigned long) (&layer_info);
     tmp[3] = 0;
-    if (ioctl(qt->fd, DISP_CMD_LAYER_GET_PARA, tmp) < 0)
+    if (disp->ioctl(qt->fd, DISP_CMD_LAYER_GET_PARA, tmp) < 0)
     {
             printf("layer get para failed\n");
     }
     layer_info.alpha_en = 1;
     layer_info.alpha_val = 255;
 
-    if (ioctl(qt->fd, DISP_CMD_LAYER_SET_PARA, tmp) < 0)
+    if (disp->ioctl(qt->fd, DISP_CMD_LAYER_SET_PARA, tmp) < 0)
     {
             printf("layer get para failed\n");
     }
@@ -161,7 +451,7 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
     /* Enable color key for the overlay layer */
     tmp[0] = dev->fb_id;
     tmp[1] = qt->layer;
-    if (ioctl(qt->fd, DISP_CMD_LAYER_CK_ON, &tmp) < 0)
+    if (disp->ioctl(qt->fd, DISP_CMD_LAYER_CK_ON, &tmp) < 0)
     {
             printf("layer ck on failed\n");
     }
@@ -170,11 +460,11 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
     args[1] = (unsigned long)(&ck);
     args[2] = 0;
     args[3] = 0;
-    ioctl(qt->fd, DISP_CMD_SET_BKCOLOR, args);
+    disp->ioctl(qt->fd, DISP_CMD_SET_BKCOLOR, args);
     
     tmp[0] = dev->fb_id;
     tmp[1] = qt->layer;
-    if (ioctl(qt->fd, DISP_CMD_LAYER_TOP, &tmp) < 0)
+    if (disp->ioctl(qt->fd, DISP_CMD_LAYER_TOP, &tmp) < 0)
     {
         printf("layer bottom 2 failed\n");
     }
@@ -183,7 +473,7 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
     /* Set the overlay layer below the screen layer */
     tmp[0] = dev->fb_id;
     tmp[1] = dev->fb_layer_id;
-    if (ioctl(qt->fd, DISP_CMD_LAYER_TOP, &tmp) < 0)
+    if (disp->ioctl(qt->fd, DISP_CMD_LAYER_TOP, &tmp) < 0)
     {
         printf("layer bottom 1 failed\n");
     }
@@ -193,21 +483,21 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
     /* Disable color key and enable global alpha for the screen layer */
     tmp[0] = dev->fb_id;
     tmp[1] = dev->fb_layer_id;
-    if (ioctl(qt->fd, DISP_CMD_LAYER_CK_OFF, &tmp) < 0)
+    if (disp->ioctl(qt->fd, DISP_CMD_LAYER_CK_OFF, &tmp) < 0)
     {
             printf("layer ck off failed\n");
     }
     tmp[0] = dev->fb_id;
     tmp[1] = dev->fb_layer_id;
     tmp[2] = 0xFF;
-    if (ioctl(qt->fd,DISP_CMD_LAYER_SET_ALPHA_VALUE,(void*)tmp) < 0)
+    if (disp->ioctl(qt->fd,DISP_CMD_LAYER_SET_ALPHA_VALUE,(void*)tmp) < 0)
     {
             printf("set alpha value failed\n");
     }
 
     tmp[0] = dev->fb_id;
     tmp[1] = dev->fb_layer_id;
-    if (ioctl(qt->fd, DISP_CMD_LAYER_ALPHA_ON, &tmp) < 0)
+    if (disp->ioctl(qt->fd, DISP_CMD_LAYER_ALPHA_ON, &tmp) < 0)
     {
             printf("alpha on failed\n");
     }
@@ -218,29 +508,51 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
             printf("layer top failed\n");
     }
 
-    if (ioctl(qt->fd, DISP_CMD_VIDEO_START, args) < 0)
+    if (disp->ioctl(qt->fd, DISP_CMD_VIDEO_START, args) < 0)
     {
             printf("video start failed\n");
     }
 #endif
 #endif
+    if (dev->display && drawable)
+        x11_track_start(qt, dev->display);
+
     printf("vdpau presentation target queue=%d created\n", *target);
 
     handle_release(device);
     return VDP_STATUS_OK;
 }
 
+/*
+ * The layer, its state and the disp fd are used by the flip threads of
+ * the queues on a target, so the target and every queue hold a use and
+ * whoever drops the last one closes them. A target destroyed before its
+ * queues stays on screen until the last queue is destroyed.
+ */
+static void target_put(queue_target_ctx_t *qt)
+{
+	if (__atomic_sub_fetch(&qt->users, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	uint32_t args[4] = { 0, qt->layer, 0, 0 };
+	if (qt->state && qt->state->video_started)
+		disp->ioctl(qt->fd, DISP_CMD_VIDEO_STOP, args);
+	disp->ioctl(qt->fd, DISP_CMD_LAYER_CLOSE, args);
+	disp->ioctl(qt->fd, DISP_CMD_LAYER_RELEASE, args);
+
+	disp->close(qt->fd);
+	free(qt->state);
+	qt->state = NULL;
+}
+
 VdpStatus vdp_presentation_queue_target_destroy(VdpPresentationQueueTarget presentation_queue_target)
 {
 	queue_target_ctx_t *qt = handle_get(presentation_queue_target);
 	if (!qt)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	uint32_t args[4] = { 0, qt->layer, 0, 0 };
-	ioctl(qt->fd, DISP_CMD_LAYER_CLOSE, args);
-	ioctl(qt->fd, DISP_CMD_LAYER_RELEASE, args);
-
-	close(qt->fd);
+	x11_track_stop(qt);
+	target_put(qt);
 
         handle_release(presentation_queue_target);
 	handle_destroy(presentation_queue_target);
@@ -249,8 +561,240 @@ VdpStatus vdp_presentation_queue_target_destroy(VdpPresentationQueueTarget prese
         return VDP_STATUS_OK;
 }
 
+#define QUEUE_SIZE 16
+
+struct queue_entry
+{
+	VdpOutputSurface surface;
+	output_surface_ctx_t *os;
+	VdpTime earliest;
+	uint32_t fence;
+	__disp_layer_info_t layer_info;
+	int csc_change;
+	float brightness;
+	float contrast;
+	float saturation;
+	float hue;
+};
+
+/*
+ * Waits for the next vsync and returns its time. The period is learned
+ * from consecutive vsyncs, without FBIO_WAITFORVSYNC the flips are
+ * paced on the last known period instead.
+ */
+static VdpTime wait_vsync(queue_ctx_t *q)
+{
+	VdpTime now, next;
+	uint32_t crtc = 0;
+
+	if (!q->no_vsync)
+	{
+		TRACE_BEGIN(t);
+		if (disp->ioctl(q->device->fb_fd, FBIO_WAITFORVSYNC, &crtc) == 0)
+		{
+			TRACE_END(t, "disp_wait_vsync");
+			now = get_time();
+			if (q->last_vsync)
+			{
+				VdpTime d = now - q->last_vsync;
+				if (d > q->vsync_period / 2 && d < q->vsync_period * 3 / 2)
+					q->vsync_period = (q->vsync_period * 7 + d) / 8;
+			}
+			q->last_vsync = now;
+			return now;
+		}
+
+		printf("waiting for vsync failed, errno=%d\n", errno);
+		q->no_vsync = 1;
+	}
+
+	now = get_time();
+	next = q->last_vsync + q->vsync_period;
+	if (next < now)
+		next = now;
+	sleep_until(next);
+	q->last_vsync = next;
+	return next;
+}
+
+// the vsync at which a layer change made now becomes visible
+static VdpTime next_vsync(queue_ctx_t *q, VdpTime now)
+{
+	if (!q->last_vsync || q->last_vsync > now)
+		return now;
+
+	return q->last_vsync + ((now - q->last_vsync) / q->vsync_period + 1) * q->vsync_period;
+}
+
+static void flip(queue_ctx_t *q, struct queue_entry *e)
+{
+	int error;
+	queue_target_ctx_t *qt = q->target;
+	struct layer_state *st = qt->state;
+	uint32_t args[4] = { 0, qt->layer, (unsigned long)(&e->layer_info), 0 };
+	__disp_layer_info_t cmp;
+
+	cedarv_sync(e->fence);
+
+	if (!st && !(st = qt->state = calloc(1, sizeof(*st))))
+	{
+		printf("out of memory for layer state\n");
+		return;
+	}
+
+	cmp = e->layer_info;
+	memcpy(cmp.fb.addr, st->layer_info.fb.addr, sizeof(cmp.fb.addr));
+	if (st->video_started && !e->csc_change && memcmp(&cmp, &st->layer_info, sizeof(cmp)) == 0)
+	{
+		__disp_video_fb_t fb;
+		memset(&fb, 0, sizeof(fb));
+		fb.id = ++st->frame_id;
+		memcpy(fb.addr, e->layer_info.fb.addr, sizeof(fb.addr));
+
+		args[2] = (unsigned long)(&fb);
+		TRACE_BEGIN(t);
+		error = disp->ioctl(qt->fd, DISP_CMD_VIDEO_SET_FB, args);
+		TRACE_END(t, "disp_video_set_fb");
+		if (error == 0)
+		{
+			memcpy(st->layer_info.fb.addr, fb.addr, sizeof(fb.addr));
+			return;
+		}
+
+		printf("video set fb failed, errno=%d\n", errno);
+		st->video_started = 0;
+		st->no_video = 1;
+		args[2] = (unsigned long)(&e->layer_info);
+	}
+
+	TRACE_BEGIN(t);
+	disp->ioctl(qt->fd, DISP_CMD_START_CMD_CACHE, args);
+
+	error = disp->ioctl(qt->fd, DISP_CMD_LAYER_SET_PARA, args);
+	if(error < 0)
+	{
+		printf("set para failed\n");
+	}
+
+	if (!st->open)
+	{
+		error = disp->ioctl(qt->fd, DISP_CMD_LAYER_OPEN, args);
+		if(error < 0)
+		{
+			printf("layer open failed, fd=%d, errno=%d\n", qt->fd, errno);
+		}
+		else
+			st->open = 1;
+	}
+
+	// Note: might be more reliable (but slower and problematic when there
+	// are driver issues and the GET functions return wrong values) to query the
+	// old values instead of relying on our internal csc_change.
+	// Since the driver calculates a matrix out of these values after each
+	// set doing this unconditionally is costly.
+	if (e->csc_change) {
+		disp->ioctl(qt->fd, DISP_CMD_LAYER_ENHANCE_OFF, args);
+		args[2] = 0xff * e->brightness + 0x20;
+		disp->ioctl(qt->fd, DISP_CMD_LAYER_SET_BRIGHT, args);
+		args[2] = 0x20 * e->contrast;
+		disp->ioctl(qt->fd, DISP_CMD_LAYER_SET_CONTRAST, args);
+		args[2] = 0x20 * e->saturation;
+		disp->ioctl(qt->fd, DISP_CMD_LAYER_SET_SATURATION, args);
+		// hue scale is randomly chosen, no idea how it maps exactly
+		args[2] = (32 / 3.14) * e->hue + 0x20;
+		disp->ioctl(qt->fd, DISP_CMD_LAYER_SET_HUE, args);
+		disp->ioctl(qt->fd, DISP_CMD_LAYER_ENHANCE_ON, args);
+	}
+
+	disp->ioctl(qt->fd, DISP_CMD_EXECUTE_CMD_AND_STOP_CACHE, args);
+	TRACE_END(t, "disp_layer_update");
+	st->layer_info = e->layer_info;
+
+	// later flips of the same geometry only swap the buffer
+	if (st->open && !st->video_started && !st->no_video)
+	{
+		if (disp->ioctl(qt->fd, DISP_CMD_VIDEO_START, args) == 0)
+			st->video_started = 1;
+		else
+			st->no_video = 1;
+	}
+}
+
+/*
+ * Shows each pending surface at the first vsync at or after its earliest
+ * presentation time, rounded to the nearest vsync to absorb timestamp
+ * jitter. The layer parameters are latched by the display engine at the
+ * next vsync, so they are set one vsync ahead. A surface stays VISIBLE
+ * until the next one replaces it, then it becomes IDLE and the queue
+ * drops its reference.
+ */
+static void *flip_thread(void *arg)
+{
+	queue_ctx_t *q = arg;
+	struct queue_entry e;
+	VdpOutputSurface old;
+	VdpTime now, next, shown;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->stop)
+	{
+		if (q->pending_count == 0)
+		{
+			pthread_cond_wait(&q->wake, &q->lock);
+			continue;
+		}
+
+		now = get_time();
+		next = next_vsync(q, now);
+		if (q->pending[0].earliest > next + q->vsync_period / 2)
+		{
+			// sleep until just after the vsync before the one we want
+			VdpTime wake = q->pending[0].earliest - q->vsync_period / 2;
+			struct timespec ts = { wake / 1000000000ULL, wake % 1000000000ULL };
+			pthread_cond_timedwait(&q->wake, &q->lock, &ts);
+			continue;
+		}
+
+		e = q->pending[0];
+		q->pending_count--;
+		memmove(&q->pending[0], &q->pending[1], q->pending_count * sizeof(e));
+		pthread_mutex_unlock(&q->lock);
+
+		flip(q, &e);
+		shown = wait_vsync(q);
+		if (e.earliest && shown > e.earliest + q->vsync_period)
+			COUNTER_INC(display_late);
+
+		pthread_mutex_lock(&q->lock);
+		old = q->visible;
+		if (old != VDP_INVALID_HANDLE)
+		{
+			output_surface_ctx_t *os = handle_get(old);
+			if (os)
+			{
+				if (!os->queued)
+					os->status = VDP_PRESENTATION_QUEUE_STATUS_IDLE;
+				handle_release(old);
+			}
+			handle_release(old);
+		}
+
+		if (e.os->queued)
+			e.os->queued--;
+		e.os->status = VDP_PRESENTATION_QUEUE_STATUS_VISIBLE;
+		e.os->first_presentation_time = shown;
+		q->visible = e.surface;
+		pthread_cond_broadcast(&q->idle);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
 VdpStatus vdp_presentation_queue_create(VdpDevice device, VdpPresentationQueueTarget presentation_queue_target, VdpPresentationQueue *presentation_queue)
 {
+	pthread_condattr_t attr;
+
 	if (!presentation_queue)
 		return VDP_STATUS_INVALID_POINTER;
 
@@ -278,18 +822,79 @@ VdpStatus vdp_presentation_queue_create(VdpDevice device, VdpPresentationQueueTa
 	q->device = dev;
         q->target_hdl = presentation_queue_target;
         q->device_hdl = device;
-        
+
+	q->pending = calloc(QUEUE_SIZE, sizeof(struct queue_entry));
+	if (!q->pending)
+		goto err_pending;
+
+	q->visible = VDP_INVALID_HANDLE;
+	q->vsync_period = 1000000000ULL / 60;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&q->idle, NULL);
+
+	__atomic_add_fetch(&qt->users, 1, __ATOMIC_ACQ_REL);
+	if (pthread_create(&q->flip_thread, NULL, flip_thread, q) != 0)
+		goto err_thread;
+
         printf("vdpau presentation queue=%d created\n", *presentation_queue);
 
         return VDP_STATUS_OK;
+
+err_thread:
+	target_put(qt);
+	pthread_cond_destroy(&q->idle);
+	pthread_cond_destroy(&q->wake);
+	pthread_mutex_destroy(&q->lock);
+	free(q->pending);
+err_pending:
+	handle_release(device);
+	handle_release(presentation_queue_target);
+	handle_destroy(*presentation_queue);
+	return VDP_STATUS_RESOURCES;
 }
 
 VdpStatus vdp_presentation_queue_destroy(VdpPresentationQueue presentation_queue)
 {
+	int i;
+
 	queue_ctx_t *q = handle_get(presentation_queue);
 	if (!q)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_signal(&q->wake);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->flip_thread, NULL);
+
+	// drop the references the queue holds, pending surfaces are never shown
+	for (i = 0; i < q->pending_count; i++)
+	{
+		q->pending[i].os->status = VDP_PRESENTATION_QUEUE_STATUS_IDLE;
+		q->pending[i].os->queued = 0;
+		handle_release(q->pending[i].surface);
+	}
+	if (q->visible != VDP_INVALID_HANDLE)
+	{
+		output_surface_ctx_t *os = handle_get(q->visible);
+		if (os)
+		{
+			os->status = VDP_PRESENTATION_QUEUE_STATUS_IDLE;
+			handle_release(q->visible);
+		}
+		handle_release(q->visible);
+	}
+
+	pthread_cond_destroy(&q->idle);
+	pthread_cond_destroy(&q->wake);
+	pthread_mutex_destroy(&q->lock);
+	free(q->pending);
+
+	target_put(q->target);
         handle_release(q->target_hdl);
         handle_release(q->device_hdl);
         handle_release(presentation_queue);
@@ -348,7 +953,8 @@ VdpStatus vdp_presentation_queue_get_time(VdpPresentationQueue presentation_queu
 
 VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, uint32_t clip_width, uint32_t clip_height, VdpTime earliest_presentation_time)
 {
-        int error;
+	struct queue_entry e;
+	int i;
 
 	queue_ctx_t *q = handle_get(presentation_queue);
 	if (!q)
@@ -370,128 +976,129 @@ VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue
 		return VDP_STATUS_OK;
 	}
 
-	if (earliest_presentation_time != 0)
-		VDPAU_DBG_ONCE("Presentation time not supported");
+	COUNTER_INC(display_calls);
 
 	//printf("%s: p_q=%d,o_s=%d\n", __FUNCTION__, presentation_queue, surface);
 
-	Window c;
-	int x=0,y=0;
-	//XTranslateCoordinates(q->device->display, q->target->drawable, RootWindow(q->device->display, q->device->screen), 0, 0, &x, &y, &c);
-	//XClearWindow(q->device->display, q->target->drawable);
+	uint64_t position = __atomic_load_n(&q->target->position, __ATOMIC_RELAXED);
+	int x = POSITION_X(position), y = POSITION_Y(position);
 
-	__disp_layer_info_t layer_info;
-	memset(&layer_info, 0, sizeof(layer_info));
-	layer_info.pipe = 1;
+	// the layer is set up from a copy, the surface may change before the flip
+	memset(&e, 0, sizeof(e));
+	e.surface = surface;
+	e.os = os;
+	e.earliest = earliest_presentation_time;
+	e.fence = os->vs->fence;
+
+	__disp_layer_info_t *layer_info = &e.layer_info;
+	layer_info->pipe = 1;
 #if 1
-        layer_info.alpha_en = 1;
-        layer_info.alpha_val = 0xff;
+        layer_info->alpha_en = 1;
+        layer_info->alpha_val = 0xff;
 #endif
-	layer_info.mode = DISP_LAYER_WORK_MODE_SCALER;
-	layer_info.fb.format = DISP_FORMAT_YUV420;
-	layer_info.fb.seq = DISP_SEQ_UVUV;
+	layer_info->mode = DISP_LAYER_WORK_MODE_SCALER;
+	layer_info->fb.format = DISP_FORMAT_YUV420;
+	layer_info->fb.seq = DISP_SEQ_UVUV;
 	switch (os->vs->source_format) {
 	case VDP_YCBCR_FORMAT_YUYV:
-		layer_info.fb.mode = DISP_MOD_INTERLEAVED;
-		layer_info.fb.format = DISP_FORMAT_YUV422;
-		layer_info.fb.seq = DISP_SEQ_YUYV;
+		layer_info->fb.mode = DISP_MOD_INTERLEAVED;
+		layer_info->fb.format = DISP_FORMAT_YUV422;
+		layer_info->fb.seq = DISP_SEQ_YUYV;
 		break;
 	case VDP_YCBCR_FORMAT_UYVY:
-		layer_info.fb.mode = DISP_MOD_INTERLEAVED;
-		layer_info.fb.format = DISP_FORMAT_YUV422;
-		layer_info.fb.seq = DISP_SEQ_UYVY;
+		layer_info->fb.mode = DISP_MOD_INTERLEAVED;
+		layer_info->fb.format = DISP_FORMAT_YUV422;
+		layer_info->fb.seq = DISP_SEQ_UYVY;
 		break;
 	case VDP_YCBCR_FORMAT_NV12:
-		layer_info.fb.mode = DISP_MOD_NON_MB_UV_COMBINED;
+		layer_info->fb.mode = DISP_MOD_NON_MB_UV_COMBINED;
 		break;
 	case VDP_YCBCR_FORMAT_YV12:
-		layer_info.fb.mode = DISP_MOD_NON_MB_PLANAR;
+		layer_info->fb.mode = DISP_MOD_NON_MB_PLANAR;
 		break;
 	default:
 	case INTERNAL_YCBCR_FORMAT:
-		layer_info.fb.mode = DISP_MOD_MB_UV_COMBINED;
+		layer_info->fb.mode = DISP_MOD_MB_UV_COMBINED;
 		break;
 	}
 	
-	layer_info.fb.br_swap = 0;
+	layer_info->fb.br_swap = 0;
 	//recalc data to cpu kernel addresses (+ 0x40000000)
-	layer_info.fb.addr[0] = cedarv_virt2phys(os->vs->dataY) + 0x40000000;
-	layer_info.fb.addr[1] = cedarv_virt2phys(os->vs->dataU)/* + os->vs->plane_size*/ + 0x40000000;
+	layer_info->fb.addr[0] = cedarv_virt2phys(os->vs->dataY) + 0x40000000;
+	layer_info->fb.addr[1] = cedarv_virt2phys(os->vs->dataU)/* + os->vs->plane_size*/ + 0x40000000;
 	if( cedarv_isValid(os->vs->dataV))
-	  layer_info.fb.addr[2] = cedarv_virt2phys(os->vs->dataV)/* + os->vs->plane_size + os->vs->plane_size / 4*/ + 0x40000000;
+	  layer_info->fb.addr[2] = cedarv_virt2phys(os->vs->dataV)/* + os->vs->plane_size + os->vs->plane_size / 4*/ + 0x40000000;
 
-	layer_info.fb.cs_mode = DISP_BT709;
-	layer_info.fb.size.width = os->vs->width; //q->target->screen_width;
-	layer_info.fb.size.height = os->vs->width; //q->target->screen_height;
+	layer_info->fb.cs_mode = DISP_BT709;
+	layer_info->fb.size.width = os->vs->width; //q->target->screen_width;
+	layer_info->fb.size.height = os->vs->width; //q->target->screen_height;
 #if 0
-       layer_info.src_win.x = 0;
-       layer_info.src_win.y = 0;
-       layer_info.src_win.width = os->vs->width;
-       layer_info.src_win.height = os->vs->height;
-       layer_info.scn_win.x = 0; //x + os->video_x;
-       layer_info.scn_win.y = 0; //y + os->video_y;
+       layer_info->src_win.x = 0;
+       layer_info->src_win.y = 0;
+       layer_info->src_win.width = os->vs->width;
+       layer_info->src_win.height = os->vs->height;
+       layer_info->scn_win.x = 0; //x + os->video_x;
+       layer_info->scn_win.y = 0; //y + os->video_y;
 #endif
-	layer_info.src_win.x = os->video_src_rect.x0;
-	layer_info.src_win.y = os->video_src_rect.y0;
-	layer_info.src_win.width = os->video_src_rect.x1 - os->video_src_rect.x0;
-	layer_info.src_win.height = os->video_src_rect.y1 - os->video_src_rect.y0;
-	layer_info.scn_win.x = x + os->video_dst_rect.x0;
-	layer_info.scn_win.y = y + os->video_dst_rect.y0;
-	layer_info.scn_win.width = os->video_dst_rect.x1 - os->video_dst_rect.x0;
-	layer_info.scn_win.height = os->video_dst_rect.y1 - os->video_dst_rect.y0;
-	layer_info.ck_enable = 1;
-
-	if (layer_info.scn_win.y < 0)
+	layer_info->src_win.x = os->video_src_rect.x0;
+	layer_info->src_win.y = os->video_src_rect.y0;
+	layer_info->src_win.width = os->video_src_rect.x1 - os->video_src_rect.x0;
+	layer_info->src_win.height = os->video_src_rect.y1 - os->video_src_rect.y0;
+	layer_info->scn_win.x = x + os->video_dst_rect.x0;
+	layer_info->scn_win.y = y + os->video_dst_rect.y0;
+	layer_info->scn_win.width = os->video_dst_rect.x1 - os->video_dst_rect.x0;
+	layer_info->scn_win.height = os->video_dst_rect.y1 - os->video_dst_rect.y0;
+	layer_info->ck_enable = 1;
+
+	if (layer_info->scn_win.y < 0)
 	{
-		int cutoff = -(layer_info.scn_win.y);
-		layer_info.src_win.y += cutoff;
-		layer_info.src_win.height -= cutoff;
-		layer_info.scn_win.y = 0;
-		layer_info.scn_win.height -= cutoff;
+		int cutoff = -(layer_info->scn_win.y);
+		layer_info->src_win.y += cutoff;
+		layer_info->src_win.height -= cutoff;
+		layer_info->scn_win.y = 0;
+		layer_info->scn_win.height -= cutoff;
 	}
-
-
-	uint32_t args[4] = { 0, q->target->layer, (unsigned long)(&layer_info), 0 };
-	error = ioctl(q->target->fd, DISP_CMD_LAYER_SET_PARA, args);
-	if(error < 0)
+	if (layer_info->scn_win.x < 0)
 	{
-		printf("set para failed\n");
-	}
-
-#if 1
-	error = ioctl(q->target->fd, DISP_CMD_LAYER_OPEN, args);
-	if(error < 0)
-	{
-		printf("layer open failed, fd=%d, errno=%d\n", q->target->fd, errno);
-	}
-	// Note: might be more reliable (but slower and problematic when there
-	// are driver issues and the GET functions return wrong values) to query the
-	// old values instead of relying on our internal csc_change.
-	// Since the driver calculates a matrix out of these values after each
-	// set doing this unconditionally is costly.
-#endif
-	if (os->csc_change) {
-		ioctl(q->target->fd, DISP_CMD_LAYER_ENHANCE_OFF, args);
-		args[2] = 0xff * os->brightness + 0x20;
-		ioctl(q->target->fd, DISP_CMD_LAYER_SET_BRIGHT, args);
-		args[2] = 0x20 * os->contrast;
-		ioctl(q->target->fd, DISP_CMD_LAYER_SET_CONTRAST, args);
-		args[2] = 0x20 * os->saturation;
-		ioctl(q->target->fd, DISP_CMD_LAYER_SET_SATURATION, args);
-		// hue scale is randomly chosen, no idea how it maps exactly
-		args[2] = (32 / 3.14) * os->hue + 0x20;
-		ioctl(q->target->fd, DISP_CMD_LAYER_SET_HUE, args);
-		ioctl(q->target->fd, DISP_CMD_LAYER_ENHANCE_ON, args);
-		os->csc_change = 0;
+		int cutoff = -(layer_info->scn_win.x);
+		layer_info->src_win.x += cutoff;
+		layer_info->src_win.width -= cutoff;
+		layer_info->scn_win.x = 0;
+		layer_info->scn_win.width -= cutoff;
 	}
 
+	e.csc_change = os->csc_change;
+	e.brightness = os->brightness;
+	e.contrast = os->contrast;
+	e.saturation = os->saturation;
+	e.hue = os->hue;
+	os->csc_change = 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->pending_count == QUEUE_SIZE)
+		pthread_cond_wait(&q->idle, &q->lock);
+
+	// keep the order of surfaces with the same time
+	for (i = q->pending_count; i > 0 && q->pending[i - 1].earliest > e.earliest; i--)
+		q->pending[i] = q->pending[i - 1];
+	q->pending[i] = e;
+	q->pending_count++;
+
+	os->queued++;
+	os->status = VDP_PRESENTATION_QUEUE_STATUS_QUEUED;
+	pthread_cond_signal(&q->wake);
+	pthread_mutex_unlock(&q->lock);
+
+	// the surface reference is kept until it went idle
         handle_release(presentation_queue);
-        handle_release(surface);
 	return VDP_STATUS_OK;
 }
 
 VdpStatus vdp_presentation_queue_block_until_surface_idle(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, VdpTime *first_presentation_time)
 {
+	if (!first_presentation_time)
+		return VDP_STATUS_INVALID_POINTER;
+
 	queue_ctx_t *q = handle_get(presentation_queue);
 	if (!q)
 		return VDP_STATUS_INVALID_HANDLE;
@@ -503,7 +1110,13 @@ VdpStatus vdp_presentation_queue_block_until_surface_idle(VdpPresentationQueue p
 		return VDP_STATUS_INVALID_HANDLE;
         }
 
-	*first_presentation_time = get_time();
+	// the last shown surface never goes idle without a successor
+	pthread_mutex_lock(&q->lock);
+	while (out->status == VDP_PRESENTATION_QUEUE_STATUS_QUEUED ||
+	       (out->status == VDP_PRESENTATION_QUEUE_STATUS_VISIBLE && q->pending_count > 0))
+		pthread_cond_wait(&q->idle, &q->lock);
+	*first_presentation_time = out->first_presentation_time;
+	pthread_mutex_unlock(&q->lock);
 
         handle_release(presentation_queue);
         handle_release(surface);
@@ -512,6 +1125,9 @@ VdpStatus vdp_presentation_queue_block_until_surface_idle(VdpPresentationQueue p
 
 VdpStatus vdp_presentation_queue_query_surface_status(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, VdpPresentationQueueStatus *status, VdpTime *first_presentation_time)
 {
+	if (!status || !first_presentation_time)
+		return VDP_STATUS_INVALID_POINTER;
+
 	queue_ctx_t *q = handle_get(presentation_queue);
 	if (!q)
 		return VDP_STATUS_INVALID_HANDLE;
@@ -523,8 +1139,10 @@ VdpStatus vdp_presentation_queue_query_surface_status(VdpPresentationQueue prese
 		return VDP_STATUS_INVALID_HANDLE;
         }
 
-	*status = VDP_PRESENTATION_QUEUE_STATUS_VISIBLE;
-	*first_presentation_time = get_time();
+	pthread_mutex_lock(&q->lock);
+	*status = out->status;
+	*first_presentation_time = out->first_presentation_time;
+	pthread_mutex_unlock(&q->lock);
 
         handle_release(presentation_queue);
         handle_release(surface);
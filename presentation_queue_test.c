@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Shows two surfaces of the same geometry alternately on the display
+ * stub and checks the ioctl counts: the first flip sets the layer up in
+ * one command cache batch and starts the video path, every later flip
+ * only sends DISP_CMD_VIDEO_SET_FB. The target is destroyed before the
+ * queue, the layer has to stay open until the queue is gone.
+ *
+ *   presentation_queue_test [flips]
+ *
+ * Exits with 1 if a count is wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "vdpau_private.h"
+#include "sunxi_disp_ioctl.h"
+
+#define MAX_CMDS 0x200
+
+static unsigned int counts[MAX_CMDS];
+
+// the stub prints its counts to stdout when the layer is closed
+static int capture_begin(FILE **f)
+{
+	int saved;
+
+	fflush(stdout);
+	*f = tmpfile();
+	if (!*f || (saved = dup(STDOUT_FILENO)) == -1)
+		return -1;
+
+	dup2(fileno(*f), STDOUT_FILENO);
+	return saved;
+}
+
+static void capture_end(FILE *f, int saved)
+{
+	char line[256];
+	unsigned int cmd, count;
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	rewind(f);
+	while (fgets(line, sizeof(line), f))
+	{
+		fputs(line, stdout);
+		if (sscanf(line, "disp stub: cmd 0x%x %u", &cmd, &count) == 2 && cmd < MAX_CMDS)
+			counts[cmd] = count;
+	}
+	fclose(f);
+}
+
+static int expect(const char *name, unsigned int cmd, unsigned int count)
+{
+	if (counts[cmd] == count)
+		return 1;
+
+	fprintf(stderr, "%s sent %u times instead of %u\n", name, counts[cmd], count);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, flips = argc > 1 ? strtoul(argv[1], NULL, 0) : 30;
+	VdpDevice dev;
+	VdpGetProcAddress *get_proc_address;
+	VdpPresentationQueueTarget target;
+	VdpPresentationQueue queue;
+	VdpVideoMixer mixer;
+	VdpVideoSurface video[2];
+	VdpOutputSurface output[2];
+	VdpTime shown;
+	FILE *f;
+	int saved;
+
+	setenv("VDPAU_VE_BACKEND", "sim", 0);
+	setenv("VDPAU_DISP_BACKEND", "stub", 1);
+
+	if (flips < 2 ||
+	    vdp_imp_device_create_x11(NULL, 0, &dev, &get_proc_address) != VDP_STATUS_OK ||
+	    vdp_presentation_queue_target_create_x11(dev, 0, &target) != VDP_STATUS_OK ||
+	    vdp_presentation_queue_create(dev, target, &queue) != VDP_STATUS_OK ||
+	    vdp_video_mixer_create(dev, 0, NULL, 0, NULL, NULL, &mixer) != VDP_STATUS_OK)
+	{
+		fprintf(stderr, "could not set up the presentation queue\n");
+		return 1;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (vdp_video_surface_create(dev, VDP_CHROMA_TYPE_420, 320, 240, &video[i]) != VDP_STATUS_OK ||
+		    vdp_output_surface_create(dev, VDP_RGBA_FORMAT_B8G8R8A8, 320, 240, &output[i]) != VDP_STATUS_OK ||
+		    vdp_video_mixer_render(mixer, VDP_INVALID_HANDLE, NULL, VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME,
+		                           0, NULL, video[i], 0, NULL, NULL, output[i], NULL, NULL, 0, NULL) != VDP_STATUS_OK)
+		{
+			fprintf(stderr, "could not set up surface %u\n", i);
+			return 1;
+		}
+	}
+
+	// like a player, a surface is reused once the queue is done with it
+	for (i = 0; i < flips; i++)
+	{
+		vdp_presentation_queue_block_until_surface_idle(queue, output[i & 1], &shown);
+		vdp_presentation_queue_display(queue, output[i & 1], 0, 0, 0);
+	}
+
+	// pending surfaces are dropped on destroy, the other surface becomes
+	// idle when the last one is shown
+	vdp_presentation_queue_block_until_surface_idle(queue, output[flips & 1], &shown);
+
+	saved = capture_begin(&f);
+	if (saved == -1)
+		return 1;
+	vdp_presentation_queue_target_destroy(target);
+	capture_end(f, saved);
+	if (!expect("DISP_CMD_LAYER_CLOSE before the queue is destroyed", DISP_CMD_LAYER_CLOSE, 0))
+		return 1;
+
+	saved = capture_begin(&f);
+	if (saved == -1)
+		return 1;
+	vdp_presentation_queue_destroy(queue);
+	capture_end(f, saved);
+
+	// target creation sets the parameters of the framebuffer layer once
+	if (!expect("DISP_CMD_START_CMD_CACHE", DISP_CMD_START_CMD_CACHE, 1) ||
+	    !expect("DISP_CMD_LAYER_SET_PARA", DISP_CMD_LAYER_SET_PARA, 1 + 1) ||
+	    !expect("DISP_CMD_LAYER_OPEN", DISP_CMD_LAYER_OPEN, 1) ||
+	    !expect("DISP_CMD_EXECUTE_CMD_AND_STOP_CACHE", DISP_CMD_EXECUTE_CMD_AND_STOP_CACHE, 1) ||
+	    !expect("DISP_CMD_VIDEO_START", DISP_CMD_VIDEO_START, 1) ||
+	    !expect("DISP_CMD_VIDEO_SET_FB", DISP_CMD_VIDEO_SET_FB, flips - 1) ||
+	    !expect("DISP_CMD_LAYER_CLOSE", DISP_CMD_LAYER_CLOSE, 1))
+		return 1;
+
+	printf("%u flips: one layer batch and %u buffer-only flips\n", flips, flips - 1);
+
+	for (i = 0; i < 2; i++)
+	{
+		vdp_output_surface_destroy(output[i]);
+		vdp_video_surface_destroy(video[i]);
+	}
+	vdp_video_mixer_destroy(mixer);
+	vdp_device_destroy(dev);
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include "vdpau_private.h"
+#include "ve.h"
+
+static inline int has_zero_byte(uint32_t w)
+{
+	return ((w - 0x01010101) & ~w & 0x80808080) != 0;
+}
+
+// adds the start codes of data, which is at pos in the VBV, to the index
+void decoder_scan_startcodes(decoder_ctx_t *dec, unsigned int pos, const uint8_t *data, unsigned int len, unsigned int *zeros)
+{
+	unsigned int i = 0;
+
+	// a start code at the end of the previous buffer is waiting for its code byte
+	if (len && dec->startcode_count && dec->startcodes[dec->startcode_count - 1].offset == pos)
+		dec->startcodes[dec->startcode_count - 1].code = data[0];
+
+	while (i < len)
+	{
+		uint32_t w;
+
+		// a word without zero bytes can only finish a prefix in its first byte
+		if (i + 4 <= len && !(*zeros >= 2 && data[i] == 0x01))
+		{
+			memcpy(&w, data + i, 4);
+			if (!has_zero_byte(w))
+			{
+				*zeros = 0;
+				i += 4;
+				continue;
+			}
+		}
+
+		if (data[i] == 0x00)
+			(*zeros)++;
+		else if (data[i] == 0x01 && *zeros >= 2)
+		{
+			*zeros = 0;
+			if (dec->startcode_count >= MAX_STARTCODES)
+				dec->startcodes_valid = 0;
+			else
+			{
+				startcode_t *sc = &dec->startcodes[dec->startcode_count++];
+				sc->offset = pos + i + 1;
+				sc->code = i + 1 < len ? data[i + 1] : 0;
+			}
+		}
+		else
+			*zeros = 0;
+
+		i++;
+	}
+}
+
+/*
+ * Copy one bitstream buffer to the VBV and index its start codes while the
+ * source is still in cache, so no codec has to scan the uncached VE memory.
+ */
+void decoder_upload_and_scan(decoder_ctx_t *dec, unsigned int pos, const uint8_t *data, unsigned int len, unsigned int *zeros)
+{
+	cedarv_memcpy(dec->data, pos, data, len);
+	memcpy(dec->host_data + pos, data, len);
+	decoder_scan_startcodes(dec, pos, data, len, zeros);
+}
+
+/*
+ * Returns the offset after the first start code whose prefix begins at or
+ * after pos, or -1. Falls back to scanning the VBV if the index is incomplete.
+ */
+int decoder_find_startcode(decoder_ctx_t *decoder, unsigned int len, unsigned int pos, uint8_t *code)
+{
+	if (pos < decoder->data_offset)
+		pos = decoder->data_offset;
+
+	if (decoder->startcodes_valid)
+	{
+		unsigned int lo = 0, hi = decoder->startcode_count;
+		while (lo < hi)
+		{
+			unsigned int mid = (lo + hi) / 2;
+			if (decoder->startcodes[mid].offset < pos + 3)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo == decoder->startcode_count || decoder->startcodes[lo].offset > len)
+			return -1;
+
+		if (code)
+			*code = decoder->startcodes[lo].code;
+		return decoder->startcodes[lo].offset;
+	}
+
+	const uint8_t *data = decoder->host_data;
+	unsigned int zeros = 0;
+	for ( ; pos < len; pos++)
+	{
+		if (data[pos] == 0x00)
+			zeros++;
+		else if (data[pos] == 0x01 && zeros >= 2)
+		{
+			if (code)
+				*code = pos + 1 < len ? data[pos + 1] : 0;
+			return pos + 1;
+		}
+		else
+			zeros = 0;
+	}
+
+	return -1;
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Compares decoder_upload_and_scan with copying the bitstream to the VBV
+ * and scanning the VE memory byte by byte afterwards, as the codecs did
+ * before, on synthetic H.264 and MPEG-2 access units. Both have to find
+ * the same start codes. Runs on the VE simulator unless VDPAU_VE_BACKEND
+ * is set, with VDPAU_VE_BACKEND=cedar the old path reads uncached memory.
+ *
+ *   startcode_bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vdpau_private.h"
+#include "ve.h"
+
+#define MAX_BUFFERS 128
+#define BENCH_NS 200000000ULL
+
+struct access_unit
+{
+	const char *name;
+	unsigned int count;
+	unsigned int len[MAX_BUFFERS];
+	uint8_t *data[MAX_BUFFERS];
+	unsigned int size;
+};
+
+static uint64_t now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+// start code and entropy coded payload, random bytes with emulation prevention
+static void add_unit(struct access_unit *au, uint8_t code, unsigned int payload)
+{
+	unsigned int i, zeros = 0, len = 4;
+	uint8_t *data = malloc(4 + payload * 3 / 2);
+
+	data[0] = 0x00;
+	data[1] = 0x00;
+	data[2] = 0x01;
+	data[3] = code;
+
+	for (i = 0; i < payload; i++)
+	{
+		uint8_t b = rand();
+		if (zeros >= 2 && b <= 0x03)
+		{
+			data[len++] = 0x03;
+			zeros = 0;
+		}
+		data[len++] = b;
+		zeros = b ? 0 : zeros + 1;
+	}
+
+	au->data[au->count] = data;
+	au->len[au->count++] = len;
+	au->size += len;
+}
+
+// one VdpBitstreamBuffer per NAL, as players pass them
+static void h264_frame(struct access_unit *au, const char *name, int idr, unsigned int slices, unsigned int size)
+{
+	unsigned int i;
+
+	au->name = name;
+	add_unit(au, 0x09, 1);
+	if (idr)
+	{
+		add_unit(au, 0x67, 12);
+		add_unit(au, 0x68, 4);
+	}
+	for (i = 0; i < slices; i++)
+		add_unit(au, idr ? 0x65 : 0x41, size / slices);
+}
+
+// one buffer with a picture header and one slice per macroblock row
+static void mpeg2_frame(struct access_unit *au, const char *name, unsigned int rows, unsigned int size)
+{
+	unsigned int i, count, pos = 0;
+	struct access_unit units = { 0 };
+
+	add_unit(&units, 0xb3, 8);
+	add_unit(&units, 0x00, 4);
+	add_unit(&units, 0xb5, 5);
+	for (i = 0; i < rows; i++)
+		add_unit(&units, i + 1, size / rows);
+
+	au->name = name;
+	au->count = 1;
+	au->size = au->len[0] = units.size;
+	au->data[0] = malloc(units.size);
+	for (count = 0; count < units.count; count++)
+	{
+		memcpy(au->data[0] + pos, units.data[count], units.len[count]);
+		pos += units.len[count];
+		free(units.data[count]);
+	}
+}
+
+static void upload_and_scan(decoder_ctx_t *dec, struct access_unit *au)
+{
+	unsigned int i, pos = 0, zeros = 0;
+
+	dec->startcode_count = 0;
+	dec->startcodes_valid = 1;
+	for (i = 0; i < au->count; i++)
+	{
+		decoder_upload_and_scan(dec, pos, au->data[i], au->len[i], &zeros);
+		pos += au->len[i];
+	}
+}
+
+// what the codecs did before the index, on the uploaded VBV
+static unsigned int copy_then_scan(decoder_ctx_t *dec, struct access_unit *au, startcode_t *sc)
+{
+	unsigned int i, pos = 0, count = 0, zeros = 0;
+	const uint8_t *data = cedarv_getPointer(dec->data);
+
+	for (i = 0; i < au->count; i++)
+	{
+		cedarv_memcpy(dec->data, pos, au->data[i], au->len[i]);
+		pos += au->len[i];
+	}
+
+	for (i = 0; i < pos; i++)
+	{
+		if (data[i] == 0x00)
+			zeros++;
+		else if (data[i] == 0x01 && zeros >= 2)
+		{
+			zeros = 0;
+			if (count < MAX_STARTCODES)
+			{
+				sc[count].offset = i + 1;
+				sc[count++].code = i + 1 < pos ? data[i + 1] : 0;
+			}
+		}
+		else
+			zeros = 0;
+	}
+
+	return count;
+}
+
+static int run(decoder_ctx_t *dec, struct access_unit *au)
+{
+	startcode_t sc[MAX_STARTCODES];
+	unsigned int i, count, runs;
+	uint64_t start, t_old, t_new;
+
+	count = copy_then_scan(dec, au, sc);
+	upload_and_scan(dec, au);
+	if (!dec->startcodes_valid || dec->startcode_count != count)
+	{
+		fprintf(stderr, "%s: found %u start codes instead of %u\n", au->name, dec->startcode_count, count);
+		return 0;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (dec->startcodes[i].offset != sc[i].offset || dec->startcodes[i].code != sc[i].code)
+		{
+			fprintf(stderr, "%s: start code %u differs\n", au->name, i);
+			return 0;
+		}
+	}
+
+	start = now();
+	for (runs = 0; now() - start < BENCH_NS; runs++)
+		copy_then_scan(dec, au, sc);
+	t_old = (now() - start) / runs;
+
+	start = now();
+	for (runs = 0; now() - start < BENCH_NS; runs++)
+		upload_and_scan(dec, au);
+	t_new = (now() - start) / runs;
+
+	printf("%-12s %8u %4u %10.1f %10.1f %6.2fx\n", au->name, au->size, count,
+	       au->size * 1000.0 / t_old, au->size * 1000.0 / t_new, (double)t_old / t_new);
+	return 1;
+}
+
+int main(void)
+{
+	struct access_unit au[5];
+	decoder_ctx_t *dec;
+	unsigned int i, ret = 0;
+
+	setenv("VDPAU_VE_BACKEND", "sim", 0);
+	if (!cedarv_open())
+	{
+		fprintf(stderr, "could not open the VE\n");
+		return 1;
+	}
+
+	memset(au, 0, sizeof(au));
+	srand(1);
+	h264_frame(&au[0], "h264-idr", 1, 8, 200000);
+	h264_frame(&au[1], "h264-p", 0, 1, 30000);
+	h264_frame(&au[2], "h264-b", 0, 1, 4000);
+	mpeg2_frame(&au[3], "mpeg2-i", 68, 150000);
+	mpeg2_frame(&au[4], "mpeg2-b", 68, 20000);
+
+	dec = calloc(1, sizeof(*dec));
+	if (!dec)
+		goto out;
+	dec->data_size = 1024 * 1024;
+	dec->data = cedarv_malloc(dec->data_size);
+	dec->host_data = malloc(dec->data_size);
+	if (!cedarv_isValid(dec->data) || !dec->host_data)
+	{
+		fprintf(stderr, "could not allocate the VBV\n");
+		goto out;
+	}
+
+	printf("%-12s %8s %4s %10s %10s %7s\n", "unit", "bytes", "sc", "old_MB/s", "new_MB/s", "speedup");
+	for (i = 0; i < sizeof(au) / sizeof(au[0]); i++)
+		if (!run(dec, &au[i]))
+			goto out;
+
+	ret = 1;
+
+out:
+	if (dec)
+	{
+		cedarv_free(dec->data);
+		free(dec->host_data);
+		free(dec);
+	}
+	for (i = 0; i < sizeof(au) / sizeof(au[0]); i++)
+		while (au[i].count)
+			free(au[i].data[--au[i].count]);
+	cedarv_close();
+	return !ret;
+}
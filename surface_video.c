@@ -20,10 +20,133 @@
 #include <string.h>
 #include "vdpau_private.h"
 #include "ve.h"
+#include "tiled_yuv.h"
 #include "vdpau_private.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+/*
+ * Surface buffers are recycled through a per device pool, players tend to
+ * destroy and recreate all surfaces of the same size on every seek. Buffers
+ * are matched by page rounded size, the pool is capped in bytes and buffers
+ * idle for longer than SURFACE_POOL_IDLE_TIME are given back.
+ */
+static void surface_pool_trim(device_ctx_t *dev, uint64_t now, size_t keep)
+{
+	int i;
+
+	for (i = 0; i < dev->surface_pool_count; )
+	{
+		pool_buffer_t *buf = &dev->surface_pool[i];
+		if (now - buf->released > SURFACE_POOL_IDLE_TIME ||
+		    dev->surface_pool_size + keep > dev->surface_pool_max)
+		{
+			// entries are ordered by release time, oldest first
+			cedarv_free(buf->mem);
+			dev->surface_pool_size -= buf->size;
+			memmove(buf, buf + 1, (dev->surface_pool_count - i - 1) * sizeof(*buf));
+			dev->surface_pool_count--;
+		}
+		else
+			i++;
+	}
+}
+
+CEDARV_MEMORY surface_pool_get(device_ctx_t *dev, int size)
+{
+	CEDARV_MEMORY mem;
+	int i;
+
+	size = (size + 4095) & ~4095;
+
+	pthread_mutex_lock(&dev->surface_pool_lock);
+	surface_pool_trim(dev, get_time(), 0);
+
+	// newest first, they are more likely to still be in the cache
+	for (i = dev->surface_pool_count - 1; i >= 0; i--)
+	{
+		if (dev->surface_pool[i].size == size)
+		{
+			mem = dev->surface_pool[i].mem;
+			dev->surface_pool_size -= size;
+			memmove(&dev->surface_pool[i], &dev->surface_pool[i + 1], (dev->surface_pool_count - i - 1) * sizeof(pool_buffer_t));
+			dev->surface_pool_count--;
+			pthread_mutex_unlock(&dev->surface_pool_lock);
+			return mem;
+		}
+	}
+	pthread_mutex_unlock(&dev->surface_pool_lock);
+
+	return cedarv_malloc(size);
+}
+
+void surface_pool_put(device_ctx_t *dev, CEDARV_MEMORY mem, int size)
+{
+	uint64_t now = get_time();
+
+	if (!cedarv_isValid(mem))
+		return;
+
+	size = (size + 4095) & ~4095;
+	if (size > dev->surface_pool_max)
+	{
+		cedarv_free(mem);
+		return;
+	}
+
+	pthread_mutex_lock(&dev->surface_pool_lock);
+	surface_pool_trim(dev, now, size);
+
+	if (dev->surface_pool_count == MAX_POOL_BUFFERS)
+	{
+		cedarv_free(dev->surface_pool[0].mem);
+		dev->surface_pool_size -= dev->surface_pool[0].size;
+		memmove(&dev->surface_pool[0], &dev->surface_pool[1], (MAX_POOL_BUFFERS - 1) * sizeof(pool_buffer_t));
+		dev->surface_pool_count--;
+	}
+
+	pool_buffer_t *buf = &dev->surface_pool[dev->surface_pool_count++];
+	buf->mem = mem;
+	buf->size = size;
+	buf->released = now;
+	dev->surface_pool_size += size;
+	pthread_mutex_unlock(&dev->surface_pool_lock);
+}
+
+void surface_pool_free(device_ctx_t *dev)
+{
+	int i;
+
+	pthread_mutex_lock(&dev->surface_pool_lock);
+	for (i = 0; i < dev->surface_pool_count; i++)
+		cedarv_free(dev->surface_pool[i].mem);
+	dev->surface_pool_count = 0;
+	dev->surface_pool_size = 0;
+	pthread_mutex_unlock(&dev->surface_pool_lock);
+}
+
+static int surface_chroma_size(video_surface_ctx_t *vs)
+{
+	return vs->chroma_type == VDP_CHROMA_TYPE_444 ? vs->plane_size : vs->plane_size / 2;
+}
+
+static void surface_put_buffers(video_surface_ctx_t *vs)
+{
+	if (cedarv_isValid(vs->dataY))
+		surface_pool_put(vs->device, vs->dataY, vs->plane_size);
+	if (cedarv_isValid(vs->dataU))
+		surface_pool_put(vs->device, vs->dataU, surface_chroma_size(vs));
+	if (cedarv_isValid(vs->dataV))
+		surface_pool_put(vs->device, vs->dataV, surface_chroma_size(vs));
+	if (cedarv_isValid(vs->mv_data))
+		surface_pool_put(vs->device, vs->mv_data, vs->mv_data_len);
+
+	cedarv_setBufferInvalid(vs->dataY);
+	cedarv_setBufferInvalid(vs->dataU);
+	cedarv_setBufferInvalid(vs->dataV);
+	cedarv_setBufferInvalid(vs->mv_data);
+}
+
 VdpStatus vdp_video_surface_create(VdpDevice device, VdpChromaType chroma_type, uint32_t width, uint32_t height, VdpVideoSurface *surface)
 {
    if (!surface)
@@ -53,59 +176,42 @@ VdpStatus vdp_video_surface_create(VdpDevice device, VdpChromaType chroma_type,
    cedarv_setBufferInvalid(vs->dataY);
    cedarv_setBufferInvalid(vs->dataU);
    cedarv_setBufferInvalid(vs->dataV);
+   cedarv_setBufferInvalid(vs->mv_data);
    
    switch (chroma_type)
    {
    case VDP_CHROMA_TYPE_444:
-      //vs->data = cedarv_malloc(vs->plane_size * 3);
-      vs->dataY = cedarv_malloc(vs->plane_size);
-      vs->dataU = cedarv_malloc(vs->plane_size);
-      vs->dataV = cedarv_malloc(vs->plane_size);
-      if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->dataV))
-      {
-	  printf("vdpau video surface=%d create, failure\n", *surface);
-
-	  handle_destroy(*surface);
-          handle_release(device);
-	  return VDP_STATUS_RESOURCES;
-      }
-      break;
    case VDP_CHROMA_TYPE_422:
-      //vs->data = cedarv_malloc(vs->plane_size * 2);
-      vs->dataY = cedarv_malloc(vs->plane_size);
-      vs->dataU = cedarv_malloc(vs->plane_size/2);
-      vs->dataV = cedarv_malloc(vs->plane_size/2);
+      vs->dataY = surface_pool_get(dev, vs->plane_size);
+      vs->dataU = surface_pool_get(dev, surface_chroma_size(vs));
+      vs->dataV = surface_pool_get(dev, surface_chroma_size(vs));
       if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->dataV))
-      {
-	  printf("vdpau video surface=%d create, failure\n", *surface);
-
-	  handle_destroy(*surface);
-          handle_release(device);
-	  return VDP_STATUS_RESOURCES;
-      }
+         goto err_data;
       break;
    case VDP_CHROMA_TYPE_420:
-      //vs->data = cedarv_malloc(vs->plane_size + (vs->plane_size / 2));
-      vs->dataY = cedarv_malloc(vs->plane_size);
-      vs->dataU = cedarv_malloc(vs->plane_size/2);
-      if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU))
-      {
-	  printf("vdpau video surface=%d create, failure\n", *surface);
-
-	  handle_destroy(*surface);
-          handle_release(device);
-	  return VDP_STATUS_RESOURCES;
-      }
-      
+      vs->dataY = surface_pool_get(dev, vs->plane_size);
+      vs->dataU = surface_pool_get(dev, surface_chroma_size(vs));
+      // pre-attach the H.264 motion vector buffer, decoding must not allocate
+      vs->mv_data_len = h264_mv_buffer_size(width, height);
+      vs->mv_data = surface_pool_get(dev, vs->mv_data_len);
+      if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->mv_data))
+         goto err_data;
       break;
    default:
-      free(vs);
+      handle_destroy(*surface);
       handle_release(device);
       return VDP_STATUS_INVALID_CHROMA_TYPE;
    }
    handle_release(device);
    
    return VDP_STATUS_OK;
+
+err_data:
+   printf("vdpau video surface=%d create, failure\n", *surface);
+   surface_put_buffers(vs);
+   handle_destroy(*surface);
+   handle_release(device);
+   return VDP_STATUS_RESOURCES;
 }
 
 VdpStatus vdp_video_surface_destroy(VdpVideoSurface surface)
@@ -114,18 +220,12 @@ VdpStatus vdp_video_surface_destroy(VdpVideoSurface surface)
 	if (!vs)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	cedarv_sync(vs->fence);
+
 	if (vs->decoder_private_free)
 		vs->decoder_private_free(vs);
-	if( cedarv_isValid(vs->dataY) )
-	  cedarv_free(vs->dataY);
-	if( cedarv_isValid(vs->dataU) )
-	  cedarv_free(vs->dataU);
-	if (cedarv_isValid(vs->dataV) )
-	  cedarv_free(vs->dataV);
-
-        cedarv_setBufferInvalid(vs->dataY);
-        cedarv_setBufferInvalid(vs->dataU);
-        cedarv_setBufferInvalid(vs->dataV);
+
+	surface_put_buffers(vs);
         
         VDPAU_DBG("vdpau video surface=%d destroyed", surface);
         
@@ -157,12 +257,61 @@ VdpStatus vdp_video_surface_get_parameters(VdpVideoSurface surface, VdpChromaTyp
 
 VdpStatus vdp_video_surface_get_bits_y_cb_cr(VdpVideoSurface surface, VdpYCbCrFormat destination_ycbcr_format, void *const *destination_data, uint32_t const *destination_pitches)
 {
+	VdpStatus status = VDP_STATUS_OK;
 	video_surface_ctx_t *vs = handle_get(surface);
 	if (!vs)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	if (!destination_data || !destination_pitches)
+	{
+		handle_release(surface);
+		return VDP_STATUS_INVALID_POINTER;
+	}
+
+	if (vs->chroma_type != VDP_CHROMA_TYPE_420)
+	{
+		handle_release(surface);
+		return VDP_STATUS_INVALID_CHROMA_TYPE;
+	}
+
+	// only decoder output is tiled, put_bits surfaces keep their source layout
+	if (!vs->frame_decoded)
+	{
+		handle_release(surface);
+		return VDP_STATUS_ERROR;
+	}
+
+	cedarv_sync(vs->fence);
+
+	// large frames are split into stripes across threads
+	int threads = vs->height >= 720 ? vs->device->detile_threads : 1;
+	const uint8_t *luma = cedarv_getPointer(vs->dataY);
+	const uint8_t *chroma = cedarv_getPointer(vs->dataU);
+
+	cedarv_flush_cache(vs->dataY, vs->plane_size);
+	cedarv_flush_cache(vs->dataU, vs->plane_size / 2);
+
+	switch (destination_ycbcr_format)
+	{
+	case VDP_YCBCR_FORMAT_NV12:
+		tiled_to_planar(luma, destination_data[0], destination_pitches[0], vs->width, vs->height, threads);
+		tiled_to_planar(chroma, destination_data[1], destination_pitches[1], vs->width, vs->height / 2, threads);
+		break;
+
+	case VDP_YCBCR_FORMAT_YV12:
+		tiled_to_planar(luma, destination_data[0], destination_pitches[0], vs->width, vs->height, threads);
+		tiled_deinterleave_to_planar(chroma, destination_data[2], destination_pitches[2],
+		                             destination_data[1], destination_pitches[1],
+		                             vs->width, vs->height / 2, threads);
+		break;
+
+	default:
+		status = VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
+		break;
+	}
+
         handle_release(surface);
-	return VDP_STATUS_ERROR;
+	return status;
 }
 
 VdpStatus vdp_video_surface_put_bits_y_cb_cr(VdpVideoSurface surface, VdpYCbCrFormat source_ycbcr_format, void const *const *source_data, uint32_t const *source_pitches)
@@ -175,6 +324,7 @@ VdpStatus vdp_video_surface_put_bits_y_cb_cr(VdpVideoSurface surface, VdpYCbCrFo
 	if (!vs)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	cedarv_sync(vs->fence);
 	vs->source_format = source_ycbcr_format;
 
 	switch (source_ycbcr_format)
@@ -274,7 +424,9 @@ VdpStatus vdp_video_surface_query_get_put_bits_y_cb_cr_capabilities(VdpDevice de
 	if (!dev)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	*is_supported = VDP_FALSE;
+	*is_supported = surface_chroma_type == VDP_CHROMA_TYPE_420 &&
+	                (bits_ycbcr_format == VDP_YCBCR_FORMAT_NV12 ||
+	                 bits_ycbcr_format == VDP_YCBCR_FORMAT_YV12);
 
         handle_release(device);
 	return VDP_STATUS_OK;
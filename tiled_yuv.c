@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include "tiled_yuv.h"
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#define MAX_STRIPES	8
+
+typedef struct
+{
+	const uint8_t *src;
+	uint8_t *dst1, *dst2;
+	unsigned int dst1_pitch, dst2_pitch;
+	unsigned int width, height;
+	unsigned int first_row, last_row;
+	int deinterleave;
+} stripe_t;
+
+static inline void copy_span(uint8_t *dst, const uint8_t *src, unsigned int len)
+{
+#ifdef __ARM_NEON__
+	if (len == 32)
+	{
+		vst1q_u8(dst, vld1q_u8(src));
+		vst1q_u8(dst + 16, vld1q_u8(src + 16));
+		return;
+	}
+#endif
+	memcpy(dst, src, len);
+}
+
+static inline void split_span(uint8_t *dst1, uint8_t *dst2, const uint8_t *src, unsigned int len)
+{
+	unsigned int i;
+#ifdef __ARM_NEON__
+	if (len == 32)
+	{
+		uint8x16x2_t uv = vld2q_u8(src);
+		vst1q_u8(dst1, uv.val[0]);
+		vst1q_u8(dst2, uv.val[1]);
+		return;
+	}
+#endif
+	for (i = 0; i < len / 2; i++)
+	{
+		dst1[i] = src[2 * i];
+		dst2[i] = src[2 * i + 1];
+	}
+}
+
+static void *stripe_run(void *arg)
+{
+	const stripe_t *s = arg;
+	unsigned int tile_row = ((s->width + 31) & ~31) * 32;
+	unsigned int x, y;
+
+	for (y = s->first_row; y < s->last_row; y++)
+	{
+		const uint8_t *line = s->src + (y / 32) * tile_row + (y % 32) * 32;
+		uint8_t *dst1 = s->dst1 + y * s->dst1_pitch;
+		uint8_t *dst2 = s->dst2 ? s->dst2 + y * s->dst2_pitch : NULL;
+
+		for (x = 0; x < s->width; x += 32)
+		{
+			unsigned int len = s->width - x < 32 ? s->width - x : 32;
+
+			if (s->deinterleave)
+				split_span(dst1 + x / 2, dst2 + x / 2, line, len);
+			else
+				copy_span(dst1 + x, line, len);
+
+			line += 1024;
+		}
+	}
+
+	return NULL;
+}
+
+static void stripes_run(stripe_t *s, int threads)
+{
+	pthread_t thread[MAX_STRIPES];
+	stripe_t stripe[MAX_STRIPES];
+	unsigned int tile_rows = (s->height + 31) / 32;
+	unsigned int rows_per_stripe;
+	int i, started = 0;
+
+	if (threads > MAX_STRIPES)
+		threads = MAX_STRIPES;
+	if (threads > (int)tile_rows)
+		threads = tile_rows;
+
+	if (threads <= 1)
+	{
+		s->first_row = 0;
+		s->last_row = s->height;
+		stripe_run(s);
+		return;
+	}
+
+	// stripes are whole tile rows, so no two threads touch the same tile
+	rows_per_stripe = (tile_rows + threads - 1) / threads * 32;
+
+	for (i = 0; i < threads; i++)
+	{
+		stripe[i] = *s;
+		stripe[i].first_row = i * rows_per_stripe;
+		stripe[i].last_row = (i + 1) * rows_per_stripe;
+		if (stripe[i].last_row > s->height)
+			stripe[i].last_row = s->height;
+	}
+
+	// the caller does the first stripe itself
+	for (i = 1; i < threads; i++)
+	{
+		if (pthread_create(&thread[i], NULL, stripe_run, &stripe[i]))
+			break;
+		started = i;
+	}
+
+	stripe_run(&stripe[0]);
+
+	for (i = started + 1; i < threads; i++)
+		stripe_run(&stripe[i]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(thread[i], NULL);
+}
+
+void tiled_to_planar(const void *src, void *dst, unsigned int dst_pitch,
+                     unsigned int width, unsigned int height, int threads)
+{
+	stripe_t s = { .src = src, .dst1 = dst, .dst1_pitch = dst_pitch,
+	               .width = width, .height = height, .deinterleave = 0 };
+
+	stripes_run(&s, threads);
+}
+
+void tiled_deinterleave_to_planar(const void *src, void *dst1, unsigned int dst1_pitch,
+                                  void *dst2, unsigned int dst2_pitch,
+                                  unsigned int width, unsigned int height, int threads)
+{
+	stripe_t s = { .src = src, .dst1 = dst1, .dst1_pitch = dst1_pitch,
+	               .dst2 = dst2, .dst2_pitch = dst2_pitch,
+	               .width = width, .height = height, .deinterleave = 1 };
+
+	stripes_run(&s, threads);
+}
+
+void tiled_to_planar_ref(const void *src, void *dst, unsigned int dst_pitch,
+                         unsigned int width, unsigned int height)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	unsigned int x, y;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			d[y * dst_pitch + x] = s[tiled_offset(x, y, width)];
+}
+
+void tiled_deinterleave_to_planar_ref(const void *src, void *dst1, unsigned int dst1_pitch,
+                                      void *dst2, unsigned int dst2_pitch,
+                                      unsigned int width, unsigned int height)
+{
+	const uint8_t *s = src;
+	uint8_t *d1 = dst1, *d2 = dst2;
+	unsigned int x, y;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width / 2; x++)
+		{
+			d1[y * dst1_pitch + x] = s[tiled_offset(2 * x, y, width)];
+			d2[y * dst2_pitch + x] = s[tiled_offset(2 * x + 1, y, width)];
+		}
+}
+
+/*
+ * The GLSL tiled_texcoord() in float, step by step, returning the texel
+ * instead of the normalized coordinate. x is in texels, so for chroma
+ * (bpp 2) it is the UV pair index. width is the plane width in bytes.
+ */
+void tiled_texel(unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+                 unsigned int bpp, unsigned int *col, unsigned int *row)
+{
+	float tiles = (width + 31) / 32;
+	float rows = tiles * ((height + 31) / 32);
+	float tw = 32.0f / bpp;
+	float tile_x = floorf(x / tw), tile_y = floorf(y / 32.0f);
+	float in_x = x - tile_x * tw, in_y = y - tile_y * 32.0f;
+	float r = tile_y * tiles + tile_x;
+	float c = in_y * tw + in_x;
+	float s = (c + 0.5f) / (32.0f * tw), t = (r + 0.5f) / rows;
+
+	// what texture2D() with GL_NEAREST picks
+	*col = floorf(s * 32.0f * tw);
+	*row = floorf(t * rows);
+}
+
+void tiled_texture_to_planar_ref(const void *src, void *dst, unsigned int dst_pitch,
+                                 unsigned int width, unsigned int height)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	unsigned int x, y, col, row;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+		{
+			tiled_texel(x, y, width, height, 1, &col, &row);
+			d[y * dst_pitch + x] = s[row * 1024 + col];
+		}
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __TILED_YUV_H__
+#define __TILED_YUV_H__
+
+#include <stdint.h>
+
+/*
+ * The VE writes its output in 32x32 macroblock tiles, tile rows are
+ * ALIGN(width, 32) * 32 bytes apart. Chroma is a tiled plane of
+ * interleaved UV pairs with the same layout.
+ */
+
+static inline uint32_t tiled_offset(unsigned int x, unsigned int y, unsigned int width)
+{
+	return (y / 32) * (((width + 31) & ~31) * 32) + (x / 32) * 1024 + (y % 32) * 32 + (x % 32);
+}
+
+void tiled_to_planar(const void *src, void *dst, unsigned int dst_pitch,
+                     unsigned int width, unsigned int height, int threads);
+void tiled_deinterleave_to_planar(const void *src, void *dst1, unsigned int dst1_pitch,
+                                  void *dst2, unsigned int dst2_pitch,
+                                  unsigned int width, unsigned int height, int threads);
+
+/* per pixel reference versions, slow */
+void tiled_to_planar_ref(const void *src, void *dst, unsigned int dst_pitch,
+                         unsigned int width, unsigned int height);
+void tiled_deinterleave_to_planar_ref(const void *src, void *dst1, unsigned int dst1_pitch,
+                                      void *dst2, unsigned int dst2_pitch,
+                                      unsigned int width, unsigned int height);
+
+/* texture addressing of the GL tiled sampler, see opengl_nv.c */
+void tiled_texel(unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+                 unsigned int bpp, unsigned int *col, unsigned int *row);
+void tiled_texture_to_planar_ref(const void *src, void *dst, unsigned int dst_pitch,
+                                 unsigned int width, unsigned int height);
+
+#endif
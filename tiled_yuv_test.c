@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Runs tiled_to_planar() and tiled_deinterleave_to_planar() against the
+ * per pixel reference detilers for random odd and even plane sizes and
+ * thread counts, with a destination pitch larger than the width that
+ * has to stay untouched, and prints their 1080p timing. Then detiles
+ * random planes through the texture addressing of the GL tiled sampler,
+ * tiled_texel() and tiled_texture_to_planar_ref(), and compares the
+ * result with the reference detilers, for luma and chroma planes up to
+ * 1080p.
+ *
+ *   tiled_yuv_test [planes]
+ *
+ * Exits with 1 on the first mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tiled_yuv.h"
+
+#define ALIGN32(x) (((x) + 31) & ~31)
+#define PITCH_PAD 7
+#define CANARY 0xa5
+#define BENCH_NS 200000000ULL
+
+static const int thread_counts[] = { 1, 2, 3, 4, 8, 9 };
+
+// luma plane sizes, chroma planes have half the height
+static const unsigned int sizes[][2] = {
+	{ 32, 32 }, { 176, 144 }, { 720, 576 }, { 1280, 720 }, { 1920, 1080 }, { 1920, 1088 },
+};
+
+static uint8_t *random_plane(unsigned int width, unsigned int height)
+{
+	unsigned int i, size = ALIGN32(width) * ALIGN32(height);
+	uint8_t *p = malloc(size);
+
+	if (p)
+		for (i = 0; i < size; i++)
+			p[i] = rand();
+
+	return p;
+}
+
+static uint64_t now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static int compare(const char *name, const uint8_t *got, const uint8_t *expected,
+                   unsigned int pitch, unsigned int width, unsigned int height, int threads)
+{
+	unsigned int x, y;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < pitch; x++)
+		{
+			uint8_t e = x < width ? expected[y * pitch + x] : CANARY;
+			if (got[y * pitch + x] != e)
+			{
+				fprintf(stderr, "%s %ux%u, %d threads: byte %u,%u is 0x%02x instead of 0x%02x\n",
+				        name, width, height, threads, x, y, got[y * pitch + x], e);
+				return 0;
+			}
+		}
+
+	return 1;
+}
+
+static int check_kernels(unsigned int width, unsigned int height)
+{
+	unsigned int pitch = width + PITCH_PAD, half = width / 2 + PITCH_PAD;
+	uint8_t *src = random_plane(width, height);
+	uint8_t *ref = malloc(pitch * height), *dst = malloc(pitch * height);
+	uint8_t *ref2 = malloc(half * height), *dst2 = malloc(half * height);
+	unsigned int i, ret = 0;
+
+	if (!src || !ref || !dst || !ref2 || !dst2)
+		goto out;
+
+	memset(ref, CANARY, pitch * height);
+	tiled_to_planar_ref(src, ref, pitch, width, height);
+	for (i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++)
+	{
+		memset(dst, CANARY, pitch * height);
+		tiled_to_planar(src, dst, pitch, width, height, thread_counts[i]);
+		if (!compare("tiled_to_planar", dst, ref, pitch, width, height, thread_counts[i]))
+			goto out;
+	}
+
+	memset(ref, CANARY, half * height);
+	memset(ref2, CANARY, half * height);
+	tiled_deinterleave_to_planar_ref(src, ref, half, ref2, half, width, height);
+	for (i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++)
+	{
+		memset(dst, CANARY, half * height);
+		memset(dst2, CANARY, half * height);
+		tiled_deinterleave_to_planar(src, dst, half, dst2, half, width, height, thread_counts[i]);
+		if (!compare("tiled_deinterleave_to_planar u", dst, ref, half, width / 2, height, thread_counts[i]) ||
+		    !compare("tiled_deinterleave_to_planar v", dst2, ref2, half, width / 2, height, thread_counts[i]))
+			goto out;
+	}
+
+	ret = 1;
+
+out:
+	free(dst2);
+	free(ref2);
+	free(dst);
+	free(ref);
+	free(src);
+	return ret;
+}
+
+// threads 0 is the reference
+static double time_kernel(const uint8_t *src, uint8_t *dst, uint8_t *dst2,
+                          unsigned int width, unsigned int height, int deinterleave, int threads)
+{
+	uint64_t start = now();
+	unsigned int runs;
+
+	for (runs = 0; now() - start < BENCH_NS; runs++)
+	{
+		if (deinterleave && threads)
+			tiled_deinterleave_to_planar(src, dst, width / 2, dst2, width / 2, width, height, threads);
+		else if (deinterleave)
+			tiled_deinterleave_to_planar_ref(src, dst, width / 2, dst2, width / 2, width, height);
+		else if (threads)
+			tiled_to_planar(src, dst, width, width, height, threads);
+		else
+			tiled_to_planar_ref(src, dst, width, width, height);
+	}
+
+	return (double)(now() - start) / runs / 1000.0;
+}
+
+// a 1080p surface, luma and interleaved chroma
+static void bench(void)
+{
+	static const int threads[] = { 0, 1, 2, 4 };
+	uint8_t *luma = random_plane(1920, 1088), *chroma = random_plane(1920, 544);
+	uint8_t *dst = malloc(1920 * 1088), *dst2 = malloc(960 * 544);
+	unsigned int i;
+
+	if (!luma || !chroma || !dst || !dst2)
+		goto out;
+
+	printf("%-8s %10s %10s\n", "threads", "luma_us", "chroma_us");
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+	{
+		double t_luma = time_kernel(luma, dst, NULL, 1920, 1088, 0, threads[i]);
+		double t_chroma = time_kernel(chroma, dst, dst2, 1920, 544, 1, threads[i]);
+		if (threads[i])
+			printf("%-8d %10.0f %10.0f\n", threads[i], t_luma, t_chroma);
+		else
+			printf("%-8s %10.0f %10.0f\n", "ref", t_luma, t_chroma);
+	}
+
+out:
+	free(dst2);
+	free(dst);
+	free(chroma);
+	free(luma);
+}
+
+static int check_luma(unsigned int width, unsigned int height)
+{
+	uint8_t *src = random_plane(width, height);
+	uint8_t *ref = malloc(width * height);
+	uint8_t *tex = malloc(width * height);
+	unsigned int i, ret = 0;
+
+	if (!src || !ref || !tex)
+		goto out;
+
+	tiled_to_planar_ref(src, ref, width, width, height);
+	tiled_texture_to_planar_ref(src, tex, width, width, height);
+
+	for (i = 0; i < width * height; i++)
+	{
+		if (tex[i] != ref[i])
+		{
+			fprintf(stderr, "luma %ux%u: texture lookup of pixel %u,%u differs\n",
+			        width, height, i % width, i / width);
+			goto out;
+		}
+	}
+
+	ret = 1;
+
+out:
+	free(tex);
+	free(ref);
+	free(src);
+	return ret;
+}
+
+// chroma is LUMINANCE_ALPHA, one texel per UV pair, 512 texels per row
+static int check_chroma(unsigned int width, unsigned int height)
+{
+	uint8_t *src = random_plane(width, height);
+	uint8_t *u = malloc(width / 2 * height);
+	uint8_t *v = malloc(width / 2 * height);
+	unsigned int x, y, col, row, ret = 0;
+
+	if (!src || !u || !v)
+		goto out;
+
+	tiled_deinterleave_to_planar_ref(src, u, width / 2, v, width / 2, width, height);
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width / 2; x++)
+		{
+			tiled_texel(x, y, width, height, 2, &col, &row);
+			if (src[row * 1024 + col * 2] != u[y * width / 2 + x] ||
+			    src[row * 1024 + col * 2 + 1] != v[y * width / 2 + x])
+			{
+				fprintf(stderr, "chroma %ux%u: texture lookup of pair %u,%u differs\n",
+				        width, height, x, y);
+				goto out;
+			}
+		}
+
+	ret = 1;
+
+out:
+	free(v);
+	free(u);
+	free(src);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, planes = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000;
+
+	srand(1);
+	for (i = 0; i < planes; i++)
+	{
+		// mostly small planes, so many tile edge cases go by
+		unsigned int max = i % 16 ? 200 : 2000;
+		if (!check_kernels(1 + rand() % max, 1 + rand() % (max / 2)))
+			return 1;
+	}
+	printf("detilers match the reference for %u plane sizes\n", planes);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		if (!check_luma(sizes[i][0], sizes[i][1]) ||
+		    !check_chroma(sizes[i][0], sizes[i][1] / 2))
+			return 1;
+	}
+
+	printf("tiled sampler addressing matches the detiler for %u plane sizes\n", i);
+
+	bench();
+	return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "trace.h"
+
+#if TRACE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING_SIZE 16384
+
+struct trace_ev
+{
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+	int32_t arg;
+};
+
+/*
+ * Each thread writes only its own ring, the head is published with a
+ * release store after the event is complete. The list of rings is only
+ * changed and walked under trace_lock. When a thread exits its events are
+ * merged into the retired ring, which keeps the tid of every event, and
+ * its ring is freed.
+ */
+struct trace_ring
+{
+	struct trace_ring *next;
+	pid_t tid;
+	uint32_t head;
+	struct trace_ev ev[TRACE_RING_SIZE];
+};
+
+int trace_enabled;
+
+static char trace_file[256];
+static volatile sig_atomic_t trace_dump_requested;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static struct trace_ring *rings;
+static __thread struct trace_ring *ring;
+
+static struct
+{
+	uint32_t head;
+	pid_t tid[TRACE_RING_SIZE];
+	struct trace_ev ev[TRACE_RING_SIZE];
+} retired;
+
+uint64_t trace_now(void)
+{
+	struct timespec tp;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) == -1)
+		return 0;
+
+	return (uint64_t)tp.tv_sec * 1000000000ULL + (uint64_t)tp.tv_nsec;
+}
+
+static struct trace_ring *ring_create(void)
+{
+	struct trace_ring *r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->tid = syscall(SYS_gettid);
+	pthread_setspecific(trace_key, r);
+
+	pthread_mutex_lock(&trace_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&trace_lock);
+
+	return r;
+}
+
+// thread exit, nobody writes the ring anymore
+static void ring_retire(void *arg)
+{
+	struct trace_ring *r = arg, **p;
+	uint32_t i = r->head > TRACE_RING_SIZE ? r->head - TRACE_RING_SIZE : 0;
+
+	pthread_mutex_lock(&trace_lock);
+	for (; i < r->head; i++, retired.head++)
+	{
+		retired.tid[retired.head % TRACE_RING_SIZE] = r->tid;
+		retired.ev[retired.head % TRACE_RING_SIZE] = r->ev[i % TRACE_RING_SIZE];
+	}
+
+	for (p = &rings; *p; p = &(*p)->next)
+	{
+		if (*p == r)
+		{
+			*p = r->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	ring = NULL;
+	free(r);
+}
+
+static void trace_dump(void);
+
+void trace_event(const char *name, uint64_t start, int32_t arg)
+{
+	struct trace_ev *e;
+
+	// SIGUSR2 only asks for a dump, the next event writes it
+	if (trace_dump_requested && __atomic_exchange_n(&trace_dump_requested, 0, __ATOMIC_ACQUIRE))
+		trace_dump();
+
+	if (!ring && !(ring = ring_create()))
+		return;
+
+	e = &ring->ev[ring->head % TRACE_RING_SIZE];
+	e->name = name;
+	e->start = start;
+	e->end = trace_now();
+	e->arg = arg;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Other threads keep writing their rings during the dump. The slot at head
+ * is written before head is published, so with a full ring the oldest slot
+ * is skipped, and an event that is overwritten while it is copied is dropped.
+ */
+static void dump_event(int fd, const struct trace_ev *e, pid_t tid, int *first)
+{
+	char buf[256];
+	uint64_t dur = e->end - e->start;
+	int len;
+
+	len = snprintf(buf, sizeof(buf),
+	               "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+	               *first ? "" : ",\n", e->name, getpid(), tid,
+	               (unsigned long long)(e->start / 1000), (unsigned int)(e->start % 1000),
+	               (unsigned long long)(dur / 1000), (unsigned int)(dur % 1000));
+	if (e->arg >= 0)
+		len += snprintf(buf + len, sizeof(buf) - len, ",\"args\":{\"n\":%d}}", e->arg);
+	else
+		len += snprintf(buf + len, sizeof(buf) - len, "}");
+
+	write(fd, buf, len);
+	*first = 0;
+}
+
+static void trace_dump(void)
+{
+	struct trace_ring *r;
+	int fd, first = 1;
+	uint32_t i;
+
+	fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return;
+
+	const char *header = "{\"traceEvents\":[\n", *footer = "\n]}\n";
+	write(fd, header, strlen(header));
+
+	pthread_mutex_lock(&trace_lock);
+	for (r = rings; r; r = r->next)
+	{
+		uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+		for (i = head >= TRACE_RING_SIZE ? head - TRACE_RING_SIZE + 1 : 0; i < head; i++)
+		{
+			struct trace_ev e = r->ev[i % TRACE_RING_SIZE];
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&r->head, __ATOMIC_RELAXED) - i >= TRACE_RING_SIZE)
+				continue;
+
+			dump_event(fd, &e, r->tid, &first);
+		}
+	}
+
+	for (i = retired.head > TRACE_RING_SIZE ? retired.head - TRACE_RING_SIZE : 0; i < retired.head; i++)
+		dump_event(fd, &retired.ev[i % TRACE_RING_SIZE], retired.tid[i % TRACE_RING_SIZE], &first);
+	pthread_mutex_unlock(&trace_lock);
+
+	write(fd, footer, strlen(footer));
+	close(fd);
+}
+
+static void trace_signal(int sig)
+{
+	trace_dump_requested = 1;
+}
+
+void trace_init(void)
+{
+	struct sigaction sa, old;
+	char *env_vdpau_trace = getenv("VDPAU_TRACE");
+
+	if (trace_enabled || !env_vdpau_trace || !*env_vdpau_trace)
+		return;
+
+	if (pthread_key_create(&trace_key, ring_retire) != 0)
+		return;
+
+	strncpy(trace_file, env_vdpau_trace, sizeof(trace_file) - 1);
+	atexit(trace_dump);
+
+	// do not take SIGUSR2 away from a player that uses it
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = trace_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR2, NULL, &old) == 0 && old.sa_handler == SIG_DFL)
+		sigaction(SIGUSR2, &sa, NULL);
+
+	trace_enabled = 1;
+}
+
+#endif
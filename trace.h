@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/*
+ * Latency tracing, built with make TRACE=1 and enabled at runtime with
+ * VDPAU_TRACE=<file>. Events go to per-thread rings and are written as
+ * Chrome trace_event JSON at exit, or by the next event after SIGUSR2.
+ * Without TRACE the macros compile to nothing.
+ *
+ *   TRACE_BEGIN(t);
+ *   ...
+ *   TRACE_END(t, "name");
+ */
+
+#if TRACE
+
+extern int trace_enabled;
+
+void trace_init(void);
+uint64_t trace_now(void);
+void trace_event(const char *name, uint64_t start, int32_t arg);
+
+#define TRACE_ENABLED()			(trace_enabled)
+#define TRACE_BEGIN(t)			uint64_t t = trace_enabled ? trace_now() : 0
+#define TRACE_MARK(t)			do { t = trace_enabled ? trace_now() : 0; } while (0)
+#define TRACE_END(t, name)		do { if (t && trace_enabled) trace_event(name, t, -1); } while (0)
+#define TRACE_END_ARG(t, name, arg)	do { if (t && trace_enabled) trace_event(name, t, arg); } while (0)
+#define TRACE_INIT()			trace_init()
+
+#else
+
+#define TRACE_ENABLED()			0
+#define TRACE_BEGIN(t)
+#define TRACE_MARK(t)			do { } while (0)
+#define TRACE_END(t, name)		do { } while (0)
+#define TRACE_END_ARG(t, name, arg)	do { } while (0)
+#define TRACE_INIT()			do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Prints the counters pages of all processes running with
+ * VDPAU_COUNTERS=1, or of the given pid, as name value lines.
+ *
+ *   vdpau_counters [-i seconds] [pid]
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "counters.h"
+
+vdpau_counters_t *counters;
+
+static const char *codec_names[COUNTER_CODEC_COUNT] = { "mpeg12", "h264", "mpeg4", "msmpeg4" };
+
+// same order as enum HandleType
+static const char *handle_names[] = { "output", "video", "bitmap", "mixer", "device",
+                                      "decoder", "presentation", "presentation_target", "nvidia_vdpau" };
+
+#define LOAD(field) __atomic_load_n(&c->field, __ATOMIC_RELAXED)
+
+static void print_counters(const vdpau_counters_t *c)
+{
+	unsigned int i;
+
+	printf("pid %u%s\n", c->pid, kill(c->pid, 0) == -1 && errno == ESRCH ? " (exited)" : "");
+
+	for (i = 0; i < COUNTER_CODEC_COUNT; i++)
+		printf("frames_decoded.%s %" PRIu64 "\n", codec_names[i], LOAD(frames_decoded[i]));
+
+	printf("bitstream_bytes %" PRIu64 "\n", LOAD(bitstream_bytes));
+	printf("h264_slices %" PRIu64 "\n", LOAD(h264_slices));
+	printf("h264_slices_max %" PRIu64 "\n", LOAD(h264_slices_max));
+	printf("h264_errors %" PRIu64 "\n", LOAD(h264_errors));
+	printf("mpeg_errors %" PRIu64 "\n", LOAD(mpeg_errors));
+	printf("ve_busy_ns %" PRIu64 "\n", LOAD(ve_busy_ns));
+	printf("ve_wait_timeouts %" PRIu64 "\n", LOAD(ve_wait_timeouts));
+	printf("mem_bytes %" PRIu64 "\n", LOAD(mem_bytes));
+	printf("mem_allocs %" PRIu64 "\n", LOAD(mem_allocs));
+
+	for (i = 0; i < sizeof(handle_names) / sizeof(handle_names[0]); i++)
+		printf("live_handles.%s %" PRId64 "\n", handle_names[i], LOAD(live_handles[i]));
+
+	printf("display_calls %" PRIu64 "\n", LOAD(display_calls));
+	printf("display_late %" PRIu64 "\n", LOAD(display_late));
+	printf("shadow_hits %" PRIu64 "\n", LOAD(shadow_hits));
+	printf("shadow_misses %" PRIu64 "\n", LOAD(shadow_misses));
+}
+
+static int read_page(const char *name)
+{
+	vdpau_counters_t *c;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+	{
+		perror(name);
+		return 0;
+	}
+
+	c = mmap(NULL, sizeof(*c), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (c == MAP_FAILED)
+	{
+		perror(name);
+		return 0;
+	}
+
+	// pages of older libraries are shorter, never read past their end
+	if (__atomic_load_n(&c->magic, __ATOMIC_ACQUIRE) != COUNTERS_MAGIC || c->version != COUNTERS_VERSION ||
+	    c->size != sizeof(*c))
+		fprintf(stderr, "%s: unsupported counters page\n", name);
+	else
+		print_counters(c);
+
+	munmap(c, sizeof(*c));
+	return 1;
+}
+
+static int read_all(void)
+{
+	struct dirent *e;
+	int found = 0;
+	DIR *dir = opendir("/dev/shm");
+	if (!dir)
+	{
+		perror("/dev/shm");
+		return 0;
+	}
+
+	while ((e = readdir(dir)))
+	{
+		char name[sizeof(e->d_name) + 1];
+		if (strncmp(e->d_name, "vdpau_sunxi.", 12) != 0)
+			continue;
+
+		snprintf(name, sizeof(name), "/%s", e->d_name);
+		found += read_page(name);
+	}
+
+	closedir(dir);
+	return found;
+}
+
+int main(int argc, char *argv[])
+{
+	char name[32];
+	int opt, interval = 0;
+
+	while ((opt = getopt(argc, argv, "i:")) != -1)
+	{
+		if (opt == 'i')
+			interval = atoi(optarg);
+		else
+			goto usage;
+	}
+
+	if (optind < argc - 1)
+		goto usage;
+
+	do
+	{
+		if (optind == argc - 1)
+		{
+			snprintf(name, sizeof(name), COUNTERS_NAME, atoi(argv[optind]));
+			if (!read_page(name))
+				return 1;
+		}
+		else if (!read_all())
+		{
+			fprintf(stderr, "no counters pages found, is VDPAU_COUNTERS=1 set?\n");
+			return 1;
+		}
+
+		if (interval > 0)
+		{
+			printf("\n");
+			fflush(stdout);
+			sleep(interval);
+		}
+	} while (interval > 0);
+
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-i seconds] [pid]\n", argv[0]);
+	return 1;
+}
@@ -22,11 +22,18 @@
 
 //#define DEBUG
 #define MAX_HANDLES 64
-#define VBV_SIZE (1 * 1024 * 1024)
+#define VBV_MIN_SIZE (256 * 1024)
+#define VBV_MAX_SIZE (16 * 1024 * 1024)
+#define MAX_STARTCODES 512
+#define MAX_SCRATCH_BUFFERS 8
+#define MAX_POOL_BUFFERS 64
+#define SURFACE_POOL_MAX_SIZE (64 * 1024 * 1024)
+#define SURFACE_POOL_IDLE_TIME 10000000000ULL
 
 //#include <stdlib.h>
 #include <vdpau/vdpau.h>
 #include <X11/Xlib.h>
+#include <pthread.h>
 
 #include "ve.h"
 
@@ -55,6 +62,20 @@ enum VdpauNVState
   VdpauNVState_Mapped
 };
 
+typedef struct
+{
+    CEDARV_MEMORY mem;
+    int size;
+    int in_use;
+} scratch_buffer_t;
+
+typedef struct
+{
+    CEDARV_MEMORY mem;
+    int size;
+    uint64_t released;
+} pool_buffer_t;
+
 typedef struct
 {
     Display *display;
@@ -67,6 +88,14 @@ typedef struct
     int fb_id;
     int g2d_fd;
     int osd_enabled;
+    int async_decode;
+    int detile_threads;
+    scratch_buffer_t scratch[MAX_SCRATCH_BUFFERS];
+    pool_buffer_t surface_pool[MAX_POOL_BUFFERS];
+    int surface_pool_count;
+    size_t surface_pool_size;
+    size_t surface_pool_max;
+    pthread_mutex_t surface_pool_lock;
 } device_ctx_t;
 
 typedef struct video_surface_ctx_struct
@@ -80,25 +109,45 @@ typedef struct video_surface_ctx_struct
 	CEDARV_MEMORY dataY;
 	CEDARV_MEMORY dataU;
 	CEDARV_MEMORY dataV;
+	CEDARV_MEMORY mv_data;
+	int mv_data_len;
 	enum VdpauNVState vdpNvState;
 	int plane_size;
 	void *decoder_private;
 	void (*decoder_private_free)(struct video_surface_ctx_struct *surface);
         uint8_t frame_decoded;
+	uint32_t fence;
 } video_surface_ctx_t;
 
+typedef struct
+{
+	uint32_t offset;	// first byte after the 00 00 01 prefix
+	uint8_t code;		// value of that byte
+} startcode_t;
+
 typedef struct decoder_ctx_struct
 {
 	uint32_t width, height;
 	VdpDecoderProfile profile;
+	int codec;
 	CEDARV_MEMORY data;
+	uint8_t *host_data;	// cached copy of data for the bitstream parsers
+	unsigned int data_size;
 	unsigned int data_pos;
+	unsigned int data_offset;
+	unsigned int busy_start, busy_end;
+	int data_keep;		// data_offset..data_pos is left for the next render call
+	VdpVideoSurface target;	// surface of the current render call
 	device_ctx_t *device;
 	VdpStatus (*decode)(struct decoder_ctx_struct *decoder, VdpPictureInfo const *info, const int len, video_surface_ctx_t *output);
 	void *private;
 	VdpStatus (*decode_stream)(struct decoder_ctx_struct *decoder, VdpPictureInfo const *info, const int len, video_surface_ctx_t *output, uint32_t *ret_len);
 	void (*private_free)(struct decoder_ctx_struct *decoder);
     VdpStatus (*setVideoControlData)(struct decoder_ctx_struct *decoder, VdpDecoderControlDataId id, VdpDecoderControlData *data);
+	uint32_t fence;
+	startcode_t startcodes[MAX_STARTCODES];
+	unsigned int startcode_count;
+	int startcodes_valid;
 } decoder_ctx_t;
 
 typedef struct
@@ -108,6 +157,12 @@ typedef struct
     int layer;
     int screen_height;
     int screen_width;
+    struct layer_state *state;
+    Display *display;		// private connection for window tracking
+    pthread_t x11_thread;
+    int x11_pipe[2];
+    uint64_t position;		// drawable origin on screen, see POSITION()
+    int users;			// the target and its queues, see target_put()
 } queue_target_ctx_t;
 
 typedef struct
@@ -117,6 +172,19 @@ typedef struct
 	VdpColor background;
 	device_ctx_t *device;
         VdpHandle device_hdl;
+
+	// flip thread, pending surfaces ordered by earliest presentation time
+	pthread_t flip_thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	int stop;
+	struct queue_entry *pending;
+	int pending_count;
+	VdpOutputSurface visible;
+	VdpTime last_vsync;
+	VdpTime vsync_period;
+	int no_vsync;
 } queue_ctx_t;
 
 typedef struct
@@ -142,6 +210,9 @@ typedef struct
 	float saturation;
 	float hue;
 	enum VdpauNVState vdpNvState;
+	VdpPresentationQueueStatus status;	// protected by the queue lock
+	VdpTime first_presentation_time;
+	int queued;
 } output_surface_ctx_t;
 
 #ifndef ARRAY_SIZE
@@ -183,6 +254,19 @@ VdpStatus new_decoder_mpeg12(decoder_ctx_t *decoder);
 VdpStatus new_decoder_h264(decoder_ctx_t *decoder);
 VdpStatus new_decoder_mpeg4(decoder_ctx_t *decoder);
 VdpStatus new_decoder_msmpeg4(decoder_ctx_t *decoder);
+void decoder_submit(decoder_ctx_t *decoder, video_surface_ctx_t *output, cedarv_done_fn done, void *arg);
+int decoder_find_startcode(decoder_ctx_t *decoder, unsigned int len, unsigned int pos, uint8_t *code);
+void decoder_scan_startcodes(decoder_ctx_t *dec, unsigned int pos, const uint8_t *data, unsigned int len, unsigned int *zeros);
+void decoder_upload_and_scan(decoder_ctx_t *dec, unsigned int pos, const uint8_t *data, unsigned int len, unsigned int *zeros);
+int decoder_scratch_lease(decoder_ctx_t *decoder, int size, CEDARV_MEMORY *mem);
+void decoder_scratch_return(decoder_ctx_t *decoder, CEDARV_MEMORY mem);
+void decoder_scratch_free(device_ctx_t *dev);
+int h264_mv_buffer_size(uint32_t width, uint32_t height);
+
+CEDARV_MEMORY surface_pool_get(device_ctx_t *dev, int size);
+void surface_pool_put(device_ctx_t *dev, CEDARV_MEMORY mem, int size);
+void surface_pool_free(device_ctx_t *dev);
+uint64_t get_time(void);
 
 void *handle_create(size_t size, VdpHandle *handle, enum HandleType type);
 void *handle_get(VdpHandle handle);
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Replays a VDPAU_CAPTURE file against libvdpau_sunxi and reports the
+ * latency of every replayed call.
+ *
+ *   vdpau_replay [-t] capture.bin
+ *
+ * Calls are issued back to back, with -t at their recorded timestamps.
+ * Only surface and decoder calls are replayed, mixer and presentation
+ * calls need a window and are skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <vdpau/vdpau.h>
+#include <vdpau/vdpau_x11.h>
+#include "capture.h"
+
+VdpStatus vdp_imp_device_create_x11(Display *display, int screen, VdpDevice *device, VdpGetProcAddress **get_proc_address);
+
+typedef VdpStatus video_surface_create_fn(VdpDevice, VdpChromaType, uint32_t, uint32_t, VdpVideoSurface *);
+typedef VdpStatus video_surface_destroy_fn(VdpVideoSurface);
+typedef VdpStatus video_surface_get_bits_fn(VdpVideoSurface, VdpYCbCrFormat, void *const *, uint32_t const *);
+typedef VdpStatus video_surface_put_bits_fn(VdpVideoSurface, VdpYCbCrFormat, void const *const *, uint32_t const *);
+typedef VdpStatus decoder_create_fn(VdpDevice, VdpDecoderProfile, uint32_t, uint32_t, uint32_t, VdpDecoder *);
+typedef VdpStatus decoder_destroy_fn(VdpDecoder);
+typedef VdpStatus decoder_render_fn(VdpDecoder, VdpVideoSurface, VdpPictureInfo const *, uint32_t, VdpBitstreamBuffer const *);
+typedef VdpStatus decoder_render_stream_fn(VdpDecoder, VdpVideoSurface, VdpPictureInfo const *, uint32_t, VdpBitstreamBuffer const *, uint32_t *);
+typedef VdpStatus decoder_set_video_control_data_fn(VdpDecoder, VdpDecoderControlDataId, VdpDecoderControlData *);
+typedef VdpStatus device_destroy_fn(VdpDevice);
+
+static struct
+{
+	VdpDevice device;
+	device_destroy_fn *device_destroy;
+	video_surface_create_fn *video_surface_create;
+	video_surface_destroy_fn *video_surface_destroy;
+	video_surface_get_bits_fn *video_surface_get_bits;
+	video_surface_put_bits_fn *video_surface_put_bits;
+	decoder_create_fn *decoder_create;
+	decoder_destroy_fn *decoder_destroy;
+	decoder_render_fn *decoder_render;
+	decoder_render_stream_fn *decoder_render_stream;
+	decoder_set_video_control_data_fn *decoder_set_video_control_data;
+} vdp;
+
+// captured handle -> replayed handle, handles are unique in their low 16 bits
+static struct
+{
+	uint32_t captured;
+	uint32_t handle;
+	uint32_t profile;
+	uint32_t height;
+} map[0x10000];
+
+static struct stats
+{
+	uint32_t func_id;
+	const char *name;
+	uint64_t *replayed;
+	uint64_t *captured;
+	unsigned int count;
+	unsigned int alloc;
+	unsigned int mismatches;
+} stats[] =
+{
+	{ VDP_FUNC_ID_VIDEO_SURFACE_CREATE, "video_surface_create" },
+	{ VDP_FUNC_ID_VIDEO_SURFACE_DESTROY, "video_surface_destroy" },
+	{ VDP_FUNC_ID_VIDEO_SURFACE_GET_BITS_Y_CB_CR, "video_surface_get_bits" },
+	{ VDP_FUNC_ID_VIDEO_SURFACE_PUT_BITS_Y_CB_CR, "video_surface_put_bits" },
+	{ VDP_FUNC_ID_DECODER_CREATE, "decoder_create" },
+	{ VDP_FUNC_ID_DECODER_DESTROY, "decoder_destroy" },
+	{ VDP_FUNC_ID_DECODER_SET_VIDEO_CONTROL_DATA, "decoder_set_control_data" },
+	{ VDP_FUNC_ID_DECODER_RENDER, "decoder_render" },
+	{ VDP_FUNC_ID_DECODER_RENDERSTREAM, "decoder_render_stream" },
+};
+
+static uint64_t get_time(void)
+{
+	struct timespec tp;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) == -1)
+		return 0;
+
+	return (uint64_t)tp.tv_sec * 1000000000ULL + (uint64_t)tp.tv_nsec;
+}
+
+static void map_add(uint32_t captured, uint32_t handle, uint32_t profile, uint32_t height)
+{
+	map[captured & 0xffff].captured = captured;
+	map[captured & 0xffff].handle = handle;
+	map[captured & 0xffff].profile = profile;
+	map[captured & 0xffff].height = height;
+}
+
+static int map_find(uint32_t captured)
+{
+	if (captured == VDP_INVALID_HANDLE || map[captured & 0xffff].captured != captured)
+		return -1;
+
+	return captured & 0xffff;
+}
+
+static uint32_t map_handle(uint32_t captured)
+{
+	int i = map_find(captured);
+	return i < 0 ? VDP_INVALID_HANDLE : map[i].handle;
+}
+
+static void map_remove(uint32_t captured)
+{
+	int i = map_find(captured);
+	if (i >= 0)
+		map[i].captured = VDP_INVALID_HANDLE;
+}
+
+static void stats_add(uint32_t func_id, uint64_t replayed, uint64_t captured, int mismatch)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+	{
+		struct stats *s = &stats[i];
+		if (s->func_id != func_id)
+			continue;
+
+		if (s->count == s->alloc)
+		{
+			s->alloc = s->alloc ? s->alloc * 2 : 256;
+			s->replayed = realloc(s->replayed, s->alloc * sizeof(uint64_t));
+			s->captured = realloc(s->captured, s->alloc * sizeof(uint64_t));
+			if (!s->replayed || !s->captured)
+			{
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+
+		s->replayed[s->count] = replayed;
+		s->captured[s->count] = captured;
+		s->count++;
+		s->mismatches += mismatch;
+		return;
+	}
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *sorted, unsigned int count, unsigned int p)
+{
+	return sorted[(uint64_t)(count - 1) * p / 100] / 1000.0;
+}
+
+static void stats_print(void)
+{
+	unsigned int i;
+
+	printf("%-26s %8s %10s %10s %10s %10s %12s %6s\n", "call", "count",
+	       "p50 us", "p90 us", "p99 us", "max us", "captured p50", "status");
+
+	for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+	{
+		struct stats *s = &stats[i];
+		if (!s->count)
+			continue;
+
+		qsort(s->replayed, s->count, sizeof(uint64_t), compare_u64);
+		qsort(s->captured, s->count, sizeof(uint64_t), compare_u64);
+
+		printf("%-26s %8u %10.1f %10.1f %10.1f %10.1f %12.1f %6u\n", s->name, s->count,
+		       percentile(s->replayed, s->count, 50), percentile(s->replayed, s->count, 90),
+		       percentile(s->replayed, s->count, 99), percentile(s->replayed, s->count, 100),
+		       percentile(s->captured, s->count, 50), s->mismatches);
+	}
+}
+
+static void remap_picture_info(uint32_t profile, void *info)
+{
+	int i;
+
+	switch (profile)
+	{
+	case VDP_DECODER_PROFILE_H264_BASELINE:
+	case VDP_DECODER_PROFILE_H264_MAIN:
+	case VDP_DECODER_PROFILE_H264_HIGH:
+	{
+		VdpPictureInfoH264 *h264 = info;
+		for (i = 0; i < 16; i++)
+			h264->referenceFrames[i].surface = map_handle(h264->referenceFrames[i].surface);
+		break;
+	}
+	case VDP_DECODER_PROFILE_MPEG1:
+	case VDP_DECODER_PROFILE_MPEG2_SIMPLE:
+	case VDP_DECODER_PROFILE_MPEG2_MAIN:
+	{
+		VdpPictureInfoMPEG1Or2 *mpeg12 = info;
+		mpeg12->forward_reference = map_handle(mpeg12->forward_reference);
+		mpeg12->backward_reference = map_handle(mpeg12->backward_reference);
+		break;
+	}
+	default:
+	{
+		VdpPictureInfoMPEG4Part2 *mpeg4 = info;
+		mpeg4->forward_reference = map_handle(mpeg4->forward_reference);
+		mpeg4->backward_reference = map_handle(mpeg4->backward_reference);
+		break;
+	}
+	}
+}
+
+static VdpStatus replay_surface_bits(const capture_record_t *rec, const capture_surface_bits_t *args)
+{
+	static void *planes[3];
+	static size_t planes_size[3];
+	int i, s = map_find(args->surface);
+
+	if (s < 0)
+		return VDP_STATUS_INVALID_HANDLE;
+
+	for (i = 0; i < 3; i++)
+	{
+		size_t size = (size_t)args->pitches[i] * map[s].height;
+		if (size > planes_size[i])
+		{
+			free(planes[i]);
+			planes[i] = calloc(1, size);
+			planes_size[i] = planes[i] ? size : 0;
+		}
+	}
+
+	if (rec->func_id == VDP_FUNC_ID_VIDEO_SURFACE_GET_BITS_Y_CB_CR)
+		return vdp.video_surface_get_bits(map[s].handle, args->format, planes, args->pitches);
+	else
+		return vdp.video_surface_put_bits(map[s].handle, args->format, (void const *const *)planes, args->pitches);
+}
+
+static VdpStatus replay_render(const capture_record_t *rec, uint8_t *payload)
+{
+	static VdpBitstreamBuffer *buffers;
+	static uint32_t buffers_alloc;
+	capture_render_t *args = (capture_render_t *)payload;
+	uint8_t *info = payload + sizeof(*args);
+	uint8_t *data = info + args->info_size;
+	uint32_t i, bitstream_pos;
+	int d = map_find(args->decoder);
+
+	if (d < 0)
+		return VDP_STATUS_INVALID_HANDLE;
+
+	if (args->buffer_count > buffers_alloc)
+	{
+		buffers_alloc = args->buffer_count;
+		buffers = realloc(buffers, buffers_alloc * sizeof(*buffers));
+		if (!buffers)
+			return VDP_STATUS_RESOURCES;
+	}
+
+	for (i = 0; i < args->buffer_count; i++)
+	{
+		memcpy(&buffers[i].bitstream_bytes, data, sizeof(uint32_t));
+		buffers[i].struct_version = VDP_BITSTREAM_BUFFER_VERSION;
+		buffers[i].bitstream = data + sizeof(uint32_t);
+		data += sizeof(uint32_t) + buffers[i].bitstream_bytes;
+	}
+
+	remap_picture_info(map[d].profile, info);
+
+	if (rec->func_id == VDP_FUNC_ID_DECODER_RENDER)
+		return vdp.decoder_render(map[d].handle, map_handle(args->target), info, args->buffer_count, buffers);
+	else
+		return vdp.decoder_render_stream(map[d].handle, map_handle(args->target), info, args->buffer_count, buffers, &bitstream_pos);
+}
+
+static int replay_call(const capture_record_t *rec, uint8_t *payload, VdpStatus *status)
+{
+	uint32_t handle;
+
+	switch (rec->func_id)
+	{
+	case VDP_FUNC_ID_VIDEO_SURFACE_CREATE:
+	{
+		capture_surface_create_t *args = (capture_surface_create_t *)payload;
+		*status = vdp.video_surface_create(vdp.device, args->chroma_type, args->width, args->height, &handle);
+		if (*status == VDP_STATUS_OK && rec->status == VDP_STATUS_OK)
+			map_add(rec->handle, handle, 0, args->height);
+		return 1;
+	}
+	case VDP_FUNC_ID_VIDEO_SURFACE_DESTROY:
+		*status = vdp.video_surface_destroy(map_handle(*(uint32_t *)payload));
+		map_remove(*(uint32_t *)payload);
+		return 1;
+	case VDP_FUNC_ID_VIDEO_SURFACE_GET_BITS_Y_CB_CR:
+	case VDP_FUNC_ID_VIDEO_SURFACE_PUT_BITS_Y_CB_CR:
+		*status = replay_surface_bits(rec, (capture_surface_bits_t *)payload);
+		return 1;
+	case VDP_FUNC_ID_DECODER_CREATE:
+	{
+		capture_decoder_create_t *args = (capture_decoder_create_t *)payload;
+		*status = vdp.decoder_create(vdp.device, args->profile, args->width, args->height, args->max_references, &handle);
+		if (*status == VDP_STATUS_OK && rec->status == VDP_STATUS_OK)
+			map_add(rec->handle, handle, args->profile, args->height);
+		return 1;
+	}
+	case VDP_FUNC_ID_DECODER_DESTROY:
+		*status = vdp.decoder_destroy(map_handle(*(uint32_t *)payload));
+		map_remove(*(uint32_t *)payload);
+		return 1;
+	case VDP_FUNC_ID_DECODER_SET_VIDEO_CONTROL_DATA:
+	{
+		capture_control_data_t *args = (capture_control_data_t *)payload;
+		*status = vdp.decoder_set_video_control_data(map_handle(args->decoder), args->id, &args->data);
+		return 1;
+	}
+	case VDP_FUNC_ID_DECODER_RENDER:
+	case VDP_FUNC_ID_DECODER_RENDERSTREAM:
+		*status = replay_render(rec, payload);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int device_open(void)
+{
+	VdpGetProcAddress *get_proc_address;
+
+	// do not capture the replay
+	unsetenv("VDPAU_CAPTURE");
+
+	if (vdp_imp_device_create_x11(NULL, 0, &vdp.device, &get_proc_address) != VDP_STATUS_OK)
+		return 0;
+
+#define GET_PROC(id, fn) \
+	if (get_proc_address(vdp.device, id, (void **)&vdp.fn) != VDP_STATUS_OK) \
+		return 0;
+
+	GET_PROC(VDP_FUNC_ID_DEVICE_DESTROY, device_destroy);
+	GET_PROC(VDP_FUNC_ID_VIDEO_SURFACE_CREATE, video_surface_create);
+	GET_PROC(VDP_FUNC_ID_VIDEO_SURFACE_DESTROY, video_surface_destroy);
+	GET_PROC(VDP_FUNC_ID_VIDEO_SURFACE_GET_BITS_Y_CB_CR, video_surface_get_bits);
+	GET_PROC(VDP_FUNC_ID_VIDEO_SURFACE_PUT_BITS_Y_CB_CR, video_surface_put_bits);
+	GET_PROC(VDP_FUNC_ID_DECODER_CREATE, decoder_create);
+	GET_PROC(VDP_FUNC_ID_DECODER_DESTROY, decoder_destroy);
+	GET_PROC(VDP_FUNC_ID_DECODER_RENDER, decoder_render);
+	GET_PROC(VDP_FUNC_ID_DECODER_RENDERSTREAM, decoder_render_stream);
+	GET_PROC(VDP_FUNC_ID_DECODER_SET_VIDEO_CONTROL_DATA, decoder_set_video_control_data);
+
+#undef GET_PROC
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	capture_header_t header;
+	capture_record_t rec;
+	uint8_t *payload = NULL;
+	uint32_t payload_alloc = 0;
+	unsigned int replayed = 0, skipped = 0;
+	int opt, timed = 0;
+	uint64_t start, begin;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "t")) != -1)
+	{
+		if (opt == 't')
+			timed = 1;
+		else
+			goto usage;
+	}
+
+	if (optind != argc - 1)
+		goto usage;
+
+	f = fopen(argv[optind], "rb");
+	if (!f)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION)
+	{
+		fprintf(stderr, "%s is not a capture file\n", argv[optind]);
+		return 1;
+	}
+
+	if (!device_open())
+	{
+		fprintf(stderr, "can not open vdpau device\n");
+		return 1;
+	}
+
+	memset(map, 0xff, sizeof(map));
+	start = get_time();
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1)
+	{
+		VdpStatus status;
+
+		if (rec.size > payload_alloc)
+		{
+			payload_alloc = rec.size;
+			payload = realloc(payload, payload_alloc);
+			if (!payload)
+			{
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+		}
+
+		if (rec.size && fread(payload, rec.size, 1, f) != 1)
+		{
+			fprintf(stderr, "truncated capture file\n");
+			break;
+		}
+
+		if (timed)
+		{
+			uint64_t now = get_time();
+			if (start + rec.time > now)
+				usleep((start + rec.time - now) / 1000);
+		}
+
+		// calls without payload were recorded for their timing only
+		begin = get_time();
+		if (rec.size == 0 || !replay_call(&rec, payload, &status))
+		{
+			skipped++;
+			continue;
+		}
+
+		stats_add(rec.func_id, get_time() - begin, rec.duration, status != rec.status);
+		replayed++;
+	}
+
+	fclose(f);
+	vdp.device_destroy(vdp.device);
+
+	printf("%u calls replayed in %.3f s, %u skipped\n", replayed, (get_time() - start) / 1e9, skipped);
+	stats_print();
+
+	free(payload);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-t] capture_file\n", argv[0]);
+	return 1;
+}
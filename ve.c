@@ -22,14 +22,20 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include "ve.h"
+#include "trace.h"
+#include "counters.h"
 
 #define DEVICE "/dev/cedar_dev"
 #define PAGE_OFFSET (0xc0000000) // from kernel
 #define PAGE_SIZE (4096)
+#define MEM_BINS (32)
+#define REGS_SIZE (0x800)
 
 enum IOCTL_CMD
 {
@@ -68,35 +74,245 @@ struct cedarv_cache_range
 	long end;
 };
 
+/*
+ * Everything that touches the kernel goes through a backend, either the
+ * real /dev/cedar_dev or a simulator that keeps registers and "physical"
+ * memory on the heap. VDPAU_VE_BACKEND=sim selects the simulator, which
+ * allows measuring the CPU side of decoding without a VE.
+ */
+struct ve_backend
+{
+	const char *name;
+	int (*open)(void);
+	void (*close)(int fd);
+	int (*ioctl)(int fd, int cmd, unsigned long arg);
+	void *(*mmap)(int fd, size_t size, uint32_t offset);
+	void (*munmap)(void *addr, size_t size);
+};
+
+static int hw_open(void)
+{
+	return open(DEVICE, O_RDWR);
+}
+
+static void hw_close(int fd)
+{
+	close(fd);
+}
+
+static int hw_ioctl(int fd, int cmd, unsigned long arg)
+{
+	return ioctl(fd, cmd, arg);
+}
+
+static void *hw_mmap(int fd, size_t size, uint32_t offset)
+{
+	return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+}
+
+static void hw_munmap(void *addr, size_t size)
+{
+	munmap(addr, size);
+}
+
+static const struct ve_backend hw_backend =
+{
+	.name = "cedar",
+	.open = hw_open,
+	.close = hw_close,
+	.ioctl = hw_ioctl,
+	.mmap = hw_mmap,
+	.munmap = hw_munmap,
+};
+
+#if USE_UMP == 0
+#define SIM_REGS_BASE (0x01c0e000)
+#define SIM_PHYS_BASE (0x10000000)
+#define SIM_VERSION (0x1623)
+
+static struct
+{
+	void *regs;
+	void *mem;
+	int mem_size;
+	int mpeg_log;
+	int mpeg_resync;
+} sim;
+
+static int sim_open(void)
+{
+	char *env_vdpau_sim_mem = getenv("VDPAU_SIM_MEM_MB");
+	sim.mem_size = (env_vdpau_sim_mem ? atoi(env_vdpau_sim_mem) : 64) * 1024 * 1024;
+
+	// "log" prints the position registers of every MPEG job, "resync"
+	// stops a job at the next resync marker like the VE does
+	char *env_vdpau_sim_mpeg = getenv("VDPAU_SIM_MPEG");
+	sim.mpeg_log = env_vdpau_sim_mpeg && strstr(env_vdpau_sim_mpeg, "log");
+	sim.mpeg_resync = env_vdpau_sim_mpeg && strstr(env_vdpau_sim_mpeg, "resync");
+
+	// anonymous memory stands in for the reserved area, pages are only
+	// populated when touched
+	sim.regs = calloc(1, REGS_SIZE);
+	sim.mem = mmap(NULL, sim.mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!sim.regs || sim.mem == MAP_FAILED)
+	{
+		if (sim.mem != MAP_FAILED)
+			munmap(sim.mem, sim.mem_size);
+		free(sim.regs);
+		return -1;
+	}
+
+	writel(SIM_VERSION << 16, sim.regs + CEDARV_VERSION);
+	return 0;
+}
+
+static void sim_close(int fd)
+{
+	free(sim.regs);
+	munmap(sim.mem, sim.mem_size);
+	sim.regs = NULL;
+	sim.mem = NULL;
+}
+
+static void sim_mpeg_job(void)
+{
+	uint32_t offset = readl(sim.regs + CEDARV_MPEG_VLD_OFFSET);
+	uint32_t end = offset + readl(sim.regs + CEDARV_MPEG_VLD_LEN);
+
+	if (sim.mpeg_log)
+		printf("ve sim: mpeg job mba 0x%04x qp %u offset %u trigger 0x%08x\n",
+		       readl(sim.regs + CEDARV_MPEG_MBA), readl(sim.regs + CEDARV_MPEG_QP_INPUT),
+		       offset, readl(sim.regs + CEDARV_MPEG_TRIGGER));
+
+	if (sim.mpeg_resync)
+	{
+		uint32_t addr = readl(sim.regs + CEDARV_MPEG_VLD_ADDR);
+		uint32_t phys = (addr & 0x0ffffff0) | ((addr & 0xf) << 28);
+		const uint8_t *data = (const uint8_t *)sim.mem + (phys - SIM_PHYS_BASE);
+		uint32_t byte;
+
+		// resync markers and start codes are byte aligned, at least 16
+		// zero bits and a one
+		if (phys >= SIM_PHYS_BASE && phys - SIM_PHYS_BASE + end / 8 <= sim.mem_size)
+			for (byte = (offset + 7) / 8; byte * 8 + 24 <= end; byte++)
+				if (data[byte] == 0x00 && data[byte + 1] == 0x00 && data[byte + 2] != 0x00)
+				{
+					end = byte * 8;
+					break;
+				}
+	}
+
+	writel(end, sim.regs + CEDARV_MPEG_VLD_OFFSET);
+}
+
+static int sim_ioctl(int fd, int cmd, unsigned long arg)
+{
+	switch (cmd)
+	{
+	case IOCTL_GET_ENV_INFO:
+		((struct ve_info *)arg)->registers = SIM_REGS_BASE;
+		((struct ve_info *)arg)->reserved_mem = SIM_PHYS_BASE + PAGE_OFFSET;
+		((struct ve_info *)arg)->reserved_mem_size = sim.mem_size;
+		return 0;
+
+	case IOCTL_WAIT_VE:
+		// every job finishes at once and consumes all of its MPEG input
+		if ((readl(sim.regs + CEDARV_CTRL) & 0xf) == CEDARV_ENGINE_MPEG)
+			sim_mpeg_job();
+		else
+			writel(readl(sim.regs + CEDARV_MPEG_VLD_OFFSET) + readl(sim.regs + CEDARV_MPEG_VLD_LEN),
+			       sim.regs + CEDARV_MPEG_VLD_OFFSET);
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static void *sim_mmap(int fd, size_t size, uint32_t offset)
+{
+	if (offset == SIM_REGS_BASE)
+		return sim.regs;
+
+	offset -= SIM_PHYS_BASE + PAGE_OFFSET;
+	if (offset + size > sim.mem_size)
+		return MAP_FAILED;
+
+	return sim.mem + offset;
+}
+
+static void sim_munmap(void *addr, size_t size)
+{
+}
+
+static const struct ve_backend sim_backend =
+{
+	.name = "sim",
+	.open = sim_open,
+	.close = sim_close,
+	.ioctl = sim_ioctl,
+	.mmap = sim_mmap,
+	.munmap = sim_munmap,
+};
+#endif
+
 struct memchunk_t
 {
 	uint32_t phys_addr;
 	int size;
 	void *virt_addr;
-	struct memchunk_t *next;
+	struct memchunk_t *prev, *next;
+	struct memchunk_t *free_prev, *free_next;
 };
 
 static struct ve_dev
 {
+	const struct ve_backend *backend;
 	int fd;
 	void *regs;
 	int version;
 #if USE_UMP == 0
 	struct memchunk_t first_memchunk;
+	struct memchunk_t *free_bins[MEM_BINS];
+	uint32_t free_mask;
+	struct memchunk_t **used;
+	int used_count;
+	int used_size;
 	pthread_rwlock_t memory_lock;
 #endif
 	pthread_mutex_t device_lock;
         int initialized;
         unsigned int refCnt;
+	uint32_t fence_submitted;
+	uint32_t fence_done;
+	cedarv_done_fn done;
+	void *done_arg;
+	int shadow_enabled;
+	int engine;
+	uint32_t reg_shadow[REGS_SIZE / 4];
+	uint8_t reg_valid[REGS_SIZE / 4];
+	struct
+	{
+		uint32_t words[CEDARV_TABLE_MAX_WORDS];
+		int count;
+	} table_shadow[CEDARV_TABLE_COUNT];
+	uint64_t lock_time;
+	uint64_t busy_start;
 } ve = { .fd = -1, 
 #if USE_UMP == 0
 	.memory_lock = PTHREAD_RWLOCK_INITIALIZER, 
 #endif
         .device_lock = PTHREAD_MUTEX_INITIALIZER,
         .initialized = 0,
-        .refCnt = 0
+        .refCnt = 0,
+	.fence_submitted = 0,
+	.fence_done = 0
 };
 
+#if USE_UMP == 0
+static void free_list_insert(struct memchunk_t *c);
+#endif
+
 int cedarv_open(void)
 {
         if (pthread_mutex_lock(&ve.device_lock))
@@ -111,20 +327,34 @@ int cedarv_open(void)
 
              struct ve_info info;
 
-             ve.fd = open(DEVICE, O_RDWR);
+	     TRACE_INIT();
+
+	     ve.backend = &hw_backend;
+	     char *env_vdpau_backend = getenv("VDPAU_VE_BACKEND");
+	     if (env_vdpau_backend && strcmp(env_vdpau_backend, "sim") == 0)
+	     {
+#if USE_UMP == 0
+		 ve.backend = &sim_backend;
+#else
+		 printf("VE simulator needs a build with USE_UMP=0\n");
+#endif
+	     }
+
+             ve.fd = ve.backend->open();
 	     if (ve.fd == -1)
              {
-		 printf("could not open %s\n", DEVICE);
+		 printf("could not open %s backend\n", ve.backend->name);
+		 pthread_mutex_unlock(&ve.device_lock);
 		 return 0;
 	     }
 
-	     if (ioctl(ve.fd, IOCTL_GET_ENV_INFO, (void *)(&info)) == -1)
+	     if (ve.backend->ioctl(ve.fd, IOCTL_GET_ENV_INFO, (unsigned long)&info) == -1)
 	     {
 		 printf("ioctl get_env_info failed!\n");
 		 goto err;
 	     }
 
-	     ve.regs = mmap(NULL, 0x800, PROT_READ | PROT_WRITE, MAP_SHARED, ve.fd, info.registers);
+	     ve.regs = ve.backend->mmap(ve.fd, REGS_SIZE, info.registers);
 	     if (ve.regs == MAP_FAILED)
 	     {
 		 printf("mmap failed!\n");
@@ -133,17 +363,23 @@ int cedarv_open(void)
 #if USE_UMP == 0
 	     ve.first_memchunk.phys_addr = info.reserved_mem - PAGE_OFFSET;
 	     ve.first_memchunk.size = info.reserved_mem_size;
+	     free_list_insert(&ve.first_memchunk);
 #endif
 
-	     ioctl(ve.fd, IOCTL_ENGINE_REQ, 0);
-             ioctl(ve.fd, IOCTL_ENABLE_VE, 0);
-	     ioctl(ve.fd, IOCTL_SET_VE_FREQ, 320);
-	     ioctl(ve.fd, IOCTL_RESET_VE, 0);
+	     ve.backend->ioctl(ve.fd, IOCTL_ENGINE_REQ, 0);
+	     ve.backend->ioctl(ve.fd, IOCTL_ENABLE_VE, 0);
+	     ve.backend->ioctl(ve.fd, IOCTL_SET_VE_FREQ, 320);
+	     ve.backend->ioctl(ve.fd, IOCTL_RESET_VE, 0);
 
 	     writel(0x00130007, ve.regs + CEDARV_CTRL);
 
 	     ve.version = readl(ve.regs + CEDARV_VERSION) >> 16;
 
+	     char *env_vdpau_shadow = getenv("VDPAU_VE_SHADOW");
+	     ve.shadow_enabled = !(env_vdpau_shadow && strncmp(env_vdpau_shadow, "0", 1) == 0);
+	     ve.engine = -1;
+	     cedarv_shadow_invalidate();
+
 #if USE_UMP
 	     if(ump_open() != UMP_OK)
 	     {
@@ -151,6 +387,7 @@ int cedarv_open(void)
 	          goto err;
 	     }
 #endif
+	     counters_init();
              ve.initialized = 1;
         }
         ve.refCnt ++;
@@ -159,7 +396,7 @@ int cedarv_open(void)
 	return 1;
 
 err:
-	close(ve.fd);
+	ve.backend->close(ve.fd);
 	ve.fd = -1;
         pthread_mutex_unlock(&ve.device_lock);
 
@@ -173,17 +410,20 @@ void cedarv_close(void)
 	    if (ve.fd == -1)
 		return;
 
-            ioctl(ve.fd, IOCTL_DISABLE_VE, 0);
-	    ioctl(ve.fd, IOCTL_ENGINE_REL, 0);
+	    cedarv_sync(ve.fence_submitted);
 
-	    munmap(ve.regs, 0x800);
+	    ve.backend->ioctl(ve.fd, IOCTL_DISABLE_VE, 0);
+	    ve.backend->ioctl(ve.fd, IOCTL_ENGINE_REL, 0);
+
+	    ve.backend->munmap(ve.regs, REGS_SIZE);
 	    ve.regs = NULL;
 
-	    close(ve.fd);
+	    ve.backend->close(ve.fd);
 	    ve.fd = -1;
 #if USE_UMP
 	    ump_close();
 #endif
+	    counters_close();
             ve.initialized = 0;
         }
 }
@@ -193,27 +433,183 @@ int cedarv_get_version(void)
 	return ve.version;
 }
 
+static uint64_t ve_time(void)
+{
+	struct timespec tp;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) == -1)
+		return 0;
+
+	return (uint64_t)tp.tv_sec * 1000000000ULL + (uint64_t)tp.tv_nsec;
+}
+
 int cedarv_wait(int timeout)
 {
+	int ret;
+
 	if (ve.fd == -1)
 		return 0;
 
-	return ioctl(ve.fd, IOCTL_WAIT_VE, timeout);
+	TRACE_BEGIN(t);
+	ret = ve.backend->ioctl(ve.fd, IOCTL_WAIT_VE, timeout);
+	TRACE_END(t, "cedarv_wait");
+
+	if (ret <= 0)
+		COUNTER_INC(ve_wait_timeouts);
+
+	return ret;
+}
+
+static int fence_signaled(uint32_t fence)
+{
+	return (int32_t)(ve.fence_done - fence) >= 0;
+}
+
+// finish the job left running by cedarv_submit(), device_lock must be held
+static void cedarv_complete(void)
+{
+	if (fence_signaled(ve.fence_submitted))
+		return;
+
+	cedarv_wait(1);
+	COUNTER_ADD(ve_busy_ns, ve_time() - ve.busy_start);
+
+	if (ve.done)
+		ve.done(ve.regs, ve.done_arg);
+
+	ve.done = NULL;
+	ve.done_arg = NULL;
+	ve.fence_done = ve.fence_submitted;
+
+	writel(0x00130007, ve.regs + CEDARV_CTRL);
 }
 
 void *cedarv_get(int engine, uint32_t flags)
 {
+	TRACE_BEGIN(t);
+
 	if (pthread_mutex_lock(&ve.device_lock))
 		return NULL;
 
+	cedarv_complete();
+
+	// lock wait and completion of the previous job, then the hold time
+	TRACE_END(t, "cedarv_get");
+	TRACE_MARK(ve.lock_time);
+	ve.busy_start = ve_time();
+
+	if (engine != ve.engine)
+	{
+		cedarv_shadow_invalidate();
+		ve.engine = engine;
+	}
+
 	writel(0x00130000 | (engine & 0xf) | (flags & ~0xf), ve.regs + CEDARV_CTRL);
 
 	return ve.regs;
 }
 
+/*
+ * Returns 1 if the table already holds these words, the upload can be
+ * skipped. Otherwise the shadow is updated and the caller has to upload.
+ * Only call while holding the engine.
+ */
+int cedarv_table_cached(enum cedarv_table table, const uint32_t *words, int count)
+{
+	if (ve.shadow_enabled && ve.table_shadow[table].count == count &&
+	    memcmp(ve.table_shadow[table].words, words, count * sizeof(uint32_t)) == 0)
+	{
+		COUNTER_INC(shadow_hits);
+		return 1;
+	}
+
+	COUNTER_INC(shadow_misses);
+	if (count > CEDARV_TABLE_MAX_WORDS)
+	{
+		ve.table_shadow[table].count = 0;
+		return 0;
+	}
+
+	memcpy(ve.table_shadow[table].words, words, count * sizeof(uint32_t));
+	ve.table_shadow[table].count = count;
+	return 0;
+}
+
+// for configuration registers only, never for triggers or status
+void cedarv_writel_cached(uint32_t val, int reg)
+{
+	if (ve.shadow_enabled && ve.reg_valid[reg / 4] && ve.reg_shadow[reg / 4] == val)
+	{
+		COUNTER_INC(shadow_hits);
+		return;
+	}
+
+	COUNTER_INC(shadow_misses);
+	writel(val, ve.regs + reg);
+	ve.reg_shadow[reg / 4] = val;
+	ve.reg_valid[reg / 4] = 1;
+}
+
+void cedarv_shadow_invalidate(void)
+{
+	int i;
+
+	memset(ve.reg_valid, 0, sizeof(ve.reg_valid));
+	for (i = 0; i < CEDARV_TABLE_COUNT; i++)
+		ve.table_shadow[i].count = 0;
+}
+
 void cedarv_put(void)
 {
 	writel(0x00130007, ve.regs + CEDARV_CTRL);
+	COUNTER_ADD(ve_busy_ns, ve_time() - ve.busy_start);
+	TRACE_END(ve.lock_time, "cedarv_hold");
+	pthread_mutex_unlock(&ve.device_lock);
+}
+
+/*
+ * Releases the engine after a job has been triggered without waiting for
+ * it. The returned fence is signaled once the interrupt has been handled
+ * and done() has run, either by cedarv_sync() or by the next cedarv_get().
+ */
+uint32_t cedarv_submit(cedarv_done_fn done, void *arg)
+{
+	uint32_t fence;
+
+	ve.done = done;
+	ve.done_arg = arg;
+	fence = ++ve.fence_submitted;
+	if (fence == 0)
+		fence = ++ve.fence_submitted;
+
+	TRACE_END(ve.lock_time, "cedarv_hold");
+	pthread_mutex_unlock(&ve.device_lock);
+	return fence;
+}
+
+void cedarv_sync(uint32_t fence)
+{
+	if (fence == 0)
+		return;
+
+	if (pthread_mutex_lock(&ve.device_lock))
+		return;
+
+	if (!fence_signaled(fence))
+		cedarv_complete();
+
+	pthread_mutex_unlock(&ve.device_lock);
+}
+
+// waits for the last submitted job, before memory it may use is freed
+void cedarv_sync_all(void)
+{
+	if (pthread_mutex_lock(&ve.device_lock))
+		return;
+
+	if (ve.fence_submitted && !fence_signaled(ve.fence_submitted))
+		cedarv_complete();
+
 	pthread_mutex_unlock(&ve.device_lock);
 }
 
@@ -232,6 +628,8 @@ CEDARV_MEMORY cedarv_malloc(int size)
     printf("could not allocate ump buffer!\n");
     exit(1);
   }
+  COUNTER_ADD(mem_bytes, ump_size_get(mem.mem_id));
+  COUNTER_INC(mem_allocs);
   return mem;
 }
 
@@ -242,6 +640,8 @@ int cedarv_isValid(CEDARV_MEMORY mem)
 
 void cedarv_free(CEDARV_MEMORY mem)
 {
+  if (mem.mem_id != UMP_INVALID_MEMORY_HANDLE)
+    COUNTER_SUB(mem_bytes, ump_size_get(mem.mem_id));
   ump_reference_release(mem.mem_id);
 }
 
@@ -286,55 +686,177 @@ void cedarv_setBufferInvalid(CEDARV_MEMORY mem)
 
 #else
 
+static int mem_bin(int size)
+{
+	int bin = 31 - __builtin_clz(size / PAGE_SIZE);
+	return bin < MEM_BINS ? bin : MEM_BINS - 1;
+}
+
+static void free_list_insert(struct memchunk_t *c)
+{
+	int bin = mem_bin(c->size);
+
+	c->free_prev = NULL;
+	c->free_next = ve.free_bins[bin];
+	if (c->free_next)
+		c->free_next->free_prev = c;
+	ve.free_bins[bin] = c;
+	ve.free_mask |= (1u << bin);
+}
+
+static void free_list_remove(struct memchunk_t *c)
+{
+	int bin = mem_bin(c->size);
+
+	if (c->free_prev)
+		c->free_prev->free_next = c->free_next;
+	else
+		ve.free_bins[bin] = c->free_next;
+	if (c->free_next)
+		c->free_next->free_prev = c->free_prev;
+	if (!ve.free_bins[bin])
+		ve.free_mask &= ~(1u << bin);
+}
+
+// index of the last used chunk with virt_addr <= ptr, -1 if none
+static int used_find(const void *ptr)
+{
+	int lo = 0, hi = ve.used_count - 1, found = -1;
+
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (ve.used[mid]->virt_addr <= ptr)
+		{
+			found = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+
+	return found;
+}
+
+static int used_insert(struct memchunk_t *c)
+{
+	if (ve.used_count == ve.used_size)
+	{
+		int new_size = ve.used_size ? ve.used_size * 2 : 64;
+		struct memchunk_t **new_used = realloc(ve.used, new_size * sizeof(*new_used));
+		if (!new_used)
+			return 0;
+
+		ve.used = new_used;
+		ve.used_size = new_size;
+	}
+
+	int i = used_find(c->virt_addr) + 1;
+	memmove(&ve.used[i + 1], &ve.used[i], (ve.used_count - i) * sizeof(*ve.used));
+	ve.used[i] = c;
+	ve.used_count++;
+
+	return 1;
+}
+
+static void used_remove(int i)
+{
+	ve.used_count--;
+	memmove(&ve.used[i], &ve.used[i + 1], (ve.used_count - i) * sizeof(*ve.used));
+}
+
+static struct memchunk_t *used_lookup(const void *ptr)
+{
+	int i = used_find(ptr);
+
+	if (i < 0 || ptr >= ve.used[i]->virt_addr + ve.used[i]->size)
+		return NULL;
+
+	return ve.used[i];
+}
+
 void *cedarv_malloc(int size)
 {
 	if (ve.fd == -1)
 		return NULL;
 
+	if (size <= 0)
+		return NULL;
+
 	if (pthread_rwlock_wrlock(&ve.memory_lock))
 		return NULL;
 
 	void *addr = NULL;
 
 	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	int bin = mem_bin(size);
 	struct memchunk_t *c, *best_chunk = NULL;
-	for (c = &ve.first_memchunk; c != NULL; c = c->next)
+
+	// best fit within the own size class
+	for (c = ve.free_bins[bin]; c != NULL; c = c->free_next)
 	{
-		if(c->virt_addr == NULL && c->size >= size)
+		if (c->size >= size && (best_chunk == NULL || c->size < best_chunk->size))
 		{
-			if (best_chunk == NULL || c->size < best_chunk->size)
-				best_chunk = c;
-
+			best_chunk = c;
 			if (c->size == size)
 				break;
 		}
 	}
 
+	// otherwise every chunk of a bigger class fits
+	if (!best_chunk)
+	{
+		uint32_t mask = bin < MEM_BINS - 1 ? ve.free_mask & ~((2u << bin) - 1) : 0;
+		if (mask)
+			best_chunk = ve.free_bins[__builtin_ctz(mask)];
+	}
+
 	if (!best_chunk)
 		goto out;
 
-	int left_size = best_chunk->size - size;
+	// the chunk must not stay bigger than its mapping, split it or fail
+	struct memchunk_t *rest = NULL;
+	if (best_chunk->size > size && !(rest = malloc(sizeof(struct memchunk_t))))
+		goto out;
 
-	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ve.fd, best_chunk->phys_addr + PAGE_OFFSET);
+	addr = ve.backend->mmap(ve.fd, size, best_chunk->phys_addr + PAGE_OFFSET);
 	if (addr == MAP_FAILED)
 	{
+		free(rest);
 		addr = NULL;
 		goto out;
 	}
 
+	free_list_remove(best_chunk);
 	best_chunk->virt_addr = addr;
-	best_chunk->size = size;
 
-	if (left_size > 0)
+	if (!used_insert(best_chunk))
+	{
+		ve.backend->munmap(addr, size);
+		best_chunk->virt_addr = NULL;
+		free_list_insert(best_chunk);
+		free(rest);
+		addr = NULL;
+		goto out;
+	}
+
+	if (rest)
 	{
-		c = malloc(sizeof(struct memchunk_t));
-		c->phys_addr = best_chunk->phys_addr + size;
-		c->size = left_size;
-		c->virt_addr = NULL;
-		c->next = best_chunk->next;
-		best_chunk->next = c;
+		rest->phys_addr = best_chunk->phys_addr + size;
+		rest->size = best_chunk->size - size;
+		rest->virt_addr = NULL;
+		rest->prev = best_chunk;
+		rest->next = best_chunk->next;
+		if (rest->next)
+			rest->next->prev = rest;
+		best_chunk->next = rest;
+		best_chunk->size = size;
+		free_list_insert(rest);
 	}
 
+	COUNTER_ADD(mem_bytes, best_chunk->size);
+	COUNTER_INC(mem_allocs);
+
 out:
 	pthread_rwlock_unlock(&ve.memory_lock);
 	return addr;
@@ -355,31 +877,42 @@ void cedarv_free(void *ptr)
 	if (pthread_rwlock_wrlock(&ve.memory_lock))
 		return;
 
-	struct memchunk_t *c;
-	for (c = &ve.first_memchunk; c != NULL; c = c->next)
+	int i = used_find(ptr);
+	if (i < 0 || ve.used[i]->virt_addr != ptr)
+		goto out;
+
+	struct memchunk_t *c = ve.used[i];
+	used_remove(i);
+	COUNTER_SUB(mem_bytes, c->size);
+	ve.backend->munmap(ptr, c->size);
+	c->virt_addr = NULL;
+
+	if (c->next && c->next->virt_addr == NULL)
 	{
-		if (c->virt_addr == ptr)
-		{
-			munmap(ptr, c->size);
-			c->virt_addr = NULL;
-			break;
-		}
+		struct memchunk_t *n = c->next;
+		free_list_remove(n);
+		c->size += n->size;
+		c->next = n->next;
+		if (c->next)
+			c->next->prev = c;
+		free(n);
 	}
 
-	for (c = &ve.first_memchunk; c != NULL; c = c->next)
+	if (c->prev && c->prev->virt_addr == NULL)
 	{
-		if (c->virt_addr == NULL)
-		{
-			while (c->next != NULL && c->next->virt_addr == NULL)
-			{
-				struct memchunk_t *n = c->next;
-				c->size += n->size;
-				c->next = n->next;
-				free(n);
-			}
-		}
+		struct memchunk_t *p = c->prev;
+		free_list_remove(p);
+		p->size += c->size;
+		p->next = c->next;
+		if (p->next)
+			p->next->prev = p;
+		free(c);
+		c = p;
 	}
 
+	free_list_insert(c);
+
+out:
 	pthread_rwlock_unlock(&ve.memory_lock);
 }
 
@@ -393,28 +926,29 @@ uint32_t cedarv_virt2phys(void *ptr)
 
 	uint32_t addr = 0;
 
-	struct memchunk_t *c;
-	for (c = &ve.first_memchunk; c != NULL; c = c->next)
-	{
-		if (c->virt_addr == NULL)
-			continue;
-
-		if (c->virt_addr == ptr)
-		{
-			addr = c->phys_addr;
-			break;
-		}
-		else if (ptr > c->virt_addr && ptr < (c->virt_addr + c->size))
-		{
-			addr = c->phys_addr + (ptr - c->virt_addr);
-			break;
-		}
-	}
+	struct memchunk_t *c = used_lookup(ptr);
+	if (c)
+		addr = c->phys_addr + (ptr - c->virt_addr);
 
 	pthread_rwlock_unlock(&ve.memory_lock);
 	return addr;
 }
 
+size_t cedarv_getSize(void *mem)
+{
+	if (pthread_rwlock_rdlock(&ve.memory_lock))
+		return 0;
+
+	size_t size = 0;
+
+	struct memchunk_t *c = used_lookup(mem);
+	if (c)
+		size = c->size - (mem - c->virt_addr);
+
+	pthread_rwlock_unlock(&ve.memory_lock);
+	return size;
+}
+
 void cedarv_flush_cache(void *start, int len)
 {
 	if (ve.fd == -1)
@@ -426,7 +960,7 @@ void cedarv_flush_cache(void *start, int len)
 		.end = (int)(start + len)
 	};
 
-	ioctl(ve.fd, IOCTL_FLUSH_CACHE, (void*)(&range));
+	ve.backend->ioctl(ve.fd, IOCTL_FLUSH_CACHE, (unsigned long)&range);
 }
 
 void cedarv_memcpy(void* dst, size_t offset, const void * src, size_t len)
@@ -434,6 +968,11 @@ void cedarv_memcpy(void* dst, size_t offset, const void * src, size_t len)
 	memcpy((char*)dst + offset, src, len);
 }
 
+void cedarv_memset(void* dst, unsigned char value, size_t len)
+{
+	memset(dst, value, len);
+}
+
 void* cedarv_getPointer(CEDARV_MEMORY mem)
 {
   return mem;
@@ -30,6 +30,29 @@ void *cedarv_get(int engine, uint32_t flags);
 void cedarv_put(void);
 void* cedarv_get_regs();
 
+typedef void (*cedarv_done_fn)(void *regs, void *arg);
+uint32_t cedarv_submit(cedarv_done_fn done, void *arg);
+void cedarv_sync(uint32_t fence);
+void cedarv_sync_all(void);
+
+/*
+ * Shadow copies of what was last written to the VE while holding the
+ * engine. They are dropped whenever a different engine is selected.
+ */
+enum cedarv_table
+{
+	CEDARV_TABLE_MPEG_IQ,
+	CEDARV_TABLE_H264_SCALING_LISTS,
+	CEDARV_TABLE_H264_PRED_WEIGHT,
+	CEDARV_TABLE_COUNT
+};
+
+#define CEDARV_TABLE_MAX_WORDS 192
+
+int cedarv_table_cached(enum cedarv_table table, const uint32_t *words, int count);
+void cedarv_writel_cached(uint32_t val, int reg);
+void cedarv_shadow_invalidate(void);
+
 #if USE_UMP
   #include <ump/ump.h>
   #include <ump/ump_ref_drv.h>
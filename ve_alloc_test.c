@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2013 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Runs the USE_UMP=0 allocator of ve.c on the simulator backend, whose
+ * reserved memory is an anonymous mapping. For growing numbers of live
+ * buffers it checks that buffers do not overlap, that interior pointers
+ * translate to the right physical address and that freed memory merges
+ * again, and prints the cost per cedarv_malloc, cedarv_virt2phys and
+ * cedarv_free.
+ *
+ *   ve_alloc_test [max_buffers]
+ *
+ * Exits with 1 if a check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "ve.h"
+
+// about 600 kB per buffer on average, the pool holds MAX_BUFFERS of them
+#define POOL_MB 1024
+#define MAX_BUFFERS 1024
+#define LOOKUPS_PER_BUFFER 64
+
+struct buffer
+{
+	uint8_t *virt;
+	uint32_t phys;
+	int size;
+};
+
+// surface planes, motion vector and scratch buffers of typical streams
+static const int sizes[] = {
+	1920 * 1088, 1920 * 1088 / 2, 1280 * 736, 1280 * 736 / 2,
+	720 * 576, 720 * 576 / 2, 120 * 68 * 64, 64 * 1024, 16 * 1024, 4 * 1024,
+};
+
+static uint64_t now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static int cmp_phys(const void *a, const void *b)
+{
+	const struct buffer *x = a, *y = b;
+	return x->phys < y->phys ? -1 : x->phys > y->phys;
+}
+
+static int alloc_buffer(struct buffer *b)
+{
+	b->size = sizes[rand() % (sizeof(sizes) / sizeof(sizes[0]))];
+	b->virt = cedarv_malloc(b->size);
+	if (!b->virt)
+	{
+		fprintf(stderr, "cedarv_malloc(%d) failed\n", b->size);
+		return 0;
+	}
+
+	b->phys = cedarv_virt2phys(b->virt);
+	if (b->phys == 0 || (b->phys & 0xfff) || cedarv_getSize(b->virt) < (size_t)b->size)
+	{
+		fprintf(stderr, "bad buffer %p phys 0x%08x size %zu\n", b->virt, b->phys, cedarv_getSize(b->virt));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int check_overlap(struct buffer *buf, int count)
+{
+	int i;
+	struct buffer *sorted = malloc(count * sizeof(*sorted));
+	if (!sorted)
+		return 0;
+
+	for (i = 0; i < count; i++)
+		sorted[i] = buf[i];
+	qsort(sorted, count, sizeof(*sorted), cmp_phys);
+
+	for (i = 1; i < count; i++)
+	{
+		if (sorted[i - 1].phys + sorted[i - 1].size > sorted[i].phys)
+		{
+			fprintf(stderr, "buffers at 0x%08x and 0x%08x overlap\n", sorted[i - 1].phys, sorted[i].phys);
+			free(sorted);
+			return 0;
+		}
+	}
+
+	free(sorted);
+	return 1;
+}
+
+static int run(int count)
+{
+	int i, n = count, ret = 0;
+	uint64_t t, t_malloc, t_lookup, t_free;
+	struct buffer *buf = calloc(count, sizeof(*buf));
+	uint32_t *offsets = malloc(count * LOOKUPS_PER_BUFFER * sizeof(*offsets));
+	if (!buf || !offsets)
+		goto out;
+
+	t = now();
+	for (i = 0; i < count; i++)
+		if (!alloc_buffer(&buf[i]))
+			goto out;
+	t_malloc = now() - t;
+
+	// free and refill every other buffer, so the pool is fragmented
+	for (i = 0; i < count; i += 2)
+	{
+		cedarv_free(buf[i].virt);
+		buf[i].virt = NULL;
+	}
+	for (i = 0; i < count; i += 2)
+		if (!alloc_buffer(&buf[i]))
+			goto out;
+
+	if (!check_overlap(buf, count))
+		goto out;
+
+	for (i = 0; i < count * LOOKUPS_PER_BUFFER; i++)
+		offsets[i] = rand();
+
+	t = now();
+	for (i = 0; i < count * LOOKUPS_PER_BUFFER; i++)
+	{
+		struct buffer *b = &buf[offsets[i] % count];
+		uint32_t offset = offsets[i] % b->size;
+		if (cedarv_virt2phys(b->virt + offset) != b->phys + offset)
+		{
+			fprintf(stderr, "virt2phys(%p + %u) != 0x%08x\n", b->virt, offset, b->phys + offset);
+			goto out;
+		}
+	}
+	t_lookup = now() - t;
+
+	t = now();
+	for (i = 0; i < count; i++)
+		cedarv_free(buf[i].virt);
+	t_free = now() - t;
+	count = 0;
+
+	// everything merged back into one chunk
+	void *all = cedarv_malloc(POOL_MB * 1024 * 1024);
+	if (!all)
+	{
+		fprintf(stderr, "freed memory did not merge\n");
+		goto out;
+	}
+	cedarv_free(all);
+
+	printf("%8d %10.0f %10.1f %10.0f\n", n, (double)t_malloc / n,
+	       (double)t_lookup / (n * LOOKUPS_PER_BUFFER), (double)t_free / n);
+	ret = 1;
+
+out:
+	for (i = 0; i < count; i++)
+		cedarv_free(buf[i].virt);
+	free(offsets);
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char pool[16];
+	int count, max = argc > 1 ? atoi(argv[1]) : MAX_BUFFERS;
+
+	if (max < 16 || max > MAX_BUFFERS)
+	{
+		fprintf(stderr, "usage: %s [max_buffers], 16 to %d\n", argv[0], MAX_BUFFERS);
+		return 1;
+	}
+
+	snprintf(pool, sizeof(pool), "%d", POOL_MB);
+	setenv("VDPAU_VE_BACKEND", "sim", 1);
+	setenv("VDPAU_SIM_MEM_MB", pool, 1);
+
+	if (!cedarv_open())
+	{
+		fprintf(stderr, "could not open the VE simulator\n");
+		return 1;
+	}
+
+	srand(1);
+	printf("%8s %10s %10s %10s\n", "buffers", "malloc_ns", "lookup_ns", "free_ns");
+	for (count = 16; count <= max; count *= 2)
+	{
+		if (!run(count))
+		{
+			cedarv_close();
+			return 1;
+		}
+	}
+
+	cedarv_close();
+	return 0;
+}